@@ -4,73 +4,25 @@
 // Author:  Sonny Chan, University of Calgary
 // Date:    December 2015
 // ==========================================================================
-#version 410
-
-// interpolated colour received from vertex stage
-in vec2 textureCoords;
-
-// first output is mapped to the framebuffer's colour index by default
-out vec4 FragmentColour;
-
-// our texture to read from
-uniform sampler2DRect tex;
-uniform int blur;
-
-
-// constant values
-const float PI = 3.14159265;
-const vec2 texOffset = vec2(1.5, 1.5);
-
-void main(void)
+// One pass of a separable Gaussian: (1, 0) blurs rows, (0, 1) columns.
+// Taps are precomputed on the CPU; each one after the centre is a bilinear
+// fetch placed between two texels so that it returns their weighted sum.
+// This file is pasted into the pass shaders generated by the effect
+// pipeline, which provide Sample() to read the pass input and define the
+// kernel as constants, so the loop below unrolls completely.
+const vec2 direction = BLUR_DIRECTION;
+const float weights[BLUR_TAPS + 1] = float[](BLUR_WEIGHTS);
+const float offsets[BLUR_TAPS + 1] = float[](BLUR_OFFSETS);
+
+vec4 Blur(vec2 textureCoords)
 {
-	// Don't bother doing the calculations if not blurring
-	if(blur == 0)
+	vec4 sum = Sample(textureCoords) * weights[0];
+	for (int i = 1; i <= BLUR_TAPS; i++)
 	{
-		FragmentColour = texture(tex, textureCoords);;
-		return;
-	}
-
-	float sigma;
-	float numBlurPixelsPerSide;
-
-	// Populate with selected blur values
-	if(blur == 1)
-	{
-		sigma = 1.5;
-		numBlurPixelsPerSide = 1.0;
-	}
-	else if(blur == 2)
-	{
-		sigma = 1.96;
-		numBlurPixelsPerSide = 2.0;
-	}
-	else if(blur == 3)
-	{
-		sigma = 2.56;
-		numBlurPixelsPerSide = 3.0;
-	}
-
-	vec4 avgValue = vec4(0.0f, 0.0f, 0.0f, 0.0f);
-	float coefficientSum = 0.0f;
-
-	// Incremental Gaussian Coefficent Calculation
-	vec3 incrementalGaussian;
-	incrementalGaussian.x = 1.0f / (sqrt(2.0f * PI) * sigma);
-	incrementalGaussian.y = exp(-0.5f / (sigma * sigma));
-	incrementalGaussian.z = incrementalGaussian.y * incrementalGaussian.y;
-	
-	// First take the sample of the centre
-	avgValue += texture(tex, textureCoords) * incrementalGaussian.x;
-	coefficientSum += incrementalGaussian.x;
-	incrementalGaussian.xy *= incrementalGaussian.yz;
-	
-	// Go through the remaining samples
-	for (float i = 1.0f; i <= numBlurPixelsPerSide; i++) { 
-		avgValue += texture(tex, textureCoords - i * texOffset) * incrementalGaussian.x;         
-		avgValue += texture(tex, textureCoords + i * texOffset) * incrementalGaussian.x;         
-		coefficientSum += 2 * incrementalGaussian.x;
-		incrementalGaussian.xy *= incrementalGaussian.yz;
+		vec2 offset = offsets[i] * direction;
+		sum += Sample(textureCoords - offset) * weights[i];
+		sum += Sample(textureCoords + offset) * weights[i];
 	}
 
-	FragmentColour = avgValue / coefficientSum;
+	return sum;
 }
@@ -12,14 +12,73 @@
 
 #include <iostream>
 #include <fstream>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cctype>
+#include <csignal>
 #include <algorithm>
 #include <string>
 #include <iterator>
+#include <complex>
 #include <vector>
+#include <map>
+#include <list>
+#include <set>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <csetjmp>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <direct.h>
+#include <sys/stat.h>
+#include <sys/utime.h>
+#include <io.h>
+#include <fcntl.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/stat.h>
+#include <utime.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 
 #define _USE_MATH_DEFINES
 #include <math.h>
 
+// SIMD kernels for the CPU effect engine are only built for x86, and are
+// compiled per function so the program still runs on older processors
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define CPU_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CPU_TARGET(features)
+#else
+#define CPU_TARGET(features) __attribute__((target(features)))
+#endif
+#endif
+
 // specify that we want the OpenGL core profile before including GLFW headers
 #ifdef _WIN32
 #include <glad/glad.h>
@@ -31,11 +90,30 @@
 #include <GLFW/glfw3.h>
 #endif
 
+// stb_image allocates through a pool so that decoded images recycle each
+// other's pixel buffers instead of going back to the heap every switch
+void *PixelPoolMalloc(size_t size);
+void *PixelPoolRealloc(void *block, size_t size);
+void PixelPoolFree(void *block);
+#define STBI_MALLOC(size) PixelPoolMalloc(size)
+#define STBI_REALLOC(block, size) PixelPoolRealloc(block, size)
+#define STBI_FREE(block) PixelPoolFree(block)
+
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include <stb_image_write.h>
 
+// optional streaming decoders and encoder for images processed in strips;
+// without them PNG and JPEG files are decoded whole by stb_image, and PNGs
+// written a strip at a time are left uncompressed
+#ifdef HAVE_LIBPNG
+#include <png.h>
+#endif
+#ifdef HAVE_LIBJPEG
+#include <jpeglib.h>
+#endif
+
 using namespace std;
 // --------------------------------------------------------------------------
 // OpenGL utility and support function prototypes
@@ -55,10 +133,71 @@ enum Effect {
    EFFECT4,
 };
 
+// largest convolution kernel side, in pixels
+static const int MAX_CONVOLUTION_SIZE = 63;
+
+// one effect as selected with the c/f/b keys or on the command line
+struct EffectStage
+{
+   // "colour", "filter", "blur" or "convolve", and the effect number within
+   // it (always EFFECT1 for convolve)
+   string shaderName;
+   int mode;
+
+   // blur only: Gaussian sigma overriding the mode's preset when positive
+   float blurSigma;
+
+   // convolve only: kernelWidth x kernelHeight weights, top row first and
+   // centred on the pixel, an offset added to the result, whether the kernel
+   // is applied to luminance rather than to each channel, and the name it
+   // was given on the command line
+   vector<float> kernel;
+   int kernelWidth;
+   int kernelHeight;
+   float kernelBias;
+   bool kernelLuminance;
+   string kernelName;
+
+   EffectStage(const string &shaderName = "colour", int mode = NO_EFFECT)
+      : shaderName(shaderName), mode(mode), blurSigma(0.0f),
+        kernelWidth(0), kernelHeight(0), kernelBias(0.0f), kernelLuminance(false)
+   {}
+};
+
+// checks the effect names a known shader and one of its modes
+bool IsValidEffect(const EffectStage &stage)
+{
+   if (stage.shaderName == "convolve")
+      return stage.mode == EFFECT1 && stage.kernelWidth >= 1 && stage.kernelHeight >= 1 &&
+         stage.kernelWidth <= MAX_CONVOLUTION_SIZE && stage.kernelHeight <= MAX_CONVOLUTION_SIZE &&
+         stage.kernel.size() == static_cast<size_t>(stage.kernelWidth) * stage.kernelHeight;
+
+   int modes = stage.shaderName == "colour" ? 5 : 4;
+   return (stage.shaderName == "colour" || stage.shaderName == "filter" || stage.shaderName == "blur")
+      && stage.mode >= 0 && stage.mode < modes;
+}
+
+// how an effect is named in messages and benchmark results
+string EffectLabel(const EffectStage &stage)
+{
+   return stage.shaderName == "convolve" ? "convolve:" + stage.kernelName : stage.shaderName;
+}
+
+// Images selectable with keys 1-6, unless others are given with --image
+static const char *defaultImageFileNames_[] = {
+   "images/image1-mandrill.png",
+   "images/image2-uclogo.png",
+   "images/image3-aerial.jpg",
+   "images/image4-thirsk.jpg",
+   "images/image5-pattern.png",
+   "images/image6-edc2016.jpg",
+};
+static vector<string> imageFileNames_(defaultImageFileNames_, defaultImageFileNames_ + 6);
+static int imageCount_ = 6;
+
 // Current image state variables
 static int currImageNum_ = 0;
-static string currImageFileName_ = "images/image1-mandrill.png";
-static string currShaderFileName_ = "colourFragment.glsl";
+static string currImageFileName_ = imageFileNames_[0];
 
 // State per image
 static vector<Effect> colourEffects_;
@@ -67,33 +206,322 @@ static vector<Effect> blurs_;
 
 // Current global state variables
 static double prevCoords_[2];
-static bool shaderChanged_ = true;
 static bool isDragging_ = false;
 
-// Vertices
-static vector<GLfloat> vertices;
+// whether the contact sheet is shown instead of the current image, and which
+// of its pages
+static bool galleryMode_ = false;
+static int galleryPage_ = 0;
+
+// set whenever what is on screen is out of date; the main loop only draws
+// when it is set and otherwise sleeps until the next event
+static bool redraw_ = true;
+
+// Accumulated view transform, uploaded to the vertex shader as a single
+// model/view matrix. Rotation is kept as a whole number of PI/8 steps so
+// repeated key presses never accumulate floating point error.
+struct ViewTransform
+{
+   GLfloat panX;
+   GLfloat panY;
+   GLfloat zoom;
+   int     rotationSteps;
+
+   ViewTransform() : panX(0.0f), panY(0.0f), zoom(1.0f), rotationSteps(0)
+   {}
+};
+
+static ViewTransform view_;
+
+// --------------------------------------------------------------------------
+// Profiler: CPU timers usable from any thread and GL_TIME_ELAPSED queries on
+// the render thread, summarised on stdout as rolling statistics and
+// optionally recorded for a Chrome trace (chrome://tracing or Perfetto)
+
+struct TraceEvent
+{
+   string name;
+   string detail;
+   int thread;
+   bool gpu;
+
+   // microseconds since the profiler started
+   double start;
+   double duration;
+};
+
+struct ProfileStat
+{
+   int count;
+   double total;
+   double shortest;
+   double longest;
+
+   ProfileStat() : count(0), total(0.0), shortest(0.0), longest(0.0)
+   {}
+};
+
+// a GL_TIME_ELAPSED query and the frame it was issued in
+struct GpuTimer
+{
+   GLuint query;
+   string name;
+   string detail;
+   double start;
+   int frame;
+};
+
+struct Profiler
+{
+   bool enabled;
+   chrono::high_resolution_clock::time_point origin;
+
+   // statistics since the last report, and the trace if one was asked for
+   mutex lock;
+   map<string, ProfileStat> stats;
+   double lastReport;
+   double reportInterval;
+   string tracePath;
+   vector<TraceEvent> events;
+   map<thread::id, int> threads;
+
+   // queries waiting for their results, oldest first, and spare query names
+   deque<GpuTimer> pendingQueries;
+   vector<GLuint> spareQueries;
+   bool gpuTimerOpen;
+   int frame;
+
+   Profiler() : enabled(false), origin(chrono::high_resolution_clock::now()), lastReport(0.0),
+      reportInterval(2.0), gpuTimerOpen(false), frame(0)
+   {}
+};
+
+static Profiler profiler_;
+
+// traces are capped so that a long session cannot exhaust memory
+static const size_t MAX_TRACE_EVENTS = 1 << 20;
+
+// microseconds since the profiler started
+double ProfileNow()
+{
+   return chrono::duration<double, micro>(chrono::high_resolution_clock::now() - profiler_.origin).count();
+}
+
+// records a finished span; start and duration are in microseconds
+void RecordProfileEvent(const string &name, const string &detail, bool gpu, double start, double duration)
+{
+   lock_guard<mutex> guard(profiler_.lock);
+   ProfileStat &stat = profiler_.stats[gpu ? "gpu " + name : name];
+   stat.shortest = stat.count ? min(stat.shortest, duration) : duration;
+   stat.longest = max(stat.longest, duration);
+   stat.total += duration;
+   stat.count++;
+
+   if (profiler_.tracePath.empty() || profiler_.events.size() >= MAX_TRACE_EVENTS)
+      return;
+   map<thread::id, int>::iterator it = profiler_.threads.find(this_thread::get_id());
+   if (it == profiler_.threads.end())
+      it = profiler_.threads.insert(make_pair(this_thread::get_id(), static_cast<int>(profiler_.threads.size()))).first;
+
+   TraceEvent event;
+   event.name = name;
+   event.detail = detail;
+   event.thread = it->second;
+   event.gpu = gpu;
+   event.start = start;
+   event.duration = duration;
+   profiler_.events.push_back(event);
+}
+
+// CPU timers: keep the value from ProfileBegin and hand it to ProfileEnd
+double ProfileBegin()
+{
+   return profiler_.enabled ? ProfileNow() : 0.0;
+}
+
+void ProfileEnd(const string &name, double start, const string &detail = "")
+{
+   if (profiler_.enabled)
+      RecordProfileEvent(name, detail, false, start, ProfileNow() - start);
+}
+
+// GPU timers measure the GL commands issued between the two calls on the
+// render thread. They cannot nest; a timer started while another is open is
+// ignored.
+void BeginGpuTimer(const string &name, const string &detail = "")
+{
+   if (!profiler_.enabled || profiler_.gpuTimerOpen) return;
+
+   GpuTimer timer;
+   if (profiler_.spareQueries.empty())
+      glGenQueries(1, &timer.query);
+   else
+   {
+      timer.query = profiler_.spareQueries.back();
+      profiler_.spareQueries.pop_back();
+   }
+   timer.name = name;
+   timer.detail = detail;
+   timer.start = ProfileNow();
+   timer.frame = profiler_.frame;
+   glBeginQuery(GL_TIME_ELAPSED, timer.query);
+   profiler_.pendingQueries.push_back(timer);
+   profiler_.gpuTimerOpen = true;
+}
+
+void EndGpuTimer()
+{
+   if (!profiler_.gpuTimerOpen) return;
+   glEndQuery(GL_TIME_ELAPSED);
+   profiler_.gpuTimerOpen = false;
+}
+
+// reads back the queries of earlier frames that have finished. The current
+// frame's queries are left alone, so results are at least a frame old and
+// the CPU never waits on the GPU, unless finishing is set.
+void CollectGpuTimers(bool finishing = false)
+{
+   while (!profiler_.pendingQueries.empty())
+   {
+      GpuTimer &timer = profiler_.pendingQueries.front();
+      if (!finishing)
+      {
+         if (timer.frame == profiler_.frame) break;
+         GLint available = 0;
+         glGetQueryObjectiv(timer.query, GL_QUERY_RESULT_AVAILABLE, &available);
+         if (!available) break;
+      }
+
+      GLuint64 nanoseconds = 0;
+      glGetQueryObjectui64v(timer.query, GL_QUERY_RESULT, &nanoseconds);
+      RecordProfileEvent(timer.name, timer.detail, true, timer.start, nanoseconds / 1000.0);
+      profiler_.spareQueries.push_back(timer.query);
+      profiler_.pendingQueries.pop_front();
+   }
+   profiler_.frame++;
+}
+
+// prints and resets the statistics once the report interval has passed, or
+// straight away when forced
+void ReportProfile(bool force = false)
+{
+   if (!profiler_.enabled) return;
+   double now = ProfileNow();
+   if (!force && now - profiler_.lastReport < profiler_.reportInterval * 1e6) return;
+
+   lock_guard<mutex> guard(profiler_.lock);
+   if (!profiler_.stats.empty())
+   {
+      cout << "Profile over " << fixed << setprecision(1) << (now - profiler_.lastReport) / 1e6
+         << " s (count, mean/min/max ms):" << endl;
+      for (map<string, ProfileStat>::iterator it = profiler_.stats.begin(); it != profiler_.stats.end(); ++it)
+      {
+         const ProfileStat &stat = it->second;
+         cout << "   " << left << setw(32) << it->first << right << setw(6) << stat.count << setprecision(3)
+            << setw(10) << stat.total / stat.count / 1000.0 << setw(10) << stat.shortest / 1000.0
+            << setw(10) << stat.longest / 1000.0 << endl;
+      }
+      cout.unsetf(ios::fixed);
+      cout << setprecision(6);
+   }
+   profiler_.stats.clear();
+   profiler_.lastReport = now;
+}
+
+// escapes a string for a JSON literal
+string JsonString(const string &text)
+{
+   string escaped = "\"";
+   for (size_t i = 0; i < text.size(); i++)
+   {
+      if (text[i] == '"' || text[i] == '\\')
+         escaped += '\\';
+      if (static_cast<unsigned char>(text[i]) < 0x20)
+         escaped += ' ';
+      else
+         escaped += text[i];
+   }
+   return escaped + "\"";
+}
+
+// writes the recorded events in the Chrome trace event format. GPU spans are
+// placed at the time their commands were issued, on a track of their own.
+bool WriteTraceFile()
+{
+   if (profiler_.tracePath.empty()) return true;
+   ofstream output(profiler_.tracePath.c_str());
+   if (!output)
+   {
+      cout << "Unable to write trace file: " << profiler_.tracePath << endl;
+      return false;
+   }
+
+   lock_guard<mutex> guard(profiler_.lock);
+   output << "{\"traceEvents\":[\n";
+   output << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1000,\"args\":{\"name\":\"GPU\"}}";
+   output << fixed << setprecision(3);
+   for (size_t i = 0; i < profiler_.events.size(); i++)
+   {
+      const TraceEvent &event = profiler_.events[i];
+      output << ",\n{\"name\":" << JsonString(event.name) << ",\"cat\":\"" << (event.gpu ? "gpu" : "cpu")
+         << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << (event.gpu ? 1000 : event.thread)
+         << ",\"ts\":" << event.start << ",\"dur\":" << event.duration;
+      if (!event.detail.empty())
+         output << ",\"args\":{\"detail\":" << JsonString(event.detail) << "}";
+      output << "}";
+   }
+   output << "\n]}\n";
+   cout << "Wrote " << profiler_.events.size() << " trace events to " << profiler_.tracePath << endl;
+   return true;
+}
+
+// collects the last GPU timings, prints the final statistics and writes the
+// trace; needs the GL context if GPU timers were used
+void FinishProfile()
+{
+   if (!profiler_.enabled) return;
+   CollectGpuTimers(true);
+   for (size_t i = 0; i < profiler_.spareQueries.size(); i++)
+      glDeleteQueries(1, &profiler_.spareQueries[i]);
+   profiler_.spareQueries.clear();
+   ReportProfile(true);
+   WriteTraceFile();
+}
 
 // --------------------------------------------------------------------------
 // Functions to set up OpenGL shader programs for rendering
 
 struct MyShader
 {
-   // OpenGL names for vertex and fragment shaders, shader program
+   // OpenGL names for vertex and fragment shaders, or the compute shader of
+   // a compute program, shader program
    GLuint  vertex;
    GLuint  fragment;
+   GLuint  compute;
    GLuint  program;
 
+   // location of the model/view matrix uniform in the vertex shader
+   GLint   modelViewUniform;
+
    // initialize shader and program names to zero (OpenGL reserved value)
-   MyShader() : vertex(0), fragment(0), program(0)
+   MyShader() : vertex(0), fragment(0), compute(0), program(0), modelViewUniform(-1)
    {}
 };
 
-// load, compile, and link shaders, returning true if successful
-bool InitializeShaders(MyShader *shader, string shaderName)
+// whether the context runs compute shaders (OpenGL 4.3). Without a loader
+// built for 4.3 they are left out altogether.
+bool ComputeShadersAvailable()
+{
+#ifdef GL_VERSION_4_3
+   return GLAD_GL_VERSION_4_3 != 0;
+#else
+   return false;
+#endif
+}
+
+// compile and link shader sources, returning true if successful
+bool InitializeShaders(MyShader *shader, const string &vertexSource, const string &fragmentSource)
 {
-   // load shader source from files
-   string vertexSource = LoadSource("vertex.glsl");
-   string fragmentSource = LoadSource(shaderName);
    if (vertexSource.empty() || fragmentSource.empty()) return false;
 
    // compile shader source into shader objects
@@ -102,11 +530,29 @@ bool InitializeShaders(MyShader *shader, string shaderName)
 
    // link shader program
    shader->program = LinkProgram(shader->vertex, shader->fragment);
+   shader->modelViewUniform = glGetUniformLocation(shader->program, "modelView");
 
    // check for OpenGL errors and return false if error occurred
    return !CheckGLErrors();
 }
 
+// compile and link a compute shader, returning true if successful
+bool InitializeComputeShader(MyShader *shader, const string &computeSource)
+{
+#ifdef GL_VERSION_4_3
+   if (computeSource.empty() || !ComputeShadersAvailable()) return false;
+
+   shader->compute = CompileShader(GL_COMPUTE_SHADER, computeSource);
+   shader->program = LinkProgram(shader->compute, 0);
+
+   GLint status = GL_FALSE;
+   glGetProgramiv(shader->program, GL_LINK_STATUS, &status);
+   return status == GL_TRUE && !CheckGLErrors();
+#else
+   return false;
+#endif
+}
+
 // deallocate shader-related objects
 void DestroyShaders(MyShader *shader)
 {
@@ -115,222 +561,7750 @@ void DestroyShaders(MyShader *shader)
    glDeleteProgram(shader->program);
    glDeleteShader(shader->vertex);
    glDeleteShader(shader->fragment);
+   glDeleteShader(shader->compute);
 }
 
 // --------------------------------------------------------------------------
-// Functions to set up OpenGL buffers for storing textures
+// Shader registry keeping every program resident, backed by an on-disk
+// cache of linked program binaries
 
-struct MyTexture
+struct ShaderRegistry
 {
-   GLuint textureID;
-   GLuint target;
-   int width;
-   int height;
+   // resident programs by name, e.g. "pass:>filter>colour" for a generated
+   // effect pipeline pass
+   map<string, MyShader> programs;
 
-   // initialize object names to zero (OpenGL reserved value)
-   MyTexture() : textureID(0), target(0), width(0), height(0)
+   // directory holding cached program binaries, and the driver identity the
+   // binaries are only valid for
+   string cacheDirectory;
+   string driverString;
+   bool binariesSupported;
+
+   // statistics for the startup report
+   int binaryHits;
+   int compiles;
+
+   ShaderRegistry() : binariesSupported(false), binaryHits(0), compiles(0)
    {}
 };
 
-bool InitializeTexture(MyTexture* texture, const char* filename, GLuint target = GL_TEXTURE_2D)
+// 64-bit FNV-1a hash, used to key cached binaries by their source text
+unsigned long long HashString(const string &text, unsigned long long hash = 14695981039346656037ULL)
 {
-   int numComponents;
-   stbi_set_flip_vertically_on_load(true);
-   unsigned char *data = stbi_load(filename, &texture->width, &texture->height, &numComponents, 0);
-   if (data != nullptr)
+   for (size_t i = 0; i < text.size(); i++)
    {
-      texture->target = target;
-      glEnable(texture->target);
-      glGenTextures(1, &texture->textureID);
-      glBindTexture(texture->target, texture->textureID);
-      GLuint format = numComponents == 3 ? GL_RGB : GL_RGBA;
-      glTexImage2D(texture->target, 0, format, texture->width, texture->height, 0, format, GL_UNSIGNED_BYTE, data);
-
-      // Note: Only wrapping modes supported for GL_TEXTURE_RECTANGLE when defining
-      // GL_TEXTURE_WRAP are GL_CLAMP_TO_EDGE or GL_CLAMP_TO_BORDER
-      glTexParameteri(texture->target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-      glTexParameteri(texture->target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-      glTexParameteri(texture->target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-      glTexParameteri(texture->target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-      // Clean up
-      glBindTexture(texture->target, 0);
-      stbi_image_free(data);
-      return !CheckGLErrors();
+      hash ^= static_cast<unsigned char>(text[i]);
+      hash *= 1099511628211ULL;
    }
-   return true; //error
+   return hash;
 }
 
-// deallocate texture-related objects
-void DestroyTexture(MyTexture *texture)
+void MakeDirectory(const string &path)
 {
-   glBindTexture(texture->target, 0);
-   glDeleteTextures(1, &texture->textureID);
+#ifdef _WIN32
+   _mkdir(path.c_str());
+#else
+   mkdir(path.c_str(), 0755);
+#endif
+}
+
+// whether files can be created in the directory at path
+bool DirectoryWritable(const string &path)
+{
+#ifdef _WIN32
+   return _access(path.c_str(), 2) == 0;
+#else
+   return access(path.c_str(), W_OK | X_OK) == 0;
+#endif
+}
+
+// prepares the registry and its cache directory for the current context
+void InitializeShaderRegistry(ShaderRegistry *registry, const string &cacheDirectory)
+{
+   registry->cacheDirectory = cacheDirectory;
+   registry->driverString = string(reinterpret_cast<const char *>(glGetString(GL_VENDOR))) + "|"
+      + reinterpret_cast<const char *>(glGetString(GL_RENDERER)) + "|"
+      + reinterpret_cast<const char *>(glGetString(GL_VERSION));
+
+   GLint formats = 0;
+   glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+   registry->binariesSupported = formats > 0;
+   if (registry->binariesSupported)
+      MakeDirectory(cacheDirectory);
+}
+
+string ProgramBinaryPath(ShaderRegistry *registry, const string &vertexSource, const string &fragmentSource)
+{
+   unsigned long long hash = HashString(registry->driverString);
+   hash = HashString(vertexSource, hash);
+   hash = HashString(string(1, '\0'), hash);
+   hash = HashString(fragmentSource, hash);
+
+   ostringstream path;
+   path << registry->cacheDirectory << "/" << hex << setw(16) << setfill('0') << hash << ".bin";
+   return path.str();
+}
+
+// tries to create a program from a cached binary, returning 0 on a miss or
+// if the driver rejects the binary
+GLuint LoadProgramBinary(const string &path)
+{
+   ifstream input(path.c_str(), ios::binary);
+   if (!input) return 0;
+
+   GLenum format = 0;
+   if (!input.read(reinterpret_cast<char *>(&format), sizeof(format))) return 0;
+   vector<char> binary((istreambuf_iterator<char>(input)), istreambuf_iterator<char>());
+   if (binary.empty()) return 0;
+
+   GLuint program = glCreateProgram();
+   glProgramBinary(program, format, binary.data(), static_cast<GLsizei>(binary.size()));
+
+   GLint status;
+   glGetProgramiv(program, GL_LINK_STATUS, &status);
+   if (status == GL_FALSE)
+   {
+      // stale binary, e.g. after a driver update that kept the version string
+      glDeleteProgram(program);
+      return 0;
+   }
+   return program;
+}
+
+void SaveProgramBinary(const string &path, GLuint program)
+{
+   GLint length = 0;
+   glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+   if (length <= 0) return;
+
+   vector<char> binary(length);
+   GLenum format = 0;
+   glGetProgramBinary(program, length, &length, &format, binary.data());
+
+   ofstream output(path.c_str(), ios::binary);
+   if (!output) return;
+   output.write(reinterpret_cast<const char *>(&format), sizeof(format));
+   output.write(binary.data(), length);
+}
+
+// builds a named program from the given sources, using the binary cache when
+// possible, and keeps it resident in the registry
+bool AddShaderProgram(ShaderRegistry *registry, const string &name,
+                      const string &vertexSource, const string &fragmentSource)
+{
+   if (vertexSource.empty() || fragmentSource.empty()) return false;
+
+   MyShader shader;
+   double start = ProfileBegin();
+   string binaryPath = ProgramBinaryPath(registry, vertexSource, fragmentSource);
+   if (registry->binariesSupported)
+      shader.program = LoadProgramBinary(binaryPath);
+
+   if (shader.program)
+   {
+      registry->binaryHits++;
+      shader.modelViewUniform = glGetUniformLocation(shader.program, "modelView");
+      ProfileEnd("load program binary", start, name);
+   }
+   else
+   {
+      registry->compiles++;
+      if (!InitializeShaders(&shader, vertexSource, fragmentSource))
+         return false;
+      if (registry->binariesSupported)
+         SaveProgramBinary(binaryPath, shader.program);
+      ProfileEnd("compile", start, name);
+   }
+
+   registry->programs[name] = shader;
+   return !CheckGLErrors();
+}
+
+// builds a named compute program like AddShaderProgram; fails without
+// compute shader support
+bool AddComputeProgram(ShaderRegistry *registry, const string &name, const string &computeSource)
+{
+   if (computeSource.empty() || !ComputeShadersAvailable()) return false;
+
+   MyShader shader;
+   double start = ProfileBegin();
+   string binaryPath = ProgramBinaryPath(registry, "compute", computeSource);
+   if (registry->binariesSupported)
+      shader.program = LoadProgramBinary(binaryPath);
+
+   if (shader.program)
+   {
+      registry->binaryHits++;
+      ProfileEnd("load program binary", start, name);
+   }
+   else
+   {
+      registry->compiles++;
+      if (!InitializeComputeShader(&shader, computeSource))
+      {
+         DestroyShaders(&shader);
+         return false;
+      }
+      if (registry->binariesSupported)
+         SaveProgramBinary(binaryPath, shader.program);
+      ProfileEnd("compile", start, name);
+   }
+
+   registry->programs[name] = shader;
+   return !CheckGLErrors();
+}
+
+// returns the resident program with the given name, or null if unknown
+MyShader *FindShaderProgram(ShaderRegistry *registry, const string &name)
+{
+   map<string, MyShader>::iterator it = registry->programs.find(name);
+   return it == registry->programs.end() ? 0 : &it->second;
 }
 
-void SaveImage(const char* filename, int width, int height, unsigned char *data, int numComponents = 3, int stride = 0)
+void DestroyShaderRegistry(ShaderRegistry *registry)
 {
-   if (!stbi_write_png(filename, width, height, numComponents, data, stride))
-      cout << "Unable to save image: " << filename << endl;
+   for (map<string, MyShader>::iterator it = registry->programs.begin(); it != registry->programs.end(); ++it)
+      DestroyShaders(&it->second);
+   registry->programs.clear();
 }
 
 // --------------------------------------------------------------------------
-// Functions to set up OpenGL buffers for storing geometry data
+// Pooled pixel buffer allocator backing stb_image. Large blocks are kept on
+// release and handed out again to later decodes of a similar size.
 
-struct MyGeometry
+struct PixelPool
 {
-   // OpenGL names for array buffer objects, vertex array object
-   GLuint  vertexBuffer;
-   GLuint  textureBuffer;
-   GLuint  colourBuffer;
-   GLuint  vertexArray;
-   GLsizei elementCount;
+   mutex lock;
+   multimap<size_t, void *> freeBlocks;
+   size_t pooledBytes;
 
-   // initialize object names to zero (OpenGL reserved value)
-   MyGeometry() : vertexBuffer(0), colourBuffer(0), vertexArray(0), elementCount(0)
+   PixelPool() : pooledBytes(0)
+   {}
+};
+
+static PixelPool pixelPool_;
+
+// blocks smaller than this go straight to the heap, and at most this many
+// bytes are held back for reuse
+static const size_t POOL_MIN_BLOCK = 1 << 20;
+static const size_t POOL_MAX_BYTES = 256 << 20;
+
+// every block carries its capacity in a header, keeping the payload 16-byte aligned
+static const size_t POOL_HEADER = 16;
+
+void *PixelPoolMalloc(size_t size)
+{
+   if (size >= POOL_MIN_BLOCK)
+   {
+      lock_guard<mutex> guard(pixelPool_.lock);
+
+      // reuse a block that is big enough without wasting more than half of it
+      multimap<size_t, void *>::iterator it = pixelPool_.freeBlocks.lower_bound(size);
+      if (it != pixelPool_.freeBlocks.end() && it->first <= size * 2)
+      {
+         void *block = it->second;
+         pixelPool_.pooledBytes -= it->first;
+         pixelPool_.freeBlocks.erase(it);
+         return static_cast<char *>(block) + POOL_HEADER;
+      }
+   }
+
+   char *block = static_cast<char *>(malloc(size + POOL_HEADER));
+   if (!block) return 0;
+   *reinterpret_cast<size_t *>(block) = size;
+   return block + POOL_HEADER;
+}
+
+void PixelPoolFree(void *pointer)
+{
+   if (!pointer) return;
+   char *block = static_cast<char *>(pointer) - POOL_HEADER;
+   size_t capacity = *reinterpret_cast<size_t *>(block);
+
+   if (capacity >= POOL_MIN_BLOCK)
+   {
+      lock_guard<mutex> guard(pixelPool_.lock);
+      if (pixelPool_.pooledBytes + capacity <= POOL_MAX_BYTES)
+      {
+         pixelPool_.freeBlocks.insert(make_pair(capacity, static_cast<void *>(block)));
+         pixelPool_.pooledBytes += capacity;
+         return;
+      }
+   }
+   free(block);
+}
+
+void *PixelPoolRealloc(void *pointer, size_t size)
+{
+   if (!pointer) return PixelPoolMalloc(size);
+
+   size_t capacity = *reinterpret_cast<size_t *>(static_cast<char *>(pointer) - POOL_HEADER);
+   if (size <= capacity) return pointer;
+
+   void *resized = PixelPoolMalloc(size);
+   if (!resized) return 0;
+   memcpy(resized, pointer, capacity);
+   PixelPoolFree(pointer);
+   return resized;
+}
+
+// --------------------------------------------------------------------------
+// Decoded images and their mip pyramids
+
+// images too large to show as one texture are drawn as tiles of this size,
+// from a pyramid of levels that ends with one fitting in a single tile
+static const int TILE_SIZE = 256;
+
+// one level of an image's mip pyramid, half the size of the level before,
+// with rows bottom first like the image itself
+struct MipLevel
+{
+   int width;
+   int height;
+   unsigned char *pixels;
+
+   MipLevel() : width(0), height(0), pixels(0)
    {}
 };
 
-void createImageWithAspectRatio(MyTexture& texture)
+struct DecodedImage
+{
+   string filename;
+   int width;
+   int height;
+   int numComponents;
+   unsigned char *pixels;
+
+   // levels below full resolution, only built for images shown as tiles
+   vector<MipLevel> mips;
+
+   // the file mapping the pixels point into when they came from the pixel
+   // cache, rather than from the pixel pool
+   void *mapping;
+   size_t mappingBytes;
+
+   DecodedImage() : width(0), height(0), numComponents(0), pixels(0), mapping(0), mappingBytes(0)
+   {}
+};
+
+int ImageLevelCount(const DecodedImage *image)
+{
+   return 1 + static_cast<int>(image->mips.size());
+}
+
+// level 0 is the decoded image itself
+MipLevel ImageLevel(const DecodedImage *image, int level)
+{
+   if (level > 0)
+      return image->mips[level - 1];
+
+   MipLevel base;
+   base.width = image->width;
+   base.height = image->height;
+   base.pixels = image->pixels;
+   return base;
+}
+
+// appends levels averaging 2x2 blocks of the level before until one fits in
+// a single tile; odd sizes repeat their last row or column
+void BuildMipPyramid(DecodedImage *image)
+{
+   double start = ProfileBegin();
+   int n = image->numComponents;
+   MipLevel source = ImageLevel(image, 0);
+   while (source.width > TILE_SIZE || source.height > TILE_SIZE)
+   {
+      MipLevel level;
+      level.width = (source.width + 1) / 2;
+      level.height = (source.height + 1) / 2;
+      level.pixels = static_cast<unsigned char *>(PixelPoolMalloc(static_cast<size_t>(level.width) * level.height * n));
+      if (!level.pixels)
+      {
+         cout << "Out of memory building levels for " << image->filename << endl;
+         break;
+      }
+
+      for (int y = 0; y < level.height; y++)
+      {
+         const unsigned char *row0 = source.pixels + static_cast<size_t>(2 * y) * source.width * n;
+         const unsigned char *row1 = source.pixels + static_cast<size_t>(min(2 * y + 1, source.height - 1)) * source.width * n;
+         unsigned char *out = level.pixels + static_cast<size_t>(y) * level.width * n;
+         for (int x = 0; x < level.width; x++)
+         {
+            int x0 = 2 * x * n;
+            int x1 = min(2 * x + 1, source.width - 1) * n;
+            for (int c = 0; c < n; c++)
+               out[x * n + c] = static_cast<unsigned char>((row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) / 4);
+         }
+      }
+      image->mips.push_back(level);
+      source = level;
+   }
+   ProfileEnd("build pyramid", start, image->filename);
+}
+
+// --------------------------------------------------------------------------
+// Cache of decoded pixels in a raw format that is mapped straight into
+// memory, so loading an image again costs page faults instead of a PNG or
+// JPEG decode. Each entry is a header followed by the rows bottom first and
+// tightly packed, exactly as DecodeImage returns them. Entries are touched
+// when they are used, and once the cache directory outgrows its byte budget
+// the least recently used ones are removed.
+
+struct PixelCacheHeader
+{
+   char magic[8];
+   int width;
+   int height;
+   int numComponents;
+   int rowStride;
+
+   // size and modification time of the source in nanoseconds, to notice it
+   // changing
+   long long sourceSize;
+   long long sourceTime;
+};
+
+static const char PIXEL_CACHE_MAGIC[8] = { 'R', 'A', 'W', 'P', 'I', 'X', '0', '2' };
+
+// the pixels start this far into an entry, keeping them aligned for SIMD loads
+static const size_t PIXEL_CACHE_HEADER = 64;
+
+struct PixelCache
+{
+   // where entries are kept; empty keeps each next to its source as FILE.raw
+   bool enabled;
+   string directory;
+
+   // bytes the directory may hold; entries kept beside their images are not
+   // counted. residentBytes is -1 until the directory has been scanned, and
+   // is only an estimate between scans
+   long long budgetBytes;
+   long long residentBytes;
+   mutex trimLock;
+
+   // statistics reported on exit, updated by the decode workers
+   mutex lock;
+   int hits;
+   int misses;
+   int evictions;
+
+   PixelCache() : enabled(true), directory("pixelcache"), budgetBytes(2048LL << 20), residentBytes(-1),
+                  hits(0), misses(0), evictions(0)
+   {}
+};
+
+static PixelCache pixelCache_;
+
+// reads a file's size and modification time in nanoseconds, returning false
+// if it is missing. _stat64 only has whole seconds, so on Windows a rewrite
+// of the same size within a second goes unnoticed
+bool FileStamp(const string &path, long long *size, long long *time)
+{
+#ifdef _WIN32
+   struct _stat64 info;
+   if (_stat64(path.c_str(), &info) != 0) return false;
+   *time = static_cast<long long>(info.st_mtime) * 1000000000;
+#else
+   struct stat info;
+   if (stat(path.c_str(), &info) != 0) return false;
+#ifdef __APPLE__
+   *time = static_cast<long long>(info.st_mtimespec.tv_sec) * 1000000000 + info.st_mtimespec.tv_nsec;
+#else
+   *time = static_cast<long long>(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+#endif
+#endif
+   *size = info.st_size;
+   return true;
+}
+
+// maps a whole file copy-on-write, so the pixels can still be changed in
+// place without touching the file; returns null if it cannot be mapped
+void *MapFile(const string &path, size_t *bytes)
+{
+   void *view = 0;
+#ifdef _WIN32
+   HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+   if (file == INVALID_HANDLE_VALUE) return 0;
+   LARGE_INTEGER size;
+   if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+   {
+      HANDLE mapping = CreateFileMappingA(file, 0, PAGE_WRITECOPY, 0, 0, 0);
+      if (mapping)
+      {
+         view = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+         CloseHandle(mapping);
+      }
+      *bytes = static_cast<size_t>(size.QuadPart);
+   }
+   CloseHandle(file);
+#else
+   int file = open(path.c_str(), O_RDONLY);
+   if (file < 0) return 0;
+   struct stat info;
+   if (fstat(file, &info) == 0 && info.st_size > 0)
+   {
+      view = mmap(0, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+      if (view == MAP_FAILED)
+         view = 0;
+      *bytes = info.st_size;
+   }
+   close(file);
+#endif
+   return view;
+}
+
+void UnmapFile(void *view, size_t bytes)
+{
+#ifdef _WIN32
+   UnmapViewOfFile(view);
+#else
+   munmap(view, bytes);
+#endif
+}
+
+string PixelCachePath(const string &filename)
+{
+   if (pixelCache_.directory.empty())
+      return filename + ".raw";
+
+   ostringstream path;
+   path << pixelCache_.directory << "/" << hex << setw(16) << setfill('0') << HashString(filename) << ".raw";
+   return path.str();
+}
+
+// checks an entry of the given size is complete and was written from the
+// source as it is now
+bool IsCurrentPixelCacheEntry(const PixelCacheHeader &header, long long sourceSize, long long sourceTime, size_t bytes)
+{
+   return bytes >= PIXEL_CACHE_HEADER && memcmp(header.magic, PIXEL_CACHE_MAGIC, sizeof(header.magic)) == 0
+      && header.sourceSize == sourceSize && header.sourceTime == sourceTime
+      && header.rowStride == header.width * header.numComponents
+      && bytes == PIXEL_CACHE_HEADER + static_cast<size_t>(header.rowStride) * header.height;
+}
+
+// points the image at the cached pixels of a file, returning false if there
+// is no entry or the source has changed since it was written
+bool MapCachedPixels(DecodedImage *image, const string &filename)
+{
+   long long sourceSize, sourceTime;
+   if (!FileStamp(filename, &sourceSize, &sourceTime)) return false;
+
+   size_t bytes = 0;
+   void *view = MapFile(PixelCachePath(filename), &bytes);
+   if (!view) return false;
+
+   PixelCacheHeader header;
+   memcpy(&header, view, min(bytes, sizeof(header)));
+   if (!IsCurrentPixelCacheEntry(header, sourceSize, sourceTime, bytes))
+   {
+      UnmapFile(view, bytes);
+      return false;
+   }
+
+   image->width = header.width;
+   image->height = header.height;
+   image->numComponents = header.numComponents;
+   image->pixels = static_cast<unsigned char *>(view) + PIXEL_CACHE_HEADER;
+   image->mapping = view;
+   image->mappingBytes = bytes;
+
+   // the entry's own modification time records when it was last used
+#ifdef _WIN32
+   _utime(PixelCachePath(filename).c_str(), 0);
+#else
+   utime(PixelCachePath(filename).c_str(), 0);
+#endif
+   return true;
+}
+
+// accounts for an entry of the given size just written to the cache
+// directory, removing the least recently used entries if that takes it over
+// budget; the newest entry is always kept
+void TrimPixelCache(long long addedBytes)
+{
+   if (pixelCache_.directory.empty()) return;
+   lock_guard<mutex> guard(pixelCache_.trimLock);
+   if (pixelCache_.residentBytes >= 0 && pixelCache_.residentBytes + addedBytes <= pixelCache_.budgetBytes)
+   {
+      pixelCache_.residentBytes += addedBytes;
+      return;
+   }
+
+   vector<string> names;
+#ifdef _WIN32
+   WIN32_FIND_DATAA entry;
+   HANDLE search = FindFirstFileA((pixelCache_.directory + "\\*.raw").c_str(), &entry);
+   if (search != INVALID_HANDLE_VALUE)
+   {
+      do names.push_back(entry.cFileName);
+      while (FindNextFileA(search, &entry));
+      FindClose(search);
+   }
+#else
+   DIR *dir = opendir(pixelCache_.directory.c_str());
+   if (dir)
+   {
+      for (dirent *entry = readdir(dir); entry; entry = readdir(dir))
+      {
+         string name = entry->d_name;
+         if (name.size() > 4 && name.compare(name.size() - 4, 4, ".raw") == 0)
+            names.push_back(name);
+      }
+      closedir(dir);
+   }
+#endif
+
+   // entries by last use, oldest first
+   vector<pair<long long, string> > entries;
+   map<string, long long> sizes;
+   long long total = 0;
+   for (size_t i = 0; i < names.size(); i++)
+   {
+      string path = pixelCache_.directory + "/" + names[i];
+      long long bytes, time;
+      if (!FileStamp(path, &bytes, &time)) continue;
+      entries.push_back(make_pair(time, path));
+      sizes[path] = bytes;
+      total += bytes;
+   }
+   sort(entries.begin(), entries.end());
+
+   int evictions = 0;
+   for (size_t i = 0; i + 1 < entries.size() && total > pixelCache_.budgetBytes; i++)
+   {
+      // an entry still mapped on Windows cannot be removed, and stays
+      if (remove(entries[i].second.c_str()) != 0) continue;
+      total -= sizes[entries[i].second];
+      evictions++;
+   }
+   pixelCache_.residentBytes = total;
+
+   lock_guard<mutex> statsGuard(pixelCache_.lock);
+   pixelCache_.evictions += evictions;
+}
+
+// writes an entry through a temporary file, so that nobody ever maps one
+// that is only partly written
+void WriteCachedPixels(const DecodedImage *image)
+{
+   PixelCacheHeader header;
+   memset(&header, 0, sizeof(header));
+   if (!FileStamp(image->filename, &header.sourceSize, &header.sourceTime)) return;
+   memcpy(header.magic, PIXEL_CACHE_MAGIC, sizeof(header.magic));
+   header.width = image->width;
+   header.height = image->height;
+   header.numComponents = image->numComponents;
+   header.rowStride = image->width * image->numComponents;
+
+   char block[PIXEL_CACHE_HEADER] = {};
+   memcpy(block, &header, sizeof(header));
+   string path = PixelCachePath(image->filename);
+   ostringstream temporary;
+   temporary << path << "." << this_thread::get_id() << ".tmp";
+   {
+      ofstream output(temporary.str().c_str(), ios::binary);
+      output.write(block, PIXEL_CACHE_HEADER);
+      output.write(reinterpret_cast<const char *>(image->pixels), static_cast<streamsize>(header.rowStride) * header.height);
+      if (!output)
+      {
+         output.close();
+         remove(temporary.str().c_str());
+         return;
+      }
+   }
+#ifdef _WIN32
+   bool written = MoveFileExA(temporary.str().c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+   bool written = rename(temporary.str().c_str(), path.c_str()) == 0;
+#endif
+   if (written)
+      TrimPixelCache(static_cast<long long>(PIXEL_CACHE_HEADER) + static_cast<long long>(header.rowStride) * header.height);
+   else
+      remove(temporary.str().c_str());
+}
+
+void PrintPixelCacheStats()
+{
+   lock_guard<mutex> guard(pixelCache_.lock);
+   if (pixelCache_.enabled)
+      cout << "Pixel cache: " << pixelCache_.hits << " hits, " << pixelCache_.misses << " misses, "
+         << pixelCache_.evictions << " evictions" << endl;
+}
+
+// --------------------------------------------------------------------------
+// Decoding through the pixel cache, on the calling thread or on a pool of
+// worker threads
+
+// decodes an image file bottom row first, as OpenGL expects, or maps it from
+// the pixel cache; pixels is null if the file could not be decoded
+void DecodeImage(DecodedImage *image, const string &filename)
+{
+   double start = ProfileBegin();
+   image->filename = filename;
+   if (pixelCache_.enabled && MapCachedPixels(image, filename))
+   {
+      ProfileEnd("map cached pixels", start, filename);
+      lock_guard<mutex> guard(pixelCache_.lock);
+      pixelCache_.hits++;
+      return;
+   }
+
+   image->pixels = stbi_load(filename.c_str(), &image->width, &image->height, &image->numComponents, 0);
+   ProfileEnd("decode", start, filename);
+   if (pixelCache_.enabled && image->pixels)
+   {
+      start = ProfileBegin();
+      WriteCachedPixels(image);
+      ProfileEnd("write pixel cache", start, filename);
+      lock_guard<mutex> guard(pixelCache_.lock);
+      pixelCache_.misses++;
+   }
+}
+
+// returns the decoded pixels to the pool, or unmaps them
+void DestroyDecodedImage(DecodedImage *image)
+{
+   if (image->mapping)
+      UnmapFile(image->mapping, image->mappingBytes);
+   else
+      stbi_image_free(image->pixels);
+   image->pixels = 0;
+   image->mapping = 0;
+   for (size_t i = 0; i < image->mips.size(); i++)
+      PixelPoolFree(image->mips[i].pixels);
+   image->mips.clear();
+}
+
+struct DecodePool
+{
+   vector<thread> workers;
+   mutex lock;
+   condition_variable wake;
+   condition_variable finished;
+
+   // pending files with urgent requests at the front, files being decoded,
+   // and finished images waiting for upload with the oldest at the front
+   deque<string> queue;
+   set<string> inFlight;
+   list<DecodedImage> completed;
+   size_t maxCompleted;
+   bool stopping;
+
+   // called on a worker thread after each image finishes, e.g. to wake an
+   // event loop that is waiting for it
+   void (*onCompleted)();
+
+   // images wider or taller than this also get their mip pyramid built on
+   // the worker, to be shown as tiles; 0 never builds one
+   int pyramidAbove;
+
+   DecodePool() : maxCompleted(4), stopping(false), onCompleted(0), pyramidAbove(0)
+   {}
+};
+
+void DecodeWorker(DecodePool *pool)
+{
+   unique_lock<mutex> guard(pool->lock);
+   while (true)
+   {
+      while (!pool->stopping && pool->queue.empty())
+         pool->wake.wait(guard);
+      if (pool->stopping) return;
+
+      string filename = pool->queue.front();
+      pool->queue.pop_front();
+      pool->inFlight.insert(filename);
+
+      int pyramidAbove = pool->pyramidAbove;
+      guard.unlock();
+      DecodedImage image;
+      DecodeImage(&image, filename);
+      if (image.pixels && pyramidAbove > 0 && max(image.width, image.height) > pyramidAbove)
+         BuildMipPyramid(&image);
+      guard.lock();
+
+      pool->inFlight.erase(filename);
+      pool->completed.push_back(image);
+      pool->finished.notify_all();
+      if (pool->onCompleted)
+         pool->onCompleted();
+
+      // drop the oldest speculative results that nobody picked up
+      while (pool->completed.size() > pool->maxCompleted)
+      {
+         DestroyDecodedImage(&pool->completed.front());
+         pool->completed.pop_front();
+      }
+   }
+}
+
+void InitializeDecodePool(DecodePool *pool, unsigned int threadCount)
+{
+   // the flip setting is global to stb_image, so set it before any worker runs
+   stbi_set_flip_vertically_on_load(true);
+   for (unsigned int i = 0; i < max(threadCount, 1u); i++)
+      pool->workers.push_back(thread(DecodeWorker, pool));
+}
+
+void DestroyDecodePool(DecodePool *pool)
+{
+   {
+      lock_guard<mutex> guard(pool->lock);
+      pool->stopping = true;
+   }
+   pool->wake.notify_all();
+   for (size_t i = 0; i < pool->workers.size(); i++)
+      pool->workers[i].join();
+   pool->workers.clear();
+
+   for (list<DecodedImage>::iterator it = pool->completed.begin(); it != pool->completed.end(); ++it)
+      DestroyDecodedImage(&*it);
+   pool->completed.clear();
+   pool->queue.clear();
+}
+
+// queues a file for decoding unless it is already pending or decoded; urgent
+// requests jump ahead of speculative prefetches
+void RequestDecode(DecodePool *pool, const string &filename, bool urgent)
+{
+   {
+      lock_guard<mutex> guard(pool->lock);
+      if (pool->inFlight.count(filename)) return;
+      for (list<DecodedImage>::iterator it = pool->completed.begin(); it != pool->completed.end(); ++it)
+         if (it->filename == filename) return;
+
+      deque<string>::iterator queued = find(pool->queue.begin(), pool->queue.end(), filename);
+      if (queued != pool->queue.end())
+      {
+         if (!urgent) return;
+         pool->queue.erase(queued);
+      }
+
+      if (urgent)
+         pool->queue.push_front(filename);
+      else
+         pool->queue.push_back(filename);
+   }
+   pool->wake.notify_one();
+}
+
+bool TakeCompletedImage(DecodePool *pool, const string &filename, DecodedImage *image)
+{
+   for (list<DecodedImage>::iterator it = pool->completed.begin(); it != pool->completed.end(); ++it)
+   {
+      if (it->filename == filename)
+      {
+         *image = *it;
+         pool->completed.erase(it);
+         return true;
+      }
+   }
+   return false;
+}
+
+// hands over a finished decode, returning false if it is not ready yet
+bool TakeDecodedImage(DecodePool *pool, const string &filename, DecodedImage *image)
+{
+   lock_guard<mutex> guard(pool->lock);
+   return TakeCompletedImage(pool, filename, image);
+}
+
+// blocks until a previously requested file has been decoded; if its result
+// was dropped before anyone took it, the file is decoded again
+void WaitDecodedImage(DecodePool *pool, const string &filename, DecodedImage *image)
+{
+   unique_lock<mutex> guard(pool->lock);
+   while (!TakeCompletedImage(pool, filename, image))
+   {
+      if (!pool->inFlight.count(filename) &&
+          find(pool->queue.begin(), pool->queue.end(), filename) == pool->queue.end())
+      {
+         pool->queue.push_front(filename);
+         pool->wake.notify_one();
+      }
+      pool->finished.wait(guard);
+   }
+}
+
+// --------------------------------------------------------------------------
+// Work-stealing task pool for data-parallel jobs. Each call hands out task
+// indices in contiguous runs, one deque per participant; participants take
+// from the front of their own deque and steal from the back of others'.
+
+struct TaskPool
+{
+   struct Queue
+   {
+      mutex lock;
+      deque<int> tasks;
+   };
+
+   // participant 0 is the thread calling RunTasks
+   vector<thread> threads;
+   vector<Queue *> queues;
+
+   mutex lock;
+   condition_variable wake;
+   condition_variable done;
+   function<void(int, int)> job;
+   unsigned int generation;
+   int busy;
+   bool stopping;
+
+   TaskPool() : generation(0), busy(0), stopping(false)
+   {}
+};
+
+bool TakeTask(TaskPool *pool, int participant, int *task)
+{
+   TaskPool::Queue *own = pool->queues[participant];
+   {
+      lock_guard<mutex> guard(own->lock);
+      if (!own->tasks.empty())
+      {
+         *task = own->tasks.front();
+         own->tasks.pop_front();
+         return true;
+      }
+   }
+
+   for (size_t i = 1; i < pool->queues.size(); i++)
+   {
+      TaskPool::Queue *victim = pool->queues[(participant + i) % pool->queues.size()];
+      lock_guard<mutex> guard(victim->lock);
+      if (!victim->tasks.empty())
+      {
+         *task = victim->tasks.back();
+         victim->tasks.pop_back();
+         return true;
+      }
+   }
+   return false;
+}
+
+void RunQueuedTasks(TaskPool *pool, int participant)
+{
+   int task;
+   while (TakeTask(pool, participant, &task))
+      pool->job(task, participant);
+}
+
+void TaskWorker(TaskPool *pool, int participant)
+{
+   unsigned int seen = 0;
+   unique_lock<mutex> guard(pool->lock);
+   while (true)
+   {
+      while (!pool->stopping && pool->generation == seen)
+         pool->wake.wait(guard);
+      if (pool->stopping) return;
+      seen = pool->generation;
+
+      guard.unlock();
+      RunQueuedTasks(pool, participant);
+      guard.lock();
+
+      if (--pool->busy == 0)
+         pool->done.notify_all();
+   }
+}
+
+// starts a pool with the given number of participants, counting the caller
+void InitializeTaskPool(TaskPool *pool, unsigned int participants)
+{
+   participants = max(participants, 1u);
+   for (unsigned int i = 0; i < participants; i++)
+      pool->queues.push_back(new TaskPool::Queue);
+   for (unsigned int i = 1; i < participants; i++)
+      pool->threads.push_back(thread(TaskWorker, pool, i));
+}
+
+int TaskPoolSize(const TaskPool *pool)
+{
+   return static_cast<int>(pool->queues.size());
+}
+
+// runs job(task, participant) for every task in [0, taskCount) and waits for
+// all of them to finish
+void RunTasks(TaskPool *pool, int taskCount, const function<void(int, int)> &job)
+{
+   int participants = TaskPoolSize(pool);
+   for (int p = 0; p < participants; p++)
+   {
+      lock_guard<mutex> guard(pool->queues[p]->lock);
+      for (int task = taskCount * p / participants; task < taskCount * (p + 1) / participants; task++)
+         pool->queues[p]->tasks.push_back(task);
+   }
+
+   {
+      lock_guard<mutex> guard(pool->lock);
+      pool->job = job;
+      pool->busy = participants - 1;
+      pool->generation++;
+   }
+   pool->wake.notify_all();
+
+   RunQueuedTasks(pool, 0);
+
+   unique_lock<mutex> guard(pool->lock);
+   while (pool->busy > 0)
+      pool->done.wait(guard);
+}
+
+void DestroyTaskPool(TaskPool *pool)
+{
+   {
+      lock_guard<mutex> guard(pool->lock);
+      pool->stopping = true;
+   }
+   pool->wake.notify_all();
+   for (size_t i = 0; i < pool->threads.size(); i++)
+      pool->threads[i].join();
+   pool->threads.clear();
+
+   for (size_t i = 0; i < pool->queues.size(); i++)
+      delete pool->queues[i];
+   pool->queues.clear();
+}
+
+// --------------------------------------------------------------------------
+// Functions to set up OpenGL buffers for storing textures
+
+struct MyTexture
+{
+   GLuint textureID;
+   GLuint target;
+   int width;
+   int height;
+
+   // initialize object names to zero (OpenGL reserved value)
+   MyTexture() : textureID(0), target(0), width(0), height(0)
+   {}
+};
+
+// pixel format of decoded images with the given number of components
+GLuint PixelFormat(int numComponents)
+{
+   return numComponents == 1 ? GL_RED : numComponents == 2 ? GL_RG : numComponents == 3 ? GL_RGB : GL_RGBA;
+}
+
+// creates a texture filled from client memory or, while a pixel unpack
+// buffer is bound, from an offset into that buffer; data may be null to
+// leave it to be filled later
+void CreateTexture(MyTexture *texture, int width, int height, int numComponents, GLuint target, const void *data)
+{
+   texture->width = width;
+   texture->height = height;
+   texture->target = target;
+   glGenTextures(1, &texture->textureID);
+   glBindTexture(texture->target, texture->textureID);
+   GLuint format = PixelFormat(numComponents);
+   glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+   glTexImage2D(texture->target, 0, format, texture->width, texture->height, 0, format, GL_UNSIGNED_BYTE, data);
+
+   // Note: Only wrapping modes supported for GL_TEXTURE_RECTANGLE when defining
+   // GL_TEXTURE_WRAP are GL_CLAMP_TO_EDGE or GL_CLAMP_TO_BORDER
+   glTexParameteri(texture->target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+   glTexParameteri(texture->target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+   glTexParameteri(texture->target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+   glTexParameteri(texture->target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+   // grey images, with or without alpha, read as grey in every channel
+   if (numComponents <= 2)
+   {
+      GLint swizzle[4] = { GL_RED, GL_RED, GL_RED, numComponents == 2 ? GL_GREEN : GL_ONE };
+      glTexParameteriv(texture->target, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+   }
+
+   // Clean up
+   glBindTexture(texture->target, 0);
+}
+
+// uploads already decoded pixels, returning true if successful
+bool UploadTexture(MyTexture* texture, const DecodedImage *image, GLuint target = GL_TEXTURE_2D)
+{
+   unsigned char *data = image->pixels;
+   if (data != nullptr)
+   {
+      double start = ProfileBegin();
+      BeginGpuTimer("upload", image->filename);
+      CreateTexture(texture, image->width, image->height, image->numComponents, target, data);
+      EndGpuTimer();
+      ProfileEnd("upload", start, image->filename);
+      return !CheckGLErrors();
+   }
+   cout << "Unable to load image: " << image->filename << endl;
+   return false;
+}
+
+// decodes and uploads an image on the calling thread
+bool InitializeTexture(MyTexture* texture, const char* filename, GLuint target = GL_TEXTURE_2D)
+{
+   stbi_set_flip_vertically_on_load(true);
+   DecodedImage image;
+   DecodeImage(&image, filename);
+   bool success = UploadTexture(texture, &image, target);
+   DestroyDecodedImage(&image);
+   return success;
+}
+
+// deallocate texture-related objects
+void DestroyTexture(MyTexture *texture)
+{
+   glBindTexture(texture->target, 0);
+   glDeleteTextures(1, &texture->textureID);
+}
+
+// --------------------------------------------------------------------------
+// Asynchronous pixel transfers through pixel buffer objects. Uploads copy
+// strips of the image into buffers from a small ring and fill the texture
+// from them, so the driver moves the data while the CPU carries on; a buffer
+// is only written again once the fence after its last use has signalled.
+// Readbacks land in buffers of their own that are mapped frames later, once
+// their fence has signalled, so neither direction waits on the GPU.
+
+// buffers in the upload ring, and the most bytes copied through one at a time
+static const int UPLOAD_RING_SIZE = 3;
+static const size_t UPLOAD_STRIP_BYTES = 8 << 20;
+
+// bytes the viewer uploads per frame, keeping frames short while a large
+// image comes in
+static const size_t FRAME_UPLOAD_BYTES = 32 << 20;
+
+// batch images rendered after one before its readback is collected
+static const size_t READBACK_LAG = 2;
+
+struct TransferBuffer
+{
+   GLuint buffer;
+   size_t capacity;
+
+   // signalled once the GPU is done with the buffer's last use
+   GLsync fence;
+
+   TransferBuffer() : buffer(0), capacity(0), fence(0)
+   {}
+};
+
+struct Readback
+{
+   TransferBuffer storage;
+   int width;
+   int height;
+};
+
+struct PixelTransfer
+{
+   TransferBuffer uploads[UPLOAD_RING_SIZE];
+   int nextUpload;
+
+   // readbacks in flight with the oldest at the front, and buffers of
+   // finished ones kept for reuse
+   deque<Readback> readbacks;
+   vector<TransferBuffer> spareReadbacks;
+
+   // statistics: transfers, and how many had to wait for the GPU anyway
+   int uploadStrips;
+   int readbackCount;
+   int stalls;
+
+   PixelTransfer() : nextUpload(0), uploadStrips(0), readbackCount(0), stalls(0)
+   {}
+};
+
+// a texture being filled a strip at a time from an image it owns
+struct TextureUpload
+{
+   MyTexture texture;
+   DecodedImage image;
+   string filename;
+   int nextRow;
+
+   TextureUpload() : nextRow(0)
+   {}
+};
+
+// blocks until the GPU is done with a buffer, counting it if that means waiting
+void WaitTransferBuffer(PixelTransfer *transfer, TransferBuffer *buffer)
+{
+   if (!buffer->fence) return;
+   if (glClientWaitSync(buffer->fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+   {
+      transfer->stalls++;
+      while (glClientWaitSync(buffer->fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+         ;
+   }
+   glDeleteSync(buffer->fence);
+   buffer->fence = 0;
+}
+
+// binds the buffer to the given target, growing it to hold at least the
+// given number of bytes
+void BindTransferBuffer(TransferBuffer *buffer, GLenum target, size_t bytes, GLenum usage)
+{
+   if (!buffer->buffer)
+      glGenBuffers(1, &buffer->buffer);
+   glBindBuffer(target, buffer->buffer);
+   if (buffer->capacity < bytes)
+   {
+      glBufferData(target, bytes, 0, usage);
+      buffer->capacity = bytes;
+   }
+}
+
+void DestroyTransferBuffer(TransferBuffer *buffer)
+{
+   if (buffer->fence)
+      glDeleteSync(buffer->fence);
+   glDeleteBuffers(1, &buffer->buffer);
+   *buffer = TransferBuffer();
+}
+
+// releases the image and texture of an upload that is not going to finish
+void CancelTextureUpload(TextureUpload *upload)
+{
+   DestroyDecodedImage(&upload->image);
+   if (upload->texture.textureID)
+      DestroyTexture(&upload->texture);
+   upload->texture = MyTexture();
+}
+
+// creates the texture for an image and takes the image over, leaving it
+// empty; the pixels follow with ContinueTextureUpload
+bool BeginTextureUpload(TextureUpload *upload, DecodedImage *image, GLuint target)
+{
+   upload->image = *image;
+   *image = DecodedImage();
+   upload->filename = upload->image.filename;
+   upload->nextRow = 0;
+   if (!upload->image.pixels)
+   {
+      cout << "Unable to load image: " << upload->filename << endl;
+      return false;
+   }
+
+   CreateTexture(&upload->texture, upload->image.width, upload->image.height, upload->image.numComponents, target, 0);
+   if (CheckGLErrors())
+   {
+      CancelTextureUpload(upload);
+      return false;
+   }
+   return true;
+}
+
+// rows of pixels sent through one buffer of the upload ring
+int UploadStripRows(int width, int numComponents)
+{
+   size_t rowBytes = static_cast<size_t>(width) * numComponents;
+   return static_cast<int>(max(UPLOAD_STRIP_BYTES / rowBytes, static_cast<size_t>(1)));
+}
+
+// copies rows of pixels, starting at the given row of the texture, through
+// the next buffer of the upload ring into the bound texture; the source rows
+// are rowStride bytes apart, which may be negative to upload them in reverse
+// order, or tightly packed if it is 0. Returns false if the buffer could not
+// be mapped
+bool UploadStrip(PixelTransfer *transfer, const MyTexture *texture, const unsigned char *pixels,
+                 int numComponents, int firstRow, int rows, ptrdiff_t rowStride = 0)
+{
+   size_t rowBytes = static_cast<size_t>(texture->width) * numComponents;
+   size_t bytes = rowBytes * rows;
+
+   // the ring slot was last used UPLOAD_RING_SIZE strips ago, so its fence
+   // has normally long signalled
+   TransferBuffer *buffer = &transfer->uploads[transfer->nextUpload];
+   transfer->nextUpload = (transfer->nextUpload + 1) % UPLOAD_RING_SIZE;
+   WaitTransferBuffer(transfer, buffer);
+   BindTransferBuffer(buffer, GL_PIXEL_UNPACK_BUFFER, bytes, GL_STREAM_DRAW);
+   void *mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes,
+                                   GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+   if (mapped)
+   {
+      if (rowStride == 0 || rowStride == static_cast<ptrdiff_t>(rowBytes))
+         memcpy(mapped, pixels, bytes);
+      else
+         for (int i = 0; i < rows; i++)
+            memcpy(static_cast<unsigned char *>(mapped) + i * rowBytes, pixels + i * rowStride, rowBytes);
+      glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+      glTexSubImage2D(texture->target, 0, 0, firstRow, texture->width, rows,
+                      PixelFormat(numComponents), GL_UNSIGNED_BYTE, 0);
+      buffer->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+      transfer->uploadStrips++;
+   }
+   glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+   return mapped != 0;
+}
+
+// uploads strips of the image until about maxBytes have gone, returning true
+// once it is done; the image is released then, and the texture is left with
+// a zero name if the upload failed
+bool ContinueTextureUpload(PixelTransfer *transfer, TextureUpload *upload, size_t maxBytes)
+{
+   DecodedImage *image = &upload->image;
+   if (!image->pixels) return true;
+
+   double start = ProfileBegin();
+   BeginGpuTimer("upload", upload->filename);
+   size_t rowBytes = static_cast<size_t>(image->width) * image->numComponents;
+   int stripRows = UploadStripRows(image->width, image->numComponents);
+   size_t sent = 0;
+   bool success = true;
+   glBindTexture(upload->texture.target, upload->texture.textureID);
+   glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+   while (upload->nextRow < image->height && sent < maxBytes)
+   {
+      int rows = min(stripRows, image->height - upload->nextRow);
+      if (!UploadStrip(transfer, &upload->texture, image->pixels + upload->nextRow * rowBytes,
+                       image->numComponents, upload->nextRow, rows))
+      {
+         success = false;
+         break;
+      }
+      upload->nextRow += rows;
+      sent += rows * rowBytes;
+   }
+   glBindTexture(upload->texture.target, 0);
+   EndGpuTimer();
+   ProfileEnd("upload", start, upload->filename);
+
+   success = !CheckGLErrors() && success;
+   if (success && upload->nextRow < image->height)
+      return false;
+
+   if (!success)
+   {
+      cout << "Unable to upload image: " << upload->filename << endl;
+      CancelTextureUpload(upload);
+   }
+   DestroyDecodedImage(image);
+   return true;
+}
+
+// replaces the whole contents of an existing texture with new pixels of its
+// size, a strip at a time through the upload ring; rows are spaced as for
+// UploadStrip, bottom row first
+bool RefillTexture(PixelTransfer *transfer, MyTexture *texture, const unsigned char *pixels, int numComponents,
+                   ptrdiff_t rowStride = 0)
+{
+   double start = ProfileBegin();
+   BeginGpuTimer("upload");
+   ptrdiff_t rowStep = rowStride ? rowStride : static_cast<ptrdiff_t>(texture->width) * numComponents;
+   int stripRows = UploadStripRows(texture->width, numComponents);
+   bool success = true;
+   glBindTexture(texture->target, texture->textureID);
+   glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+   for (int row = 0; row < texture->height && success; row += stripRows)
+      success = UploadStrip(transfer, texture, pixels + row * rowStep, numComponents, row,
+                            min(stripRows, texture->height - row), rowStep);
+   glBindTexture(texture->target, 0);
+   EndGpuTimer();
+   ProfileEnd("upload", start);
+   return !CheckGLErrors() && success;
+}
+
+// starts copying the bound framebuffer into a buffer as tightly packed RGB,
+// bottom row first; FinishReadback collects it
+void BeginReadback(PixelTransfer *transfer, int width, int height)
+{
+   Readback readback;
+   readback.width = width;
+   readback.height = height;
+   if (!transfer->spareReadbacks.empty())
+   {
+      readback.storage = transfer->spareReadbacks.back();
+      transfer->spareReadbacks.pop_back();
+   }
+
+   double start = ProfileBegin();
+   BindTransferBuffer(&readback.storage, GL_PIXEL_PACK_BUFFER, static_cast<size_t>(width) * height * 3, GL_STREAM_READ);
+   glPixelStorei(GL_PACK_ALIGNMENT, 1);
+   glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, 0);
+   readback.storage.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+   glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+   ProfileEnd("readback", start);
+
+   transfer->readbacks.push_back(readback);
+   transfer->readbackCount++;
+}
+
+// copies out the oldest readback in flight, returning false without waiting
+// if wait is not set and the GPU has not finished it yet
+bool FinishReadback(PixelTransfer *transfer, vector<unsigned char> *pixels, bool wait)
+{
+   Readback &readback = transfer->readbacks.front();
+   if (!wait && glClientWaitSync(readback.storage.fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+      return false;
+
+   double start = ProfileBegin();
+   WaitTransferBuffer(transfer, &readback.storage);
+   size_t bytes = static_cast<size_t>(readback.width) * readback.height * 3;
+   pixels->resize(bytes);
+   glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.storage.buffer);
+   void *mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, bytes, GL_MAP_READ_BIT);
+   if (mapped)
+   {
+      memcpy(pixels->data(), mapped, bytes);
+      glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+   }
+   glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+   ProfileEnd("collect readback", start);
+
+   transfer->spareReadbacks.push_back(readback.storage);
+   transfer->readbacks.pop_front();
+   return mapped != 0;
+}
+
+void PrintPixelTransferStats(const PixelTransfer *transfer)
+{
+   cout << "Pixel transfers: " << transfer->uploadStrips << " upload strips, " << transfer->readbackCount
+      << " readbacks, " << transfer->stalls << " waited for the GPU" << endl;
+}
+
+void DestroyPixelTransfer(PixelTransfer *transfer)
+{
+   for (int i = 0; i < UPLOAD_RING_SIZE; i++)
+      DestroyTransferBuffer(&transfer->uploads[i]);
+   for (size_t i = 0; i < transfer->readbacks.size(); i++)
+      DestroyTransferBuffer(&transfer->readbacks[i].storage);
+   for (size_t i = 0; i < transfer->spareReadbacks.size(); i++)
+      DestroyTransferBuffer(&transfer->spareReadbacks[i]);
+   transfer->readbacks.clear();
+   transfer->spareReadbacks.clear();
+}
+
+// --------------------------------------------------------------------------
+// Cache of uploaded textures keyed by file path, evicting the least recently
+// used entries once the resident size exceeds a byte budget
+
+struct TextureCache
+{
+   struct Entry
+   {
+      MyTexture texture;
+      size_t bytes;
+      list<string>::iterator lruPosition;
+   };
+
+   // most recently used paths at the front
+   list<string> lru;
+   map<string, Entry> entries;
+
+   size_t budgetBytes;
+   size_t residentBytes;
+
+   // statistics reported on exit
+   int hits;
+   int misses;
+   int evictions;
+
+   TextureCache() : budgetBytes(256 << 20), residentBytes(0), hits(0), misses(0), evictions(0)
+   {}
+};
+
+// evicts least recently used textures until within budget, never evicting
+// the entry at the front of the list
+void TrimTextureCache(TextureCache *cache)
+{
+   while (cache->residentBytes > cache->budgetBytes && cache->lru.size() > 1)
+   {
+      map<string, TextureCache::Entry>::iterator it = cache->entries.find(cache->lru.back());
+      DestroyTexture(&it->second.texture);
+      cache->residentBytes -= it->second.bytes;
+      cache->lru.pop_back();
+      cache->entries.erase(it);
+      cache->evictions++;
+   }
+}
+
+// returns the resident texture for the given image and marks it as most
+// recently used, or null on a miss
+MyTexture *FindTexture(TextureCache *cache, const string &filename)
+{
+   map<string, TextureCache::Entry>::iterator it = cache->entries.find(filename);
+   if (it == cache->entries.end())
+   {
+      cache->misses++;
+      return 0;
+   }
+
+   cache->hits++;
+   cache->lru.splice(cache->lru.begin(), cache->lru, it->second.lruPosition);
+   return &it->second.texture;
+}
+
+// hands an uploaded texture over to the cache, which then owns it
+MyTexture *AddTexture(TextureCache *cache, const string &filename, const MyTexture &uploaded)
+{
+   map<string, TextureCache::Entry>::iterator it = cache->entries.find(filename);
+   if (it != cache->entries.end())
+   {
+      MyTexture duplicate = uploaded;
+      DestroyTexture(&duplicate);
+      return &it->second.texture;
+   }
+
+   TextureCache::Entry entry;
+   entry.texture = uploaded;
+
+   // drivers generally pad RGB textures out to four bytes per texel
+   entry.bytes = static_cast<size_t>(entry.texture.width) * entry.texture.height * 4;
+   cache->lru.push_front(filename);
+   entry.lruPosition = cache->lru.begin();
+   cache->residentBytes += entry.bytes;
+
+   MyTexture *texture = &(cache->entries[filename] = entry).texture;
+   TrimTextureCache(cache);
+   return texture;
+}
+
+// uploads a decoded image into the cache; returns null if the upload failed
+MyTexture *InsertTexture(TextureCache *cache, const DecodedImage *image, GLuint target = GL_TEXTURE_2D)
+{
+   MyTexture texture;
+   if (!UploadTexture(&texture, image, target))
+      return 0;
+   return AddTexture(cache, image->filename, texture);
+}
+
+// returns the texture for the given image, decoding and uploading it on the
+// calling thread only if it is not already resident
+MyTexture *AcquireTexture(TextureCache *cache, const string &filename, GLuint target = GL_TEXTURE_2D)
+{
+   MyTexture *texture = FindTexture(cache, filename);
+   if (texture) return texture;
+
+   DecodedImage image;
+   DecodeImage(&image, filename);
+   texture = InsertTexture(cache, &image, target);
+   DestroyDecodedImage(&image);
+   return texture;
+}
+
+void PrintTextureCacheStats(const TextureCache *cache)
+{
+   cout << "Texture cache: " << cache->hits << " hits, " << cache->misses << " misses, "
+      << cache->evictions << " evictions, " << (cache->residentBytes >> 20) << " of "
+      << (cache->budgetBytes >> 20) << " MB resident" << endl;
+}
+
+void DestroyTextureCache(TextureCache *cache)
+{
+   for (map<string, TextureCache::Entry>::iterator it = cache->entries.begin(); it != cache->entries.end(); ++it)
+      DestroyTexture(&it->second.texture);
+   cache->entries.clear();
+   cache->lru.clear();
+   cache->residentBytes = 0;
+}
+
+bool SaveImage(const char* filename, int width, int height, unsigned char *data, int numComponents = 3, int stride = 0)
+{
+   if (stbi_write_png(filename, width, height, numComponents, data, stride))
+      return true;
+   cout << "Unable to save image: " << filename << endl;
+   return false;
+}
+
+// --------------------------------------------------------------------------
+// Functions to set up OpenGL buffers for storing geometry data
+
+struct MyGeometry
+{
+   // OpenGL names for array buffer objects, vertex array object
+   GLuint  vertexBuffer;
+   GLuint  textureBuffer;
+   GLuint  colourBuffer;
+   GLuint  vertexArray;
+   GLsizei elementCount;
+
+   // initialize object names to zero (OpenGL reserved value)
+   MyGeometry() : vertexBuffer(0), textureBuffer(0), colourBuffer(0), vertexArray(0), elementCount(0)
+   {}
+};
+
+// half extents of the image quad, fitting the longer side to the window
+void ImageAspectExtents(const MyTexture& texture, GLfloat *width, GLfloat *height)
+{
+   *height = 1.0;
+   *width = 1.0;
+
+   if (texture.width > texture.height)
+   {
+      GLfloat ratio = static_cast<GLfloat>(texture.height) / static_cast<GLfloat>(texture.width);
+      *height *= ratio;
+   }
+   else
+   {
+      GLfloat ratio = static_cast<GLfloat>(texture.width) / static_cast<GLfloat>(texture.height);
+      *width *= ratio;
+   }
+}
+
+void createImageWithAspectRatio(MyTexture& texture, vector<GLfloat>& vertices)
+{
+   GLfloat height;
+   GLfloat width;
+   ImageAspectExtents(texture, &width, &height);
+
+   // Initialize two triangles with the aspect ratio
+   vertices.resize(12);
+   vertices[0] = (-1.0f * width);
+   vertices[1] = (-1.0f * height);
+   vertices[2] = (-1.0f * width);
+   vertices[3] = (1.0f * height);
+   vertices[4] = (1.0f * width);
+   vertices[5] = (1.0f * height);
+   vertices[6] = (1.0f * width);
+   vertices[7] = (1.0f * height);
+   vertices[8] = (1.0f * width);
+   vertices[9] = (-1.0f * height);
+   vertices[10] = (-1.0f * width);
+   vertices[11] = (-1.0f * height);
+}
+
+// create buffers and fill with geometry data, returning true if successful
+bool InitializeGeometry(MyGeometry *geometry, MyTexture* texture)
+{
+   // three vertex positions and associated textures of a triangle
+   const GLfloat colours[][3] = {
+      { 1.0f, 0.0f, 0.0f },
+      { 0.0f, 1.0f, 0.0f },
+      { 0.0f, 0.0f, 1.0f }
+   };
+
+   // Untransformed quad; pan, zoom and rotation are applied in the vertex shader
+   vector<GLfloat> vertices;
+   createImageWithAspectRatio(*texture, vertices);
+
+   // Map texture coordinates to the geometry coordinates
+   vector<GLfloat> textures;
+   textures.push_back(0.0f);
+   textures.push_back(0.0f);
+   textures.push_back(0.0f);
+   textures.push_back(static_cast<GLfloat>(texture->height));
+   textures.push_back(static_cast<GLfloat>(texture->width));
+   textures.push_back(static_cast<GLfloat>(texture->height));
+   textures.push_back(static_cast<GLfloat>(texture->width));
+   textures.push_back(static_cast<GLfloat>(texture->height));
+   textures.push_back(static_cast<GLfloat>(texture->width));
+   textures.push_back(0.0f);
+   textures.push_back(0.0f);
+   textures.push_back(0.0f);
+
+   geometry->elementCount = vertices.size() / 2;
+
+   // these vertex attribute indices correspond to those specified for the
+   // input variables in the vertex shader
+   const GLuint VERTEX_INDEX = 0;
+   const GLuint COLOUR_INDEX = 1;
+   const GLuint TEXTURE_INDEX = 2;
+
+   // create an array buffer object for storing our vertices
+   glGenBuffers(1, &geometry->vertexBuffer);
+   glBindBuffer(GL_ARRAY_BUFFER, geometry->vertexBuffer);
+   glBufferData(GL_ARRAY_BUFFER, vertices.size()*sizeof(GLfloat), vertices.data(), GL_STATIC_DRAW);
+
+   // create an array buffer object for storing our textures
+   glGenBuffers(1, &geometry->textureBuffer);
+   glBindBuffer(GL_ARRAY_BUFFER, geometry->textureBuffer);
+   glBufferData(GL_ARRAY_BUFFER, textures.size()*sizeof(GLfloat), textures.data(), GL_STATIC_DRAW);
+
+   // create another one for storing our colours
+   glGenBuffers(1, &geometry->colourBuffer);
+   glBindBuffer(GL_ARRAY_BUFFER, geometry->colourBuffer);
+   glBufferData(GL_ARRAY_BUFFER, sizeof(colours), colours, GL_STATIC_DRAW);
+
+   // create a vertex array object encapsulating all our vertex attributes
+   glGenVertexArrays(1, &geometry->vertexArray);
+   glBindVertexArray(geometry->vertexArray);
+
+   // associate the position array with the vertex array object
+   glBindBuffer(GL_ARRAY_BUFFER, geometry->vertexBuffer);
+   glVertexAttribPointer(VERTEX_INDEX, 2, GL_FLOAT, GL_FALSE, 0, 0);
+   glEnableVertexAttribArray(VERTEX_INDEX);
+
+   // associate the texture array with the vertex array object
+   glBindBuffer(GL_ARRAY_BUFFER, geometry->textureBuffer);
+   glVertexAttribPointer(TEXTURE_INDEX, 2, GL_FLOAT, GL_FALSE, 0, 0);
+   glEnableVertexAttribArray(TEXTURE_INDEX);
+
+   // associate the colour array with the vertex array object
+   glBindBuffer(GL_ARRAY_BUFFER, geometry->colourBuffer);
+   glVertexAttribPointer(COLOUR_INDEX, 3, GL_FLOAT, GL_FALSE, 0, 0);
+   glEnableVertexAttribArray(COLOUR_INDEX);
+
+   // unbind our buffers, resetting to default state
+   glBindBuffer(GL_ARRAY_BUFFER, 0);
+   glBindVertexArray(0);
+
+   // check for OpenGL errors and return false if error occurred
+   return !CheckGLErrors();
+}
+
+// deallocate geometry-related objects
+void DestroyGeometry(MyGeometry *geometry)
+{
+   // unbind and destroy our vertex array object and associated buffers
+   glBindVertexArray(0);
+   glDeleteVertexArrays(1, &geometry->vertexArray);
+   glDeleteBuffers(1, &geometry->vertexBuffer);
+   glDeleteBuffers(1, &geometry->colourBuffer);
+   glDeleteBuffers(1, &geometry->textureBuffer);
+   *geometry = MyGeometry();
+}
+
+// creates buffers for positions and texture coordinates filled anew every
+// time they are drawn, with no colours
+void InitializeStreamGeometry(MyGeometry *geometry)
+{
+   const GLuint VERTEX_INDEX = 0;
+   const GLuint TEXTURE_INDEX = 2;
+   glGenBuffers(1, &geometry->vertexBuffer);
+   glGenBuffers(1, &geometry->textureBuffer);
+   glGenVertexArrays(1, &geometry->vertexArray);
+   glBindVertexArray(geometry->vertexArray);
+   glBindBuffer(GL_ARRAY_BUFFER, geometry->vertexBuffer);
+   glVertexAttribPointer(VERTEX_INDEX, 2, GL_FLOAT, GL_FALSE, 0, 0);
+   glEnableVertexAttribArray(VERTEX_INDEX);
+   glBindBuffer(GL_ARRAY_BUFFER, geometry->textureBuffer);
+   glVertexAttribPointer(TEXTURE_INDEX, 2, GL_FLOAT, GL_FALSE, 0, 0);
+   glEnableVertexAttribArray(TEXTURE_INDEX);
+   glBindBuffer(GL_ARRAY_BUFFER, 0);
+   glBindVertexArray(0);
+}
+
+// --------------------------------------------------------------------------
+// View transform functions
+
+// builds the column-major model/view matrix T(pan) * S(zoom) * R(rotation)
+void BuildModelViewMatrix(const ViewTransform& view, GLfloat matrix[16])
+{
+   double angle = view.rotationSteps * M_PI / 8;
+   GLfloat c = static_cast<GLfloat>(cos(angle)) * view.zoom;
+   GLfloat s = static_cast<GLfloat>(sin(angle)) * view.zoom;
+
+   fill(matrix, matrix + 16, 0.0f);
+   matrix[0] = c;
+   matrix[1] = s;
+   matrix[4] = -s;
+   matrix[5] = c;
+   matrix[10] = 1.0f;
+   matrix[12] = view.panX;
+   matrix[13] = view.panY;
+   matrix[15] = 1.0f;
+}
+
+// rotates the view about the window centre by the given number of PI/8 steps
+void RotateView(ViewTransform* view, int steps)
+{
+   // the pan offset is rotated with the image, as the vertices used to be
+   double angle = steps * M_PI / 8;
+   GLfloat x = static_cast<GLfloat>(view->panX * cos(angle) - view->panY * sin(angle));
+   GLfloat y = static_cast<GLfloat>(view->panY * cos(angle) + view->panX * sin(angle));
+   view->panX = x;
+   view->panY = y;
+   view->rotationSteps = (view->rotationSteps + steps) % 16;
+}
+
+// the bounding box of the part of an image quad with the given half extents
+// that the view shows, as fractions of its width and height clamped to
+// [0, 1]; empty when the image is off screen
+void VisibleImageRect(const ViewTransform& view, GLfloat width, GLfloat height, double rect[4])
+{
+   // undo the pan, zoom and rotation for each corner of the viewport
+   double angle = view.rotationSteps * M_PI / 8;
+   rect[0] = rect[1] = 1.0;
+   rect[2] = rect[3] = 0.0;
+   for (int corner = 0; corner < 4; corner++)
+   {
+      double x = ((corner & 1 ? 1.0 : -1.0) - view.panX) / view.zoom;
+      double y = ((corner & 2 ? 1.0 : -1.0) - view.panY) / view.zoom;
+      double u = (x * cos(angle) + y * sin(angle) + width) / (2 * width);
+      double v = (y * cos(angle) - x * sin(angle) + height) / (2 * height);
+      rect[0] = min(rect[0], u);
+      rect[1] = min(rect[1], v);
+      rect[2] = max(rect[2], u);
+      rect[3] = max(rect[3], v);
+   }
+   for (int i = 0; i < 4; i++)
+      rect[i] = min(max(rect[i], 0.0), 1.0);
+}
+
+// builds a matrix stretching the image quad over the whole viewport, for
+// rendering at native resolution; flipY makes a readback come out top row first
+void BuildFillMatrix(const MyTexture& texture, bool flipY, GLfloat matrix[16])
+{
+   GLfloat width;
+   GLfloat height;
+   ImageAspectExtents(texture, &width, &height);
+
+   fill(matrix, matrix + 16, 0.0f);
+   matrix[0] = 1.0f / width;
+   matrix[5] = (flipY ? -1.0f : 1.0f) / height;
+   matrix[10] = 1.0f;
+   matrix[15] = 1.0f;
+}
+
+// --------------------------------------------------------------------------
+// Rendering function that draws our scene to the frame buffer
+
+void RenderScene(MyGeometry *geometry, MyTexture* texture, MyShader *shader, const GLfloat *modelView)
+{
+   // clear screen to a dark grey colour
+   glClearColor(0.2f, 0.2f, 0.2f, 1.0f);
+   glClear(GL_COLOR_BUFFER_BIT);
+
+   // bind our shader program and the vertex array object containing our
+   // scene geometry, then tell OpenGL to draw our geometry
+   glUseProgram(shader->program);
+   glUniformMatrix4fv(shader->modelViewUniform, 1, GL_FALSE, modelView);
+   glBindVertexArray(geometry->vertexArray);
+   glBindTexture(texture->target, texture->textureID);
+   glDrawArrays(GL_TRIANGLES, 0, geometry->elementCount);
+
+   // reset state to default (no shader or geometry bound)
+   glBindTexture(texture->target, 0);
+   glBindVertexArray(0);
+   glUseProgram(0);
+
+   // check for an report any OpenGL errors
+   CheckGLErrors();
+}
+
+// --------------------------------------------------------------------------
+// Offscreen render targets
+
+struct MyRenderTarget
+{
+   // framebuffer object with a single RGBA8 rectangle texture attached
+   GLuint framebuffer;
+   GLuint texture;
+   int width;
+   int height;
+
+   // initialize object names to zero (OpenGL reserved value)
+   MyRenderTarget() : framebuffer(0), texture(0), width(0), height(0)
+   {}
+};
+
+bool InitializeRenderTarget(MyRenderTarget *target, int width, int height)
+{
+   target->width = width;
+   target->height = height;
+
+   glGenTextures(1, &target->texture);
+   glBindTexture(GL_TEXTURE_RECTANGLE, target->texture);
+   glTexImage2D(GL_TEXTURE_RECTANGLE, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+   glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+   glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+   glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+   glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+   glBindTexture(GL_TEXTURE_RECTANGLE, 0);
+
+   glGenFramebuffers(1, &target->framebuffer);
+   glBindFramebuffer(GL_FRAMEBUFFER, target->framebuffer);
+   glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_RECTANGLE, target->texture, 0);
+   GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+   glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+   if (status != GL_FRAMEBUFFER_COMPLETE)
+   {
+      cout << "Framebuffer incomplete for " << width << "x" << height << " target" << endl;
+      return false;
+   }
+   return !CheckGLErrors();
+}
+
+void DestroyRenderTarget(MyRenderTarget *target)
+{
+   glBindFramebuffer(GL_FRAMEBUFFER, 0);
+   glDeleteFramebuffers(1, &target->framebuffer);
+   glDeleteTextures(1, &target->texture);
+   *target = MyRenderTarget();
+}
+
+// makes sure the target matches the given size, recreating it if not
+void EnsureRenderTarget(MyRenderTarget *target, int width, int height)
+{
+   if (target->framebuffer && target->width == width && target->height == height)
+      return;
+   DestroyRenderTarget(target);
+   InitializeRenderTarget(target, width, height);
+}
+
+// wraps a render target's colour buffer so it can be drawn like an image
+MyTexture RenderTargetTexture(const MyRenderTarget &target)
+{
+   MyTexture texture;
+   texture.textureID = target.texture;
+   texture.target = GL_TEXTURE_RECTANGLE;
+   texture.width = target.width;
+   texture.height = target.height;
+   return texture;
+}
+
+// --------------------------------------------------------------------------
+// Separable Gaussian blur. The kernel is computed once on the CPU, then run as
+// a horizontal pass into a render target and a vertical pass out of it.
+// Neighbouring taps are merged into one bilinear fetch placed between them,
+// so a radius-N pass takes 1 + 2 * ceil(N / 2) fetches.
+
+// largest number of merged taps per side; the blur shader unrolls them all
+static const int MAX_BLUR_TAPS = 32;
+
+// sigma and radius for the blur presets cycled with the b key
+static const float BLUR_SIGMAS[3] = { 1.5f, 1.96f, 2.56f };
+static const int BLUR_RADII[3] = { 1, 2, 3 };
+
+struct BlurKernel
+{
+   int radius;
+
+   // normalised weight for each texel offset 0..radius, used by the CPU
+   vector<float> weights;
+
+   // merged bilinear taps, with the centre texel at index 0
+   int tapCount;
+   vector<float> tapWeights;
+   vector<float> tapOffsets;
+
+   BlurKernel() : radius(0), tapCount(0)
+   {}
+};
+
+void BuildBlurKernel(BlurKernel *kernel, const EffectStage &stage)
+{
+   float sigma = 1.0f;
+   int radius = 0;
+   if (stage.blurSigma > 0.0f)
+   {
+      sigma = stage.blurSigma;
+      radius = min(static_cast<int>(ceil(3.0f * sigma)), 2 * MAX_BLUR_TAPS);
+   }
+   else if (stage.mode != NO_EFFECT)
+   {
+      sigma = BLUR_SIGMAS[stage.mode - 1];
+      radius = BLUR_RADII[stage.mode - 1];
+   }
+
+   kernel->radius = radius;
+   kernel->weights.resize(radius + 1);
+   float sum = 0.0f;
+   for (int i = 0; i <= radius; i++)
+   {
+      kernel->weights[i] = exp(-0.5f * i * i / (sigma * sigma));
+      sum += i ? 2 * kernel->weights[i] : kernel->weights[i];
+   }
+   for (int i = 0; i <= radius; i++)
+      kernel->weights[i] /= sum;
+
+   // pair up texels 1+2, 3+4, ...; a bilinear fetch at the weighted offset
+   // between two texels returns their weighted sum
+   kernel->tapWeights.assign(1, kernel->weights[0]);
+   kernel->tapOffsets.assign(1, 0.0f);
+   for (int i = 1; i <= radius; i += 2)
+   {
+      float first = kernel->weights[i];
+      float second = i + 1 <= radius ? kernel->weights[i + 1] : 0.0f;
+      kernel->tapWeights.push_back(first + second);
+      kernel->tapOffsets.push_back((i * first + (i + 1) * second) / (first + second));
+   }
+   kernel->tapCount = static_cast<int>(kernel->tapWeights.size()) - 1;
+}
+
+// --------------------------------------------------------------------------
+// Convolution with arbitrary kernels. A kernel that is the outer product of
+// a column and a row runs as two 1D passes; any other kernel runs directly,
+// or on the CPU through FFTs once it has enough taps for that to be cheaper.
+// Kernels are applied as written (correlation), centred on the pixel with
+// their top row above it.
+
+// non-separable kernels with at least this many taps use FFTs on the CPU
+static const int FFT_MIN_TAPS = 225;
+
+// largest deviation from an outer product, relative to the largest weight,
+// for a kernel to count as separable
+static const float SEPARABLE_TOLERANCE = 1e-5f;
+
+// column j of a kernel is at dx = j - KernelLeft, row i (from the top) at
+// dy = KernelTop - i, with y pointing up the image
+int KernelLeft(const EffectStage &stage)
+{
+   return (stage.kernelWidth - 1) / 2;
+}
+
+int KernelTop(const EffectStage &stage)
+{
+   return (stage.kernelHeight - 1) / 2;
+}
+
+// texels a kernel reads beyond the pixel in any direction
+int KernelHalo(const EffectStage &stage)
+{
+   return max(stage.kernelWidth, stage.kernelHeight) / 2;
+}
+
+// identifies a kernel in program names, e.g. "9x9l-1f3a5c7e"
+string KernelKey(const EffectStage &stage)
+{
+   unsigned int hash = 2166136261u;
+   vector<float> values(stage.kernel);
+   values.push_back(stage.kernelBias);
+   const unsigned char *bytes = reinterpret_cast<const unsigned char *>(values.data());
+   for (size_t i = 0; i < values.size() * sizeof(float); i++)
+      hash = (hash ^ bytes[i]) * 16777619u;
+
+   ostringstream key;
+   key << stage.kernelWidth << "x" << stage.kernelHeight << (stage.kernelLuminance ? "l" : "")
+      << "-" << hex << setw(8) << setfill('0') << hash;
+   return key.str();
+}
+
+struct KernelFactors
+{
+   // whether the kernel is the outer product of a column and a row
+   bool separable;
+
+   // row weights left to right (axis 0) and column weights top to bottom
+   // (axis 1), whose product is the kernel
+   vector<float> weights[2];
+
+   // the axis filtered first. When it has a factor without negative weights,
+   // that factor goes first, scaled to sum to one, so that its result stays
+   // within [0, 1] and fits the 8-bit target the GPU keeps between passes.
+   int firstAxis;
+   bool fitsTarget;
+
+   KernelFactors() : separable(false), firstAxis(0), fitsTarget(false)
+   {}
+};
+
+void FactorKernel(const EffectStage &stage, KernelFactors *factors)
+{
+   *factors = KernelFactors();
+   int width = stage.kernelWidth;
+   int height = stage.kernelHeight;
+   const vector<float> &kernel = stage.kernel;
+
+   // a rank-one kernel is its pivot's row times its pivot's column
+   size_t pivot = 0;
+   for (size_t i = 1; i < kernel.size(); i++)
+      if (fabs(kernel[i]) > fabs(kernel[pivot]))
+         pivot = i;
+   float largest = kernel.empty() ? 0.0f : fabs(kernel[pivot]);
+   if (largest == 0.0f) return;
+
+   int pivotRow = static_cast<int>(pivot) / width;
+   int pivotColumn = static_cast<int>(pivot) % width;
+   factors->weights[0].resize(width);
+   factors->weights[1].resize(height);
+   for (int j = 0; j < width; j++)
+      factors->weights[0][j] = kernel[pivotRow * width + j] / kernel[pivot];
+   for (int i = 0; i < height; i++)
+      factors->weights[1][i] = kernel[i * width + pivotColumn];
+
+   for (int i = 0; i < height; i++)
+      for (int j = 0; j < width; j++)
+         if (fabs(kernel[i * width + j] - factors->weights[1][i] * factors->weights[0][j]) > SEPARABLE_TOLERANCE * largest)
+            return;
+   factors->separable = true;
+
+   for (int axis = 0; axis < 2; axis++)
+   {
+      vector<float> &first = factors->weights[axis];
+      vector<float> &second = factors->weights[1 - axis];
+      float sum = 0.0f, lowest = 0.0f, highest = 0.0f;
+      for (size_t i = 0; i < first.size(); i++)
+      {
+         sum += first[i];
+         lowest = min(lowest, first[i]);
+         highest = max(highest, first[i]);
+      }
+      // flipping the sign of both factors leaves the product unchanged
+      float sign = highest > 0.0f ? 1.0f : -1.0f;
+      if ((sign > 0.0f ? lowest < 0.0f : highest > 0.0f) || sum == 0.0f)
+         continue;
+
+      for (size_t i = 0; i < first.size(); i++)
+         first[i] /= sum;
+      for (size_t i = 0; i < second.size(); i++)
+         second[i] *= sum;
+      factors->firstAxis = axis;
+      factors->fitsTarget = true;
+      return;
+   }
+}
+
+// whether the CPU runs a convolve stage through FFTs
+bool UsesFftConvolution(const EffectStage &stage)
+{
+   if (stage.shaderName != "convolve" || stage.kernelWidth * stage.kernelHeight < FFT_MIN_TAPS)
+      return false;
+   KernelFactors factors;
+   FactorKernel(stage, &factors);
+   return !factors.separable;
+}
+
+// one kernel weight and the texel it applies to, relative to the pixel
+struct ConvolutionTap
+{
+   int dx;
+   int dy;
+   float weight;
+};
+
+// the non-zero taps of a whole kernel (axis -1) or of one factor of a
+// separable one (0 for the row, 1 for the column); an all-zero kernel keeps
+// a single tap at the centre
+void ConvolutionTaps(const EffectStage &stage, int axis, vector<ConvolutionTap> *taps)
+{
+   taps->clear();
+   int left = KernelLeft(stage);
+   int top = KernelTop(stage);
+   if (axis < 0)
+   {
+      for (int i = 0; i < stage.kernelHeight; i++)
+         for (int j = 0; j < stage.kernelWidth; j++)
+            if (stage.kernel[i * stage.kernelWidth + j] != 0.0f)
+            {
+               ConvolutionTap tap = { j - left, top - i, stage.kernel[i * stage.kernelWidth + j] };
+               taps->push_back(tap);
+            }
+   }
+   else
+   {
+      KernelFactors factors;
+      FactorKernel(stage, &factors);
+      const vector<float> &weights = factors.weights[axis];
+      for (int i = 0; i < static_cast<int>(weights.size()); i++)
+         if (weights[i] != 0.0f)
+         {
+            ConvolutionTap tap = { axis ? 0 : i - left, axis ? top - i : 0, weights[i] };
+            taps->push_back(tap);
+         }
+   }
+
+   if (taps->empty())
+   {
+      ConvolutionTap tap = { 0, 0, 0.0f };
+      taps->push_back(tap);
+   }
+}
+
+// fills in a convolve stage from a kernel file or one of the built-in
+// kernels: "emboss", "box:N" (N x N average) or "log:SIGMA" (Laplacian of
+// Gaussian, edges drawn around mid grey). A kernel file holds the width,
+// height and optionally a bias on its first line, then the weights with the
+// top row first. Returns false if the kernel cannot be used.
+bool LoadConvolutionKernel(EffectStage *stage, const string &spec, bool luminance)
+{
+   *stage = EffectStage("convolve", EFFECT1);
+   stage->kernelLuminance = luminance;
+   stage->kernelName = spec;
+
+   if (spec == "emboss")
+   {
+      const float emboss[9] = { -2, -1, 0, -1, 1, 1, 0, 1, 2 };
+      stage->kernelWidth = stage->kernelHeight = 3;
+      stage->kernel.assign(emboss, emboss + 9);
+   }
+   else if (spec.compare(0, 4, "box:") == 0)
+   {
+      int size = atoi(spec.c_str() + 4);
+      stage->kernelWidth = stage->kernelHeight = size;
+      if (size > 0)
+         stage->kernel.assign(size * size, 1.0f / (size * size));
+   }
+   else if (spec.compare(0, 4, "log:") == 0)
+   {
+      // an inverted Laplacian of Gaussian with its mean removed, scaled so
+      // that the positive weights sum to one
+      float sigma = static_cast<float>(atof(spec.c_str() + 4));
+      int radius = sigma > 0.0f ? min(static_cast<int>(ceil(3.0f * sigma)), MAX_CONVOLUTION_SIZE / 2) : -1;
+      int size = 2 * radius + 1;
+      stage->kernelWidth = stage->kernelHeight = size;
+      stage->kernelBias = 0.5f;
+      stage->kernel.resize(max(size * size, 0));
+      float mean = 0.0f;
+      for (int y = 0; y < size; y++)
+         for (int x = 0; x < size; x++)
+         {
+            float r2 = static_cast<float>((x - radius) * (x - radius) + (y - radius) * (y - radius));
+            float weight = (1.0f - r2 / (2.0f * sigma * sigma)) * exp(-r2 / (2.0f * sigma * sigma));
+            stage->kernel[y * size + x] = weight;
+            mean += weight / (size * size);
+         }
+      float positive = 0.0f;
+      for (size_t i = 0; i < stage->kernel.size(); i++)
+      {
+         stage->kernel[i] -= mean;
+         positive += max(stage->kernel[i], 0.0f);
+      }
+      for (size_t i = 0; i < stage->kernel.size(); i++)
+         stage->kernel[i] /= positive;
+   }
+   else
+   {
+      ifstream file(spec.c_str());
+      string header;
+      getline(file, header);
+      istringstream sizes(header);
+      sizes >> stage->kernelWidth >> stage->kernelHeight >> stage->kernelBias;
+      float weight;
+      while (file >> weight)
+         stage->kernel.push_back(weight);
+   }
+
+   if (!IsValidEffect(*stage))
+   {
+      cout << "Unusable convolution kernel: " << spec << " (at most " << MAX_CONVOLUTION_SIZE << "x"
+         << MAX_CONVOLUTION_SIZE << ", with width x height weights)" << endl;
+      return false;
+   }
+   return true;
+}
+
+// adds the stage named by an effect option and its value, from the command
+// line or a server request, to the end of the chain. Returns the number of
+// arguments used: 0 if this is not an effect option or has no value, -1 if
+// its kernel is unusable
+int ParseEffectOption(const string &arg, const char *value, vector<EffectStage> *chain)
+{
+   if (!value) return 0;
+   if (arg == "--colour" || arg == "--filter" || arg == "--blur")
+      chain->push_back(EffectStage(arg.substr(2), atoi(value)));
+   else if (arg == "--blur-sigma")
+   {
+      chain->push_back(EffectStage("blur", EFFECT1));
+      chain->back().blurSigma = static_cast<float>(atof(value));
+   }
+   else if (arg == "--convolve" || arg == "--convolve-luma")
+   {
+      chain->push_back(EffectStage());
+      if (!LoadConvolutionKernel(&chain->back(), value, arg == "--convolve-luma"))
+         return -1;
+   }
+   else
+      return 0;
+   return 2;
+}
+
+// --------------------------------------------------------------------------
+// Colour lookup tables. Colour effects depend on nothing but the RGB value,
+// so a run of them is baked into a 3D table of RGBA results sampled with
+// trilinear interpolation: one fetch per pixel on the GPU, and one table
+// lookup on the CPU, however many stages the run has. Tables are baked on
+// first use and kept for the rest of the run, keyed by the stages in them.
+
+// grid points per axis; the colour effects are linear in RGB, which
+// trilinear interpolation reproduces exactly on any grid
+static const int COLOUR_LUT_SIZE = 17;
+
+// a single stage folds to one dot product, which is cheaper than the fetch
+static const size_t COLOUR_LUT_MIN_STAGES = 2;
+
+// luminance weights and sepia tint from colourFragment.glsl
+static const float GREYSCALE1[3] = { 0.333f, 0.333f, 0.333f };
+static const float GREYSCALE2[3] = { 0.299f, 0.587f, 0.114f };
+static const float GREYSCALE3[3] = { 0.213f, 0.715f, 0.072f };
+static const float SEPIA[3] = { 1.2f, 1.0f, 0.8f };
+
+// RGBA results for size^3 inputs spread evenly over [0, 1], red varying
+// fastest, laid out like the GL_TEXTURE_3D it is uploaded to
+struct ColourLut
+{
+   int size;
+   vector<float> table;
+
+   ColourLut() : size(0)
+   {}
+};
+
+struct ColourLutCache
+{
+   bool enabled;
+   mutex lock;
+   map<string, ColourLut> luts;
+
+   ColourLutCache() : enabled(true)
+   {}
+};
+
+static ColourLutCache colourLuts_;
+
+// applies one colour effect to an RGBA value the way colourFragment.glsl does
+void EvaluateColourEffect(int mode, float colour[4])
+{
+   if (mode == NO_EFFECT) return;
+
+   const float *weights[] = { GREYSCALE1, GREYSCALE2, GREYSCALE3, GREYSCALE2 };
+   const float *w = weights[mode - 1];
+   float luminance = colour[0] * w[0] + colour[1] * w[1] + colour[2] * w[2];
+   for (int c = 0; c < 3; c++)
+      colour[c] = mode == EFFECT4 ? luminance * SEPIA[c] : luminance;
+   colour[3] = mode == EFFECT4 ? 1.0f : 0.0f;
+}
+
+// cache key for a run of colour stages, e.g. "colour1,colour4"
+string ColourLutKey(const vector<EffectStage> &stages)
+{
+   ostringstream key;
+   for (size_t i = 0; i < stages.size(); i++)
+      key << (i ? "," : "") << stages[i].shaderName << stages[i].mode;
+   return key.str();
+}
+
+// the table for a run of colour stages, baked on first use; safe to call
+// from any thread
+const ColourLut *FindColourLut(const vector<EffectStage> &stages)
+{
+   string key = ColourLutKey(stages);
+   lock_guard<mutex> guard(colourLuts_.lock);
+   map<string, ColourLut>::iterator it = colourLuts_.luts.find(key);
+   if (it != colourLuts_.luts.end())
+      return &it->second;
+
+   double start = ProfileBegin();
+   ColourLut &lut = colourLuts_.luts[key];
+   int size = COLOUR_LUT_SIZE;
+   lut.size = size;
+   lut.table.resize(static_cast<size_t>(size) * size * size * 4);
+   float *entry = lut.table.data();
+   for (int b = 0; b < size; b++)
+      for (int g = 0; g < size; g++)
+         for (int r = 0; r < size; r++, entry += 4)
+         {
+            entry[0] = r / (size - 1.0f);
+            entry[1] = g / (size - 1.0f);
+            entry[2] = b / (size - 1.0f);
+            entry[3] = 1.0f;
+            for (size_t i = 0; i < stages.size(); i++)
+               EvaluateColourEffect(stages[i].mode, entry);
+         }
+   ProfileEnd("bake colour lut", start, key);
+   return &lut;
+}
+
+// --------------------------------------------------------------------------
+// Effect pipeline. An ordered chain of stages is split into passes, each
+// running at most one neighbourhood stage (filter or blur) with the
+// per-pixel colour stages next to it fused into the same generated shader.
+// Passes other than the last render at the image's native resolution into
+// render targets taken from a pool.
+
+// colour stages only read the pixel they compute, so they can be fused
+bool IsPerPixelStage(const EffectStage &stage)
+{
+   return stage.shaderName == "colour";
+}
+
+struct EffectPass
+{
+   // per-pixel stages applied to every texel the pass reads, the
+   // neighbourhood stage (mode NO_EFFECT for none), and the per-pixel
+   // stages applied to its result
+   vector<EffectStage> pre;
+   EffectStage stage;
+   vector<EffectStage> post;
+
+   // GPU blur and convolve passes only: 0 filters rows, 1 columns, and -1
+   // applies a whole convolution kernel at once
+   int axis;
+
+   EffectPass() : axis(0)
+   {}
+};
+
+// splits a chain into passes. Per-pixel stages join the pass before them, or
+// the first neighbourhood pass when nothing precedes them; stages with
+// NO_EFFECT are dropped. There is always at least one pass.
+void PlanEffectPasses(const vector<EffectStage> &chain, vector<EffectPass> *passes)
+{
+   passes->clear();
+   vector<EffectStage> pending;
+   for (size_t i = 0; i < chain.size(); i++)
+   {
+      if (chain[i].mode == NO_EFFECT)
+         continue;
+
+      if (!IsPerPixelStage(chain[i]))
+      {
+         EffectPass pass;
+         pass.pre.swap(pending);
+         pass.stage = chain[i];
+         passes->push_back(pass);
+      }
+      else if (passes->empty())
+         pending.push_back(chain[i]);
+      else
+         passes->back().post.push_back(chain[i]);
+   }
+
+   if (passes->empty())
+   {
+      passes->push_back(EffectPass());
+      passes->back().pre.swap(pending);
+   }
+}
+
+// the GPU runs a blur as a row pass followed by a column pass, and a
+// separable convolution as one pass per factor when its first factor's
+// result fits the 8-bit target between them; other convolutions run whole
+void SplitSeparablePasses(const vector<EffectPass> &passes, vector<EffectPass> *draws)
+{
+   draws->clear();
+   for (size_t i = 0; i < passes.size(); i++)
+   {
+      const EffectStage &stage = passes[i].stage;
+      int firstAxis = 0;
+      if (stage.shaderName == "convolve" && stage.mode != NO_EFFECT)
+      {
+         KernelFactors factors;
+         FactorKernel(stage, &factors);
+         if (!factors.fitsTarget)
+         {
+            draws->push_back(passes[i]);
+            draws->back().axis = -1;
+            continue;
+         }
+         firstAxis = factors.firstAxis;
+      }
+      else if (stage.shaderName != "blur" || stage.mode == NO_EFFECT)
+      {
+         draws->push_back(passes[i]);
+         continue;
+      }
+
+      EffectPass first = passes[i];
+      first.post.clear();
+      first.axis = firstAxis;
+      EffectPass second = passes[i];
+      second.pre.clear();
+      second.axis = 1 - firstAxis;
+      draws->push_back(first);
+      draws->push_back(second);
+   }
+}
+
+// whether a pass's pre or post colour stages are looked up in a baked table.
+// Filter and convolution results can fall outside [0, 1], past what the
+// table covers, so the stages after one are applied directly.
+bool UsesColourLut(const EffectPass &pass, bool post)
+{
+   const vector<EffectStage> &stages = post ? pass.post : pass.pre;
+   if (!colourLuts_.enabled || stages.size() < COLOUR_LUT_MIN_STAGES)
+      return false;
+   return !post || pass.stage.mode == NO_EFFECT || pass.stage.shaderName == "blur";
+}
+
+// render targets that have been drawn from, kept for reuse by later passes
+// and frames instead of being reallocated
+struct RenderTargetPool
+{
+   vector<MyRenderTarget> available;
+
+   // targets created over the pool's lifetime
+   int allocations;
+
+   RenderTargetPool() : allocations(0)
+   {}
+};
+
+// returns a free target of the given size, replacing a free target of some
+// other size, or creating a new one, when there is none
+MyRenderTarget AcquireRenderTarget(RenderTargetPool *pool, int width, int height)
+{
+   MyRenderTarget target;
+   for (size_t i = 0; i < pool->available.size(); i++)
+   {
+      if (pool->available[i].width == width && pool->available[i].height == height)
+      {
+         target = pool->available[i];
+         pool->available.erase(pool->available.begin() + i);
+         return target;
+      }
+   }
+
+   if (!pool->available.empty())
+   {
+      DestroyRenderTarget(&pool->available.front());
+      pool->available.erase(pool->available.begin());
+   }
+   InitializeRenderTarget(&target, width, height);
+   pool->allocations++;
+   return target;
+}
+
+void ReleaseRenderTarget(RenderTargetPool *pool, const MyRenderTarget &target)
+{
+   if (target.framebuffer)
+      pool->available.push_back(target);
+}
+
+void DestroyRenderTargetPool(RenderTargetPool *pool)
+{
+   for (size_t i = 0; i < pool->available.size(); i++)
+      DestroyRenderTarget(&pool->available[i]);
+   pool->available.clear();
+}
+
+struct EffectPipeline
+{
+   // generated pass programs are kept here under "pass:" names
+   ShaderRegistry *shaders;
+   RenderTargetPool targets;
+
+   // vertex shader, and the stage functions by shader name
+   string vertexSource;
+   map<string, string> librarySources;
+
+   // colour lookup tables uploaded as 3D textures, by ColourLutKey
+   map<string, GLuint> colourLutTextures;
+
+   // whether filter, blur and separable convolution passes run as compute
+   // shaders, which need OpenGL 4.3
+   bool useCompute;
+
+   // image quad for the last reduced copy or region of an image that
+   // effects ran on, and its size
+   MyGeometry targetQuad;
+   int targetQuadWidth;
+   int targetQuadHeight;
+
+   EffectPipeline() : shaders(0), useCompute(false), targetQuadWidth(0), targetQuadHeight(0)
+   {}
+};
+
+// name of the program variant for a pass, e.g. "pass:colour2>blur3y>colour4";
+// every mode, blur or convolution kernel and axis gets its own program.
+// Colour stages taken from a table show as "lut", the table being bound
+// separately, so all chains share that program.
+string PassProgramName(const EffectPass &pass)
+{
+   ostringstream name;
+   name << "pass:";
+   if (UsesColourLut(pass, false))
+      name << "lut";
+   else
+      for (size_t i = 0; i < pass.pre.size(); i++)
+         name << (i ? "," : "") << pass.pre[i].shaderName << pass.pre[i].mode;
+   name << ">";
+   if (pass.stage.mode != NO_EFFECT)
+   {
+      name << pass.stage.shaderName;
+      if (pass.stage.shaderName == "convolve")
+         name << KernelKey(pass.stage);
+      else if (pass.stage.shaderName == "blur" && pass.stage.blurSigma > 0.0f)
+         name << "s" << pass.stage.blurSigma;
+      else
+         name << pass.stage.mode;
+      if (pass.stage.shaderName == "blur" || (pass.stage.shaderName == "convolve" && pass.axis >= 0))
+         name << (pass.axis ? "y" : "x");
+   }
+   name << ">";
+   if (UsesColourLut(pass, true))
+      name << "lut";
+   else
+      for (size_t i = 0; i < pass.post.size(); i++)
+         name << (i ? "," : "") << pass.post[i].shaderName << pass.post[i].mode;
+   return name.str();
+}
+
+// the #define block specialising the stage libraries for a pass
+string PassDefines(const EffectPass &pass)
+{
+   ostringstream defines;
+   if (!UsesColourLut(pass, false))
+      for (size_t i = 0; i < pass.pre.size(); i++)
+         defines << "#define PRE_EFFECT" << i << " " << pass.pre[i].mode << "\n";
+   if (!UsesColourLut(pass, true))
+      for (size_t i = 0; i < pass.post.size(); i++)
+         defines << "#define POST_EFFECT" << i << " " << pass.post[i].mode << "\n";
+
+   if (pass.stage.mode != NO_EFFECT && pass.stage.shaderName == "filter")
+      defines << "#define FILTER_EFFECT " << pass.stage.mode << "\n";
+   else if (pass.stage.mode != NO_EFFECT && pass.stage.shaderName == "blur")
+   {
+      BlurKernel blur;
+      BuildBlurKernel(&blur, pass.stage);
+      defines << scientific << setprecision(8)
+         << "#define BLUR_DIRECTION " << (pass.axis ? "vec2(0.0, 1.0)" : "vec2(1.0, 0.0)") << "\n"
+         << "#define BLUR_TAPS " << blur.tapCount << "\n"
+         << "#define BLUR_WEIGHTS";
+      for (int i = 0; i <= blur.tapCount; i++)
+         defines << (i ? ", " : " ") << blur.tapWeights[i];
+      defines << "\n#define BLUR_OFFSETS";
+      for (int i = 0; i <= blur.tapCount; i++)
+         defines << (i ? ", " : " ") << blur.tapOffsets[i];
+      defines << "\n";
+   }
+   else if (pass.stage.mode != NO_EFFECT && pass.stage.shaderName == "convolve")
+   {
+      // the first of two separable passes leaves the bias to the second,
+      // which reads luminance already reduced to grey
+      vector<ConvolutionTap> taps;
+      ConvolutionTaps(pass.stage, pass.axis, &taps);
+      bool first = false;
+      if (pass.axis >= 0)
+      {
+         KernelFactors factors;
+         FactorKernel(pass.stage, &factors);
+         first = pass.axis == factors.firstAxis;
+      }
+      defines << scientific << setprecision(8)
+         << "#define CONVOLVE_TAPS " << taps.size() << "\n"
+         << "#define CONVOLVE_LUMINANCE " << (pass.stage.kernelLuminance && (pass.axis < 0 || first)) << "\n"
+         << "#define CONVOLVE_BIAS " << (first ? 0.0f : pass.stage.kernelBias) << "\n"
+         << "#define CONVOLVE_WEIGHTS";
+      for (size_t i = 0; i < taps.size(); i++)
+         defines << (i ? ", " : " ") << taps[i].weight;
+      defines << "\n#define CONVOLVE_OFFSETS";
+      for (size_t i = 0; i < taps.size(); i++)
+         defines << (i ? ", " : " ") << "vec2(" << taps[i].dx << ".0, " << taps[i].dy << ".0)";
+      defines << "\n";
+   }
+   return defines.str();
+}
+
+// the colour library and table lookups a pass's pre and post stages need
+string PassColourSource(const EffectPipeline *pipeline, const EffectPass &pass)
+{
+   bool preLut = UsesColourLut(pass, false);
+   bool postLut = UsesColourLut(pass, true);
+
+   ostringstream source;
+   if ((!pass.pre.empty() && !preLut) || (!pass.post.empty() && !postLut))
+      source << pipeline->librarySources.find("colour")->second << "\n";
+
+   // table lookups sample the centres of the first and last texels at 0 and 1
+   if (preLut)
+      source << "uniform sampler3D preLut;\n";
+   if (postLut)
+      source << "uniform sampler3D postLut;\n";
+   if (preLut || postLut)
+      source << "vec4 ColourLut(sampler3D lut, vec4 colour)\n{\n"
+         << "\tfloat size = float(textureSize(lut, 0).x);\n"
+         << "\treturn texture(lut, (clamp(colour.rgb, 0.0, 1.0) * (size - 1.0) + 0.5) / size);\n}\n";
+   return source.str();
+}
+
+// statements applying a pass's pre or post stages to "colour"
+string PassColourStatements(const EffectPass &pass, bool post)
+{
+   ostringstream source;
+   if (UsesColourLut(pass, post))
+      source << "\tcolour = ColourLut(" << (post ? "postLut" : "preLut") << ", colour);\n";
+   else
+      for (size_t i = 0; i < (post ? pass.post : pass.pre).size(); i++)
+         source << "\tcolour = ColourEffect(colour, " << (post ? "POST_EFFECT" : "PRE_EFFECT") << i << ");\n";
+   return source.str();
+}
+
+// writes the fragment shader for a pass: its #defines, the stage libraries
+// it needs, a Sample() that applies the pre stages to each texel read, and a
+// main() that runs the neighbourhood stage and then the post stages
+string GeneratePassSource(const EffectPipeline *pipeline, const EffectPass &pass)
+{
+   ostringstream source;
+   source << "#version 410\n"
+      << PassDefines(pass)
+      << "in vec2 textureCoords;\n"
+      << "out vec4 FragmentColour;\n"
+      << "uniform sampler2DRect tex;\n"
+      << "vec4 Sample(vec2 coords);\n"
+      << PassColourSource(pipeline, pass);
+   if (pass.stage.mode != NO_EFFECT)
+      source << pipeline->librarySources.find(pass.stage.shaderName)->second << "\n";
+
+   source << "vec4 Sample(vec2 coords)\n{\n"
+      << "\tvec4 colour = texture(tex, coords);\n"
+      << PassColourStatements(pass, false)
+      << "\treturn colour;\n}\n";
+
+   source << "void main(void)\n{\n";
+   if (pass.stage.mode == NO_EFFECT)
+      source << "\tvec4 colour = Sample(textureCoords);\n";
+   else if (pass.stage.shaderName == "filter")
+      source << "\tvec4 colour = Filter(textureCoords);\n";
+   else if (pass.stage.shaderName == "convolve")
+      source << "\tvec4 colour = Convolve(textureCoords);\n";
+   else
+      source << "\tvec4 colour = Blur(textureCoords);\n";
+   source << PassColourStatements(pass, true)
+      << "\tFragmentColour = colour;\n}\n";
+   return source.str();
+}
+
+// --------------------------------------------------------------------------
+// Compute passes. With OpenGL 4.3 and --compute, filter passes and the row
+// and column passes of blurs and separable convolutions run as compute
+// shaders that load each workgroup's texels and halo into shared memory
+// once, rather than every fragment fetching its whole neighbourhood. Whether
+// that pays off depends on the GPU (software rasterisers such as llvmpipe
+// are slower with it), so it is off by default; --benchmark times both.
+// They write the same RGBA8 targets the fragment passes render to, so
+// either kind can follow the other; a chain ending in a compute pass is
+// drawn out by a plain copy.
+
+// workgroup side for filters, and texels per workgroup along a row or
+// column for separable passes
+static const int COMPUTE_GROUP_SIZE = 16;
+static const int COMPUTE_LINE_SIZE = 256;
+
+bool UsesComputePass(const EffectPipeline *pipeline, const EffectPass &pass)
+{
+   if (!pipeline->useCompute || pass.stage.mode == NO_EFFECT)
+      return false;
+   const string &shaderName = pass.stage.shaderName;
+   return shaderName == "filter" || shaderName == "blur" || (shaderName == "convolve" && pass.axis >= 0);
+}
+
+// name of the compute variant of a pass, e.g. "compute:colour2>blur3y>"
+string ComputeProgramName(const EffectPass &pass)
+{
+   return "compute:" + PassProgramName(pass).substr(5);
+}
+
+// the taps of a separable pass as whole texel offsets along its axis
+void LineTaps(const EffectPass &pass, vector<ConvolutionTap> *taps)
+{
+   taps->clear();
+   if (pass.stage.shaderName == "convolve")
+   {
+      ConvolutionTaps(pass.stage, pass.axis, taps);
+      for (size_t i = 0; i < taps->size(); i++)
+         (*taps)[i].dx = pass.axis ? (*taps)[i].dy : (*taps)[i].dx;
+      return;
+   }
+
+   BlurKernel blur;
+   BuildBlurKernel(&blur, pass.stage);
+   for (int offset = -blur.radius; offset <= blur.radius; offset++)
+   {
+      ConvolutionTap tap = { offset, 0, blur.weights[abs(offset)] };
+      taps->push_back(tap);
+   }
+}
+
+// writes the compute shader for a pass: its #defines, the colour stages, a
+// Load() that reads a texel clamped to the edge and applies the pre stages,
+// a Finish() that applies the post stages, then the filter or separable
+// library, which provides main()
+string GenerateComputeSource(const EffectPipeline *pipeline, const EffectPass &pass)
+{
+   ostringstream source;
+   source << "#version 430\n";
+   for (size_t i = 0; i < pass.pre.size() && !UsesColourLut(pass, false); i++)
+      source << "#define PRE_EFFECT" << i << " " << pass.pre[i].mode << "\n";
+   for (size_t i = 0; i < pass.post.size() && !UsesColourLut(pass, true); i++)
+      source << "#define POST_EFFECT" << i << " " << pass.post[i].mode << "\n";
+
+   string library;
+   if (pass.stage.shaderName == "filter")
+   {
+      source << "#define FILTER_EFFECT " << pass.stage.mode << "\n"
+         << "#define GROUP_SIZE " << COMPUTE_GROUP_SIZE << "\n";
+      library = "filterCompute";
+   }
+   else
+   {
+      // the first of two separable convolution passes leaves the bias to the
+      // second, which reads luminance already reduced to grey
+      vector<ConvolutionTap> taps;
+      LineTaps(pass, &taps);
+      int radius = 0;
+      for (size_t i = 0; i < taps.size(); i++)
+         radius = max(radius, abs(taps[i].dx));
+      bool convolve = pass.stage.shaderName == "convolve";
+      bool first = false;
+      if (convolve)
+      {
+         KernelFactors factors;
+         FactorKernel(pass.stage, &factors);
+         first = pass.axis == factors.firstAxis;
+      }
+
+      source << scientific << setprecision(8)
+         << "#define LINE_SIZE " << COMPUTE_LINE_SIZE << "\n"
+         << "#define LINE_DIRECTION " << (pass.axis ? "ivec2(0, 1)" : "ivec2(1, 0)") << "\n"
+         << "#define LINE_TAPS " << taps.size() << "\n"
+         << "#define LINE_RADIUS " << radius << "\n"
+         << "#define LINE_CONVOLVE " << convolve << "\n"
+         << "#define LINE_LUMINANCE " << (convolve && first && pass.stage.kernelLuminance) << "\n"
+         << "#define LINE_BIAS " << (first ? 0.0f : pass.stage.kernelBias) << "\n"
+         << "#define LINE_WEIGHTS";
+      for (size_t i = 0; i < taps.size(); i++)
+         source << (i ? ", " : " ") << taps[i].weight;
+      source << "\n#define LINE_OFFSETS";
+      for (size_t i = 0; i < taps.size(); i++)
+         source << (i ? ", " : " ") << taps[i].dx;
+      source << "\n";
+      library = "separableCompute";
+   }
+
+   source << "uniform sampler2DRect tex;\n"
+      << PassColourSource(pipeline, pass)
+      << "vec4 Load(ivec2 texel)\n{\n"
+      << "\tvec4 colour = texelFetch(tex, clamp(texel, ivec2(0), textureSize(tex) - 1));\n"
+      << PassColourStatements(pass, false)
+      << "\treturn colour;\n}\n"
+      << "vec4 Finish(vec4 colour)\n{\n"
+      << PassColourStatements(pass, true)
+      << "\treturn colour;\n}\n"
+      << pipeline->librarySources.find(library)->second << "\n";
+   return source.str();
+}
+
+// runs a compute pass over the input into the target, which must be the
+// input's size, with the pass's program and colour tables bound
+void DispatchComputePass(const EffectPass &pass, const MyTexture &input, const MyRenderTarget &target)
+{
+#ifdef GL_VERSION_4_3
+   glBindTexture(GL_TEXTURE_RECTANGLE, input.textureID);
+   glBindImageTexture(0, target.texture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
+   if (pass.stage.shaderName == "filter")
+      glDispatchCompute((target.width + COMPUTE_GROUP_SIZE - 1) / COMPUTE_GROUP_SIZE,
+                        (target.height + COMPUTE_GROUP_SIZE - 1) / COMPUTE_GROUP_SIZE, 1);
+   else if (pass.axis == 0)
+      glDispatchCompute((target.width + COMPUTE_LINE_SIZE - 1) / COMPUTE_LINE_SIZE, target.height, 1);
+   else
+      glDispatchCompute((target.height + COMPUTE_LINE_SIZE - 1) / COMPUTE_LINE_SIZE, target.width, 1);
+   glBindImageTexture(0, 0, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
+   glBindTexture(GL_TEXTURE_RECTANGLE, 0);
+
+   // the next pass samples the target, or it is read back or blitted through
+   // its framebuffer
+   glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_FRAMEBUFFER_BARRIER_BIT);
+#endif
+}
+
+// loads the stage libraries the pass programs are generated from
+bool InitializeEffectPipeline(EffectPipeline *pipeline, ShaderRegistry *shaders)
+{
+   pipeline->shaders = shaders;
+   pipeline->vertexSource = LoadSource("vertex.glsl");
+   pipeline->librarySources["colour"] = LoadSource("colourFragment.glsl");
+   pipeline->librarySources["filter"] = LoadSource("filterFragment.glsl");
+   pipeline->librarySources["blur"] = LoadSource("blurFragment.glsl");
+   pipeline->librarySources["convolve"] = LoadSource("convolveFragment.glsl");
+   pipeline->librarySources["filterCompute"] = LoadSource("filterCompute.glsl");
+   pipeline->librarySources["separableCompute"] = LoadSource("separableCompute.glsl");
+   if (pipeline->vertexSource.empty())
+      return false;
+   for (map<string, string>::iterator it = pipeline->librarySources.begin(); it != pipeline->librarySources.end(); ++it)
+      if (it->second.empty())
+         return false;
+   return true;
+}
+
+// returns the program for a pass, generating it on first use. If a compute
+// program fails to build, compute passes are turned off and the fragment
+// program is returned instead.
+MyShader *PassProgram(EffectPipeline *pipeline, const EffectPass &pass)
+{
+   if (UsesComputePass(pipeline, pass))
+   {
+      string name = ComputeProgramName(pass);
+      MyShader *shader = FindShaderProgram(pipeline->shaders, name);
+      if (!shader && AddComputeProgram(pipeline->shaders, name, GenerateComputeSource(pipeline, pass)))
+         shader = FindShaderProgram(pipeline->shaders, name);
+      if (shader)
+         return shader;
+
+      cout << "Compute shaders failed to build, using fragment shaders instead" << endl;
+      pipeline->useCompute = false;
+   }
+
+   string name = PassProgramName(pass);
+   MyShader *shader = FindShaderProgram(pipeline->shaders, name);
+   if (!shader && AddShaderProgram(pipeline->shaders, name, pipeline->vertexSource, GeneratePassSource(pipeline, pass)))
+      shader = FindShaderProgram(pipeline->shaders, name);
+   return shader;
+}
+
+// the 3D texture for a run of colour stages, uploaded on first use
+GLuint ColourLutTexture(EffectPipeline *pipeline, const vector<EffectStage> &stages)
+{
+   string key = ColourLutKey(stages);
+   map<string, GLuint>::iterator it = pipeline->colourLutTextures.find(key);
+   if (it != pipeline->colourLutTextures.end())
+      return it->second;
+
+   const ColourLut *lut = FindColourLut(stages);
+   GLuint texture = 0;
+   glGenTextures(1, &texture);
+   glBindTexture(GL_TEXTURE_3D, texture);
+   glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA16F, lut->size, lut->size, lut->size, 0, GL_RGBA, GL_FLOAT, lut->table.data());
+   glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+   glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+   glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+   glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+   glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+   glBindTexture(GL_TEXTURE_3D, 0);
+   pipeline->colourLutTextures[key] = texture;
+   return texture;
+}
+
+// binds the tables a pass looks its colour stages up in to texture units 1
+// (pre) and 2 (post), or unbinds them after the draw
+void BindColourLuts(EffectPipeline *pipeline, MyShader *shader, const EffectPass &pass, bool bind)
+{
+   for (int post = 0; post < 2; post++)
+   {
+      if (!UsesColourLut(pass, post != 0)) continue;
+      glActiveTexture(GL_TEXTURE1 + post);
+      if (bind)
+      {
+         glUseProgram(shader->program);
+         glUniform1i(glGetUniformLocation(shader->program, post ? "postLut" : "preLut"), 1 + post);
+         glBindTexture(GL_TEXTURE_3D, ColourLutTexture(pipeline, post ? pass.post : pass.pre));
+      }
+      else
+         glBindTexture(GL_TEXTURE_3D, 0);
+      glActiveTexture(GL_TEXTURE0);
+   }
+}
+
+// the passes the GPU runs for a chain: the separable passes split in two,
+// and a plain copy after a final compute pass to draw its result out
+void PlanGpuPasses(const EffectPipeline *pipeline, const vector<EffectStage> &chain, vector<EffectPass> *draws)
+{
+   vector<EffectPass> passes;
+   PlanEffectPasses(chain, &passes);
+   SplitSeparablePasses(passes, draws);
+   if (UsesComputePass(pipeline, draws->back()))
+      draws->push_back(EffectPass());
+}
+
+// builds the programs a chain needs ahead of its first frame
+bool PrepareEffectChain(EffectPipeline *pipeline, const vector<EffectStage> &chain)
+{
+   vector<EffectPass> draws;
+   PlanGpuPasses(pipeline, chain, &draws);
+   for (size_t i = 0; i < draws.size(); i++)
+      if (!PassProgram(pipeline, draws[i]))
+         return false;
+   return true;
+}
+
+// the image quad for a target of the given size holding a reduced copy or
+// a region of an image, with texture coordinates in the target's texels;
+// rebuilt when the size changes
+MyGeometry *TargetQuad(EffectPipeline *pipeline, int width, int height)
+{
+   if (pipeline->targetQuadWidth != width || pipeline->targetQuadHeight != height)
+   {
+      MyTexture target;
+      target.width = width;
+      target.height = height;
+      DestroyGeometry(&pipeline->targetQuad);
+      InitializeGeometry(&pipeline->targetQuad, &target);
+      pipeline->targetQuadWidth = width;
+      pipeline->targetQuadHeight = height;
+   }
+   return &pipeline->targetQuad;
+}
+
+// draws the image with the chain applied into the currently bound
+// framebuffer, using the given transform for the final pass. Below a scale
+// of 1 a copy first shrinks the image by it, the effect passes run on the
+// copy and a final copy stretches their result over the framebuffer; a
+// chain of per-pixel stages alone already runs once per framebuffer pixel,
+// so it is never reduced.
+bool RenderEffectChain(EffectPipeline *pipeline, MyGeometry *geometry, MyTexture *texture,
+                       const vector<EffectStage> &chain, const GLfloat *modelView, float scale = 1.0f)
+{
+   vector<EffectPass> draws;
+   PlanGpuPasses(pipeline, chain, &draws);
+
+   int width = texture->width;
+   int height = texture->height;
+   MyGeometry *reducedQuad = geometry;
+   if (scale < 1.0f && (draws.size() > 1 || draws[0].stage.mode != NO_EFFECT))
+   {
+      width = max(static_cast<int>(texture->width * scale + 0.5f), 1);
+      height = max(static_cast<int>(texture->height * scale + 0.5f), 1);
+      reducedQuad = TargetQuad(pipeline, width, height);
+      draws.insert(draws.begin(), EffectPass());
+      const EffectPass &last = draws.back();
+      if (last.stage.mode != NO_EFFECT || !last.pre.empty() || !last.post.empty())
+         draws.push_back(EffectPass());
+   }
+
+   GLint viewport[4];
+   GLint framebuffer;
+   glGetIntegerv(GL_VIEWPORT, viewport);
+   glGetIntegerv(GL_FRAMEBUFFER_BINDING, &framebuffer);
+
+   GLfloat fillMatrix[16];
+   MyTexture input = *texture;
+   MyRenderTarget previous;
+   bool success = true;
+   for (size_t i = 0; i < draws.size(); i++)
+   {
+      MyShader *shader = PassProgram(pipeline, draws[i]);
+      if (!shader)
+      {
+         success = false;
+         break;
+      }
+
+      // only the first pass reads the image itself; the rest read targets
+      MyGeometry *quad = i ? reducedQuad : geometry;
+      bool compute = UsesComputePass(pipeline, draws[i]);
+      string name = compute ? ComputeProgramName(draws[i]) : PassProgramName(draws[i]);
+      double start = ProfileBegin();
+      BindColourLuts(pipeline, shader, draws[i], true);
+      if (compute)
+      {
+         MyRenderTarget target = AcquireRenderTarget(&pipeline->targets, width, height);
+         glUseProgram(shader->program);
+         BeginGpuTimer(name);
+         DispatchComputePass(draws[i], input, target);
+         EndGpuTimer();
+         glUseProgram(0);
+         BindColourLuts(pipeline, shader, draws[i], false);
+         ProfileEnd(name, start);
+
+         ReleaseRenderTarget(&pipeline->targets, previous);
+         previous = target;
+         input = RenderTargetTexture(target);
+      }
+      else if (i + 1 == draws.size())
+      {
+         glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+         glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+         BeginGpuTimer(name);
+         RenderScene(quad, &input, shader, modelView);
+         EndGpuTimer();
+         BindColourLuts(pipeline, shader, draws[i], false);
+         ProfileEnd(name, start);
+      }
+      else
+      {
+         MyRenderTarget target = AcquireRenderTarget(&pipeline->targets, width, height);
+         glBindFramebuffer(GL_FRAMEBUFFER, target.framebuffer);
+         glViewport(0, 0, target.width, target.height);
+         BuildFillMatrix(input, false, fillMatrix);
+         BeginGpuTimer(name);
+         RenderScene(quad, &input, shader, fillMatrix);
+         EndGpuTimer();
+         BindColourLuts(pipeline, shader, draws[i], false);
+         ProfileEnd(name, start);
+
+         ReleaseRenderTarget(&pipeline->targets, previous);
+         previous = target;
+         input = RenderTargetTexture(target);
+      }
+   }
+   ReleaseRenderTarget(&pipeline->targets, previous);
+
+   glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+   glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+   return success;
+}
+
+void DestroyEffectPipeline(EffectPipeline *pipeline)
+{
+   DestroyRenderTargetPool(&pipeline->targets);
+   DestroyGeometry(&pipeline->targetQuad);
+   for (map<string, GLuint>::iterator it = pipeline->colourLutTextures.begin(); it != pipeline->colourLutTextures.end(); ++it)
+      glDeleteTextures(1, &it->second);
+   pipeline->colourLutTextures.clear();
+}
+
+// the chain for the given blur, filter and colour modes, in that order
+vector<EffectStage> KeyEffectChain(int blur, int filter, int colour)
+{
+   vector<EffectStage> chain;
+   chain.push_back(EffectStage("blur", blur));
+   chain.push_back(EffectStage("filter", filter));
+   chain.push_back(EffectStage("colour", colour));
+   return chain;
+}
+
+// the chain shown for an image, as selected with the b, f and c keys
+vector<EffectStage> ImageEffectChain(int image)
+{
+   return KeyEffectChain(blurs_.at(image), filters_.at(image), colourEffects_.at(image));
+}
+
+// builds the program variants for every chain the keys can select, so that
+// switching effects never compiles
+bool PrepareKeyEffectChains(EffectPipeline *pipeline)
+{
+   for (int blur = 0; blur < 4; blur++)
+      for (int filter = 0; filter < 4; filter++)
+         for (int colour = 0; colour < 5; colour++)
+            if (!PrepareEffectChain(pipeline, KeyEffectChain(blur, filter, colour)))
+               return false;
+   return true;
+}
+
+// --------------------------------------------------------------------------
+// Progressive refinement. While the view is panned or zoomed, effects run on
+// a reduced copy of the image that is stretched over the window, at a scale
+// picked from recent frame times to stay within a frame budget. Once input
+// has been still for a moment the view is redrawn at full resolution.
+
+// reduced scales are multiples of this step, so that only a few target sizes
+// and program variants are ever needed
+static const float PROGRESSIVE_SCALE_STEP = 0.25f;
+
+struct ProgressiveRendering
+{
+   bool enabled;
+
+   // seconds an interactive frame may take, and seconds without input after
+   // which a reduced view is refined
+   double frameBudget;
+   double settleDelay;
+
+   // glfwGetTime() of the last pan or zoom, the scale interactive frames run
+   // at, and their smoothed duration in seconds
+   double lastInput;
+   float scale;
+   double frameTime;
+
+   // whether the view on screen was drawn reduced and still needs refining
+   bool coarse;
+
+   ProgressiveRendering() : enabled(true), frameBudget(1.0 / 30), settleDelay(0.15),
+      lastInput(-1.0), scale(1.0f), frameTime(0.0), coarse(false)
+   {}
+};
+
+static ProgressiveRendering progressive_;
+
+// records a pan or zoom, which starts or extends an interaction
+void NoteInteraction(ProgressiveRendering *progressive)
+{
+   progressive->lastInput = glfwGetTime();
+}
+
+// whether input arrived recently enough for a frame to be drawn reduced
+bool IsInteracting(const ProgressiveRendering *progressive, double now)
+{
+   return progressive->enabled && now - progressive->lastInput < progressive->settleDelay;
+}
+
+// seconds until a reduced view is due to be refined, or -1 when the view on
+// screen is already at full resolution
+double RefinementWait(const ProgressiveRendering *progressive, double now)
+{
+   if (!progressive->coarse)
+      return -1.0;
+   return max(progressive->lastInput + progressive->settleDelay - now, 0.0);
+}
+
+// folds the duration of an interactive frame into the estimate and picks the
+// scale for the next one. Cost grows with the square of the scale. Smaller
+// scales are taken at once and larger ones a step at a time, so a single
+// fast frame cannot swing the view back over budget.
+void UpdateInteractiveScale(ProgressiveRendering *progressive, double seconds)
+{
+   progressive->frameTime = progressive->frameTime > 0.0 ? 0.7 * progressive->frameTime + 0.3 * seconds : seconds;
+   double ideal = progressive->scale * sqrt(progressive->frameBudget / max(progressive->frameTime, 1e-4));
+   float scale = static_cast<float>(floor(ideal / PROGRESSIVE_SCALE_STEP)) * PROGRESSIVE_SCALE_STEP;
+   scale = min(max(scale, PROGRESSIVE_SCALE_STEP), 1.0f);
+   if (scale > progressive->scale)
+      scale = progressive->scale + PROGRESSIVE_SCALE_STEP;
+
+   // the estimate carries over to the new scale as a prediction
+   float ratio = scale / progressive->scale;
+   progressive->frameTime *= ratio * ratio;
+   progressive->scale = scale;
+}
+
+// the chain to run on a copy of an image reduced by the given scale. Blurs
+// shrink with the image, so they cover the same part of it with fewer taps;
+// filters and convolution kernels keep their size in texels and reach a
+// little further while the view is reduced.
+vector<EffectStage> ReducedEffectChain(const vector<EffectStage> &chain, float scale)
+{
+   vector<EffectStage> reduced = chain;
+   for (size_t i = 0; i < reduced.size() && scale < 1.0f; i++)
+   {
+      EffectStage &stage = reduced[i];
+      if (stage.shaderName == "blur" && stage.mode != NO_EFFECT)
+         stage.blurSigma = (stage.blurSigma > 0.0f ? stage.blurSigma : BLUR_SIGMAS[stage.mode - 1]) * scale;
+   }
+   return reduced;
+}
+
+// builds the program variants the key chains need at every reduced scale, so
+// that interaction never compiles either
+bool PrepareReducedEffectChains(EffectPipeline *pipeline)
+{
+   for (float scale = PROGRESSIVE_SCALE_STEP; scale < 1.0f; scale += PROGRESSIVE_SCALE_STEP)
+      for (int blur = 1; blur < 4; blur++)
+         for (int filter = 0; filter < 4; filter++)
+            for (int colour = 0; colour < 5; colour++)
+               if (!PrepareEffectChain(pipeline, ReducedEffectChain(KeyEffectChain(blur, filter, colour), scale)))
+                  return false;
+   return true;
+}
+
+// --------------------------------------------------------------------------
+// Virtual textures for images too large to upload whole. The decoded image
+// and its mip pyramid stay on the CPU; each frame only the tiles of the level
+// matching the zoom that cover the viewport are uploaded, with a halo of
+// neighbouring pixels so effects can run on each tile alone. Tiles live in a
+// cache that evicts the least recently used ones beyond a byte budget.
+
+// halo around every tile, at least the reach of any chain the keys select
+// (blur radius 3 plus the 2 texels the filters reach)
+static const int TILE_HALO = 8;
+
+// tiles uploaded or processed per frame at most; the rest are drawn from a
+// coarser level and streamed in over the following frames
+static const int TILE_UPLOADS_PER_FRAME = 8;
+
+struct VirtualTexture
+{
+   struct Tile
+   {
+      // the tile and its halo as decoded, and with the effect chain applied
+      MyTexture source;
+      MyRenderTarget processed;
+
+      // the chain the processed texture was rendered with
+      string processedChain;
+
+      unsigned int lastUsedFrame;
+      list<long long>::iterator lruPosition;
+
+      Tile() : lastUsedFrame(0)
+      {}
+   };
+
+   // full resolution pixels and the mip pyramid, kept on the CPU
+   DecodedImage image;
+
+   // the full resolution size, standing in for the image texture when
+   // building geometry and view transforms
+   MyTexture extent;
+
+   // resident tiles by TileKey, most recently used at the front
+   map<long long, Tile> tiles;
+   list<long long> lru;
+
+   size_t budgetBytes;
+   size_t residentBytes;
+   unsigned int frame;
+
+   // quad filling a whole tile texture, for running effects over a tile,
+   // and the quads of the tiles drawn each frame
+   MyGeometry tileQuad;
+   MyGeometry drawQuads;
+
+   // statistics reported on exit
+   int uploads;
+   int evictions;
+
+   VirtualTexture() : budgetBytes(256 << 20), residentBytes(0), frame(0), uploads(0), evictions(0)
+   {}
+};
+
+long long TileKey(int level, int tileX, int tileY)
+{
+   return (static_cast<long long>(level) << 48) | (static_cast<long long>(tileY) << 24) | tileX;
+}
+
+// identifies what a chain does for comparing processed tiles; empty when the
+// chain has no effect, so tiles are drawn as decoded
+string EffectChainKey(const vector<EffectStage> &chain)
+{
+   vector<EffectPass> passes, draws;
+   PlanEffectPasses(chain, &passes);
+   SplitSeparablePasses(passes, &draws);
+   if (draws.size() == 1 && draws[0].pre.empty() && draws[0].post.empty() && draws[0].stage.mode == NO_EFFECT)
+      return "";
+
+   // passes looking colours up in a table share one program, so the stages
+   // baked into the table are added
+   string key;
+   for (size_t i = 0; i < draws.size(); i++)
+   {
+      key += PassProgramName(draws[i]);
+      if (UsesColourLut(draws[i], false))
+         key += "[" + ColourLutKey(draws[i].pre) + "]";
+      if (UsesColourLut(draws[i], true))
+         key += "[" + ColourLutKey(draws[i].post) + "]";
+      key += ";";
+   }
+   return key;
+}
+
+// uploads a tile of the given level with its halo, repeating the level's
+// edge pixels wherever the tile or its halo runs past them
+bool UploadTile(MyTexture *texture, const DecodedImage *image, int level, int tileX, int tileY)
+{
+   MipLevel source = ImageLevel(image, level);
+   int n = image->numComponents;
+   int size = TILE_SIZE + 2 * TILE_HALO;
+   int left = tileX * TILE_SIZE - TILE_HALO;
+   int bottom = tileY * TILE_SIZE - TILE_HALO;
+
+   DecodedImage tile;
+   tile.filename = image->filename;
+   tile.width = size;
+   tile.height = size;
+   tile.numComponents = n;
+
+   // tiles clear of the edges upload straight out of the level's rows
+   vector<unsigned char> copy;
+   if (left >= 0 && bottom >= 0 && left + size <= source.width && bottom + size <= source.height)
+   {
+      tile.pixels = source.pixels + (static_cast<size_t>(bottom) * source.width + left) * n;
+      glPixelStorei(GL_UNPACK_ROW_LENGTH, source.width);
+   }
+   else
+   {
+      copy.resize(static_cast<size_t>(size) * size * n);
+      for (int y = 0; y < size; y++)
+      {
+         int row = min(max(bottom + y, 0), source.height - 1);
+         const unsigned char *in = source.pixels + static_cast<size_t>(row) * source.width * n;
+         for (int x = 0; x < size; x++)
+            memcpy(&copy[(static_cast<size_t>(y) * size + x) * n], in + min(max(left + x, 0), source.width - 1) * n, n);
+      }
+      tile.pixels = copy.data();
+   }
+
+   bool success = UploadTexture(texture, &tile, GL_TEXTURE_RECTANGLE);
+   glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+   return success;
+}
+
+// takes over a decoded image with its mip pyramid, leaving it empty
+bool InitializeVirtualTexture(VirtualTexture *vt, DecodedImage *image, size_t budgetBytes)
+{
+   vt->image = *image;
+   *image = DecodedImage();
+   vt->budgetBytes = budgetBytes;
+   vt->extent.target = GL_TEXTURE_RECTANGLE;
+   vt->extent.width = vt->image.width;
+   vt->extent.height = vt->image.height;
+
+   MyTexture tile;
+   tile.width = TILE_SIZE + 2 * TILE_HALO;
+   tile.height = TILE_SIZE + 2 * TILE_HALO;
+   if (!InitializeGeometry(&vt->tileQuad, &tile))
+      return false;
+
+   // the tile quads change every frame, so they get their own buffers
+   InitializeStreamGeometry(&vt->drawQuads);
+
+   cout << "Showing " << vt->image.filename << " (" << vt->image.width << "x" << vt->image.height
+      << ") as tiles over " << ImageLevelCount(&vt->image) << " levels" << endl;
+   return !CheckGLErrors();
+}
+
+// bytes of one tile texture, padded to four bytes per texel like whole images
+size_t TileTextureBytes()
+{
+   return static_cast<size_t>(TILE_SIZE + 2 * TILE_HALO) * (TILE_SIZE + 2 * TILE_HALO) * 4;
+}
+
+void DestroyTile(VirtualTexture *vt, VirtualTexture::Tile *tile)
+{
+   DestroyTexture(&tile->source);
+   vt->residentBytes -= TileTextureBytes();
+   if (tile->processed.framebuffer)
+   {
+      DestroyRenderTarget(&tile->processed);
+      vt->residentBytes -= TileTextureBytes();
+   }
+}
+
+// evicts least recently used tiles until within budget, never evicting one
+// drawn in the current frame
+void TrimVirtualTexture(VirtualTexture *vt)
+{
+   while (vt->residentBytes > vt->budgetBytes && !vt->lru.empty())
+   {
+      map<long long, VirtualTexture::Tile>::iterator it = vt->tiles.find(vt->lru.back());
+      if (it->second.lastUsedFrame == vt->frame)
+         break;
+      DestroyTile(vt, &it->second);
+      vt->lru.pop_back();
+      vt->tiles.erase(it);
+      vt->evictions++;
+   }
+}
+
+// returns a tile ready to draw with the chain, uploading and processing it
+// if that is within the remaining budget for this frame, or null
+VirtualTexture::Tile *AcquireTile(VirtualTexture *vt, EffectPipeline *pipeline, const vector<EffectStage> &chain,
+                                  const string &chainKey, int level, int tileX, int tileY, int *budget)
+{
+   long long key = TileKey(level, tileX, tileY);
+   map<long long, VirtualTexture::Tile>::iterator it = vt->tiles.find(key);
+   bool resident = it != vt->tiles.end();
+   if (!resident || it->second.processedChain != chainKey)
+   {
+      if (*budget <= 0) return 0;
+      (*budget)--;
+   }
+
+   if (!resident)
+   {
+      VirtualTexture::Tile tile;
+      if (!UploadTile(&tile.source, &vt->image, level, tileX, tileY))
+      {
+         if (tile.source.textureID)
+            DestroyTexture(&tile.source);
+         return 0;
+      }
+      vt->lru.push_front(key);
+      tile.lruPosition = vt->lru.begin();
+      vt->residentBytes += TileTextureBytes();
+      vt->uploads++;
+      it = vt->tiles.insert(make_pair(key, tile)).first;
+   }
+   VirtualTexture::Tile *tile = &it->second;
+
+   if (tile->processedChain != chainKey)
+   {
+      if (!tile->processed.framebuffer)
+      {
+         if (!InitializeRenderTarget(&tile->processed, tile->source.width, tile->source.height))
+            return 0;
+         vt->residentBytes += TileTextureBytes();
+      }
+
+      GLint viewport[4];
+      GLint framebuffer;
+      glGetIntegerv(GL_VIEWPORT, viewport);
+      glGetIntegerv(GL_FRAMEBUFFER_BINDING, &framebuffer);
+      glBindFramebuffer(GL_FRAMEBUFFER, tile->processed.framebuffer);
+      glViewport(0, 0, tile->processed.width, tile->processed.height);
+
+      GLfloat fillMatrix[16];
+      BuildFillMatrix(tile->source, false, fillMatrix);
+      bool success = RenderEffectChain(pipeline, &vt->tileQuad, &tile->source, chain, fillMatrix);
+
+      glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+      glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+      if (!success) return 0;
+      tile->processedChain = chainKey;
+   }
+
+   tile->lastUsedFrame = vt->frame;
+   vt->lru.splice(vt->lru.begin(), vt->lru, tile->lruPosition);
+   return tile;
+}
+
+// the tiles of a level covering the given fraction of the image, inclusive
+void VisibleTileRange(const VirtualTexture *vt, int level, const double visible[4], int range[4])
+{
+   MipLevel source = ImageLevel(&vt->image, level);
+   range[0] = static_cast<int>(visible[0] * source.width) / TILE_SIZE;
+   range[1] = static_cast<int>(visible[1] * source.height) / TILE_SIZE;
+   range[2] = min((static_cast<int>(ceil(visible[2] * source.width)) - 1) / TILE_SIZE, (source.width - 1) / TILE_SIZE);
+   range[3] = min((static_cast<int>(ceil(visible[3] * source.height)) - 1) / TILE_SIZE, (source.height - 1) / TILE_SIZE);
+}
+
+// draws the image with the chain applied into the current framebuffer,
+// returning false while tiles it needs are still streaming in
+bool RenderVirtualTexture(VirtualTexture *vt, EffectPipeline *pipeline, const vector<EffectStage> &chain,
+                          const ViewTransform &view)
+{
+   double start = ProfileBegin();
+   vt->frame++;
+   string chainKey = EffectChainKey(chain);
+
+   glClearColor(0.2f, 0.2f, 0.2f, 1.0f);
+   glClear(GL_COLOR_BUFFER_BIT);
+   if (!vt->image.pixels)
+      return true;
+
+   GLint viewport[4];
+   glGetIntegerv(GL_VIEWPORT, viewport);
+   GLfloat width, height;
+   ImageAspectExtents(vt->extent, &width, &height);
+   double visible[4];
+   VisibleImageRect(view, width, height, visible);
+   if (visible[2] <= visible[0] || visible[3] <= visible[1])
+      return true;
+
+   // the coarsest level with at least one texel per screen pixel
+   int levels = ImageLevelCount(&vt->image);
+   double texelsPerPixel = min(vt->extent.width / (width * view.zoom * viewport[2]),
+                               vt->extent.height / (height * view.zoom * viewport[3]));
+   int level = texelsPerPixel > 1.0 ? min(static_cast<int>(floor(log2(texelsPerPixel))), levels - 1) : 0;
+
+   // the coarsest level is always brought in, so every missing tile has
+   // something to stand in for it
+   int range[4];
+   int unlimited = INT_MAX;
+   VisibleTileRange(vt, levels - 1, visible, range);
+   for (int y = range[1]; y <= range[3]; y++)
+      for (int x = range[0]; x <= range[2]; x++)
+         AcquireTile(vt, pipeline, chain, chainKey, levels - 1, x, y, &unlimited);
+
+   // a quad per tile, in image quad coordinates, and where it is found in its
+   // tile texture (or in a coarser tile while the tile itself is missing)
+   vector<GLfloat> vertices, coords;
+   vector<GLuint> textures;
+   MipLevel source = ImageLevel(&vt->image, level);
+   int budget = TILE_UPLOADS_PER_FRAME;
+   bool complete = true;
+   VisibleTileRange(vt, level, visible, range);
+   for (int y = range[1]; y <= range[3]; y++)
+   {
+      for (int x = range[0]; x <= range[2]; x++)
+      {
+         double u0 = static_cast<double>(x * TILE_SIZE) / source.width;
+         double v0 = static_cast<double>(y * TILE_SIZE) / source.height;
+         double u1 = min(static_cast<double>((x + 1) * TILE_SIZE) / source.width, 1.0);
+         double v1 = min(static_cast<double>((y + 1) * TILE_SIZE) / source.height, 1.0);
+
+         int found = level;
+         VirtualTexture::Tile *tile = AcquireTile(vt, pipeline, chain, chainKey, level, x, y, &budget);
+         if (!tile)
+         {
+            complete = false;
+            int none = 0;
+            while (!tile && ++found < levels)
+               tile = AcquireTile(vt, pipeline, chain, chainKey, found, x >> (found - level), y >> (found - level), &none);
+            if (!tile) continue;
+         }
+
+         MipLevel texels = ImageLevel(&vt->image, found);
+         double originX = TILE_HALO - (x >> (found - level)) * TILE_SIZE;
+         double originY = TILE_HALO - (y >> (found - level)) * TILE_SIZE;
+         GLfloat quad[4] = {
+            static_cast<GLfloat>((2 * u0 - 1) * width), static_cast<GLfloat>((2 * v0 - 1) * height),
+            static_cast<GLfloat>((2 * u1 - 1) * width), static_cast<GLfloat>((2 * v1 - 1) * height)
+         };
+         GLfloat texture[4] = {
+            static_cast<GLfloat>(originX + u0 * texels.width), static_cast<GLfloat>(originY + v0 * texels.height),
+            static_cast<GLfloat>(originX + u1 * texels.width), static_cast<GLfloat>(originY + v1 * texels.height)
+         };
+
+         // two triangles in the same order as the whole image quad
+         const int corners[6][2] = { { 0, 1 }, { 0, 3 }, { 2, 3 }, { 2, 3 }, { 2, 1 }, { 0, 1 } };
+         for (int i = 0; i < 6; i++)
+         {
+            vertices.push_back(quad[corners[i][0]]);
+            vertices.push_back(quad[corners[i][1]]);
+            coords.push_back(texture[corners[i][0]]);
+            coords.push_back(texture[corners[i][1]]);
+         }
+         textures.push_back(chainKey.empty() ? tile->source.textureID : tile->processed.texture);
+      }
+   }
+
+   glBindBuffer(GL_ARRAY_BUFFER, vt->drawQuads.vertexBuffer);
+   glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(GLfloat), vertices.data(), GL_STREAM_DRAW);
+   glBindBuffer(GL_ARRAY_BUFFER, vt->drawQuads.textureBuffer);
+   glBufferData(GL_ARRAY_BUFFER, coords.size() * sizeof(GLfloat), coords.data(), GL_STREAM_DRAW);
+   glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+   // the tiles already have their effects, so they are drawn with the
+   // program for no effect at all
+   MyShader *shader = PassProgram(pipeline, EffectPass());
+   if (shader)
+   {
+      GLfloat modelView[16];
+      BuildModelViewMatrix(view, modelView);
+      glUseProgram(shader->program);
+      glUniformMatrix4fv(shader->modelViewUniform, 1, GL_FALSE, modelView);
+      glBindVertexArray(vt->drawQuads.vertexArray);
+      for (size_t i = 0; i < textures.size(); i++)
+      {
+         glBindTexture(GL_TEXTURE_RECTANGLE, textures[i]);
+         glDrawArrays(GL_TRIANGLES, static_cast<GLint>(6 * i), 6);
+      }
+      glBindTexture(GL_TEXTURE_RECTANGLE, 0);
+      glBindVertexArray(0);
+      glUseProgram(0);
+   }
+   CheckGLErrors();
+
+   TrimVirtualTexture(vt);
+   ProfileEnd("tiles", start, vt->image.filename);
+   return complete;
+}
+
+void PrintVirtualTextureStats(const VirtualTexture *vt)
+{
+   cout << "Tile cache: " << vt->uploads << " uploads, " << vt->evictions << " evictions, "
+      << (vt->residentBytes >> 20) << " of " << (vt->budgetBytes >> 20) << " MB resident" << endl;
+}
+
+// frees the tiles and the image; safe on a virtual texture never initialized
+void DestroyVirtualTexture(VirtualTexture *vt)
+{
+   if (!vt->image.pixels) return;
+   PrintVirtualTextureStats(vt);
+   for (map<long long, VirtualTexture::Tile>::iterator it = vt->tiles.begin(); it != vt->tiles.end(); ++it)
+      DestroyTile(vt, &it->second);
+   DestroyDecodedImage(&vt->image);
+   DestroyGeometry(&vt->tileQuad);
+   DestroyGeometry(&vt->drawQuads);
+   *vt = VirtualTexture();
+}
+
+// --------------------------------------------------------------------------
+// Region of interest for whole images. Once the view is zoomed into part of
+// an image, only that part and a margin around it are processed, into a
+// cached target. Each region is cut out with a halo of the chain's reach and
+// processed alone, as tiles are, so it comes out as if the whole image had
+// been processed. Panning within the margin reuses the cache; panning past it
+// keeps the overlap and processes only the newly exposed strips.
+
+// regions are only processed for views needing at most this fraction of the
+// image; beyond it, processing the image whole is as cheap
+static const double REGION_MAX_FRACTION = 0.5;
+
+struct RegionCache
+{
+   // the processed part of the image as left, bottom, right and top in
+   // texels, and the texture and chain it was processed from
+   MyRenderTarget target;
+   int rect[4];
+   GLuint source;
+   string chainKey;
+
+   // quad that regions are copied out of the image with and the target is
+   // drawn with
+   MyGeometry drawQuad;
+
+   // texels processed over the cache's lifetime
+   long long processedTexels;
+
+   RegionCache() : source(0), processedTexels(0)
+   {
+      fill(rect, rect + 4, 0);
+   }
+};
+
+// texels the GPU passes for a chain read beyond the pixel being computed,
+// through all of its stages
+int EffectChainHalo(const vector<EffectStage> &chain)
+{
+   int halo = 0;
+   for (size_t i = 0; i < chain.size(); i++)
+   {
+      const EffectStage &stage = chain[i];
+      if (stage.mode == NO_EFFECT)
+         continue;
+      // filters sample the corners of the 3x3 texels around the pixel, so
+      // reach one texel past them, as on the CPU
+      if (stage.shaderName == "filter")
+         halo += 2;
+      else if (stage.shaderName == "blur")
+      {
+         // the last bilinear fetch can straddle the texel past the radius
+         BlurKernel kernel;
+         BuildBlurKernel(&kernel, stage);
+         halo += kernel.radius + 1;
+      }
+      else if (stage.shaderName == "convolve")
+         halo += KernelHalo(stage);
+   }
+   return halo;
+}
+
+// fills a stream geometry with one quad covering positions quad (left,
+// bottom, right, top) and texture coordinates coords
+void FillRegionQuad(MyGeometry *geometry, const GLfloat quad[4], const GLfloat coords[4])
+{
+   vector<GLfloat> vertices, textures;
+   const int corners[6][2] = { { 0, 1 }, { 0, 3 }, { 2, 3 }, { 2, 3 }, { 2, 1 }, { 0, 1 } };
+   for (int i = 0; i < 6; i++)
+   {
+      vertices.push_back(quad[corners[i][0]]);
+      vertices.push_back(quad[corners[i][1]]);
+      textures.push_back(coords[corners[i][0]]);
+      textures.push_back(coords[corners[i][1]]);
+   }
+   glBindBuffer(GL_ARRAY_BUFFER, geometry->vertexBuffer);
+   glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(GLfloat), vertices.data(), GL_STREAM_DRAW);
+   glBindBuffer(GL_ARRAY_BUFFER, geometry->textureBuffer);
+   glBufferData(GL_ARRAY_BUFFER, textures.size() * sizeof(GLfloat), textures.data(), GL_STREAM_DRAW);
+   glBindBuffer(GL_ARRAY_BUFFER, 0);
+   geometry->elementCount = 6;
+}
+
+// processes the part of the image in rect (left, bottom, right, top) into
+// the target at the given offset
+bool ProcessImageRegion(RegionCache *cache, EffectPipeline *pipeline, const MyTexture &texture,
+                        const vector<EffectStage> &chain, const int rect[4], const MyRenderTarget &target,
+                        int targetX, int targetY)
+{
+   int halo = EffectChainHalo(chain);
+   int left = max(rect[0] - halo, 0);
+   int bottom = max(rect[1] - halo, 0);
+   int right = min(rect[2] + halo, texture.width);
+   int top = min(rect[3] + halo, texture.height);
+   MyRenderTarget source = AcquireRenderTarget(&pipeline->targets, right - left, top - bottom);
+   MyRenderTarget processed = AcquireRenderTarget(&pipeline->targets, right - left, top - bottom);
+
+   GLint viewport[4];
+   GLint framebuffer;
+   glGetIntegerv(GL_VIEWPORT, viewport);
+   glGetIntegerv(GL_FRAMEBUFFER_BINDING, &framebuffer);
+
+   // cut the region and its halo out of the image with a draw rather than a
+   // blit, which would skip the swizzle that makes grey textures read grey
+   MyShader *copy = PassProgram(pipeline, EffectPass());
+   if (!copy)
+   {
+      ReleaseRenderTarget(&pipeline->targets, source);
+      ReleaseRenderTarget(&pipeline->targets, processed);
+      return false;
+   }
+   const GLfloat quad[4] = { -1.0f, -1.0f, 1.0f, 1.0f };
+   const GLfloat coords[4] = {
+      static_cast<GLfloat>(left), static_cast<GLfloat>(bottom), static_cast<GLfloat>(right), static_cast<GLfloat>(top)
+   };
+   const GLfloat identity[16] = { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 };
+   FillRegionQuad(&cache->drawQuad, quad, coords);
+   MyTexture image = texture;
+   glBindFramebuffer(GL_FRAMEBUFFER, source.framebuffer);
+   glViewport(0, 0, source.width, source.height);
+   RenderScene(&cache->drawQuad, &image, copy, identity);
+
+   glBindFramebuffer(GL_FRAMEBUFFER, processed.framebuffer);
+   glViewport(0, 0, processed.width, processed.height);
+   MyTexture input = RenderTargetTexture(source);
+   GLfloat fillMatrix[16];
+   BuildFillMatrix(input, false, fillMatrix);
+   bool success = RenderEffectChain(pipeline, TargetQuad(pipeline, input.width, input.height), &input, chain, fillMatrix);
+
+   // keep all but the halo
+   glBindFramebuffer(GL_READ_FRAMEBUFFER, processed.framebuffer);
+   glBindFramebuffer(GL_DRAW_FRAMEBUFFER, target.framebuffer);
+   glBlitFramebuffer(rect[0] - left, rect[1] - bottom, rect[2] - left, rect[3] - bottom,
+                     targetX, targetY, targetX + rect[2] - rect[0], targetY + rect[3] - rect[1],
+                     GL_COLOR_BUFFER_BIT, GL_NEAREST);
+
+   glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+   glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+   ReleaseRenderTarget(&pipeline->targets, source);
+   ReleaseRenderTarget(&pipeline->targets, processed);
+   cache->processedTexels += static_cast<long long>(rect[2] - rect[0]) * (rect[3] - rect[1]);
+   return success;
+}
+
+// makes the cache cover rect, copying over what it already holds of it and
+// processing the rest as up to four strips around that
+bool UpdateRegionCache(RegionCache *cache, EffectPipeline *pipeline, const MyTexture &texture,
+                       const vector<EffectStage> &chain, const string &chainKey, const int rect[4])
+{
+   GLint framebuffer;
+   glGetIntegerv(GL_FRAMEBUFFER_BINDING, &framebuffer);
+   MyRenderTarget target = AcquireRenderTarget(&pipeline->targets, rect[2] - rect[0], rect[3] - rect[1]);
+   if (!target.framebuffer)
+      return false;
+
+   bool valid = cache->target.framebuffer && cache->source == texture.textureID && cache->chainKey == chainKey;
+   int overlap[4] = {
+      max(rect[0], cache->rect[0]), max(rect[1], cache->rect[1]),
+      min(rect[2], cache->rect[2]), min(rect[3], cache->rect[3])
+   };
+   bool success = true;
+   if (valid && overlap[0] < overlap[2] && overlap[1] < overlap[3])
+   {
+      glBindFramebuffer(GL_READ_FRAMEBUFFER, cache->target.framebuffer);
+      glBindFramebuffer(GL_DRAW_FRAMEBUFFER, target.framebuffer);
+      glBlitFramebuffer(overlap[0] - cache->rect[0], overlap[1] - cache->rect[1],
+                        overlap[2] - cache->rect[0], overlap[3] - cache->rect[1],
+                        overlap[0] - rect[0], overlap[1] - rect[1], overlap[2] - rect[0], overlap[3] - rect[1],
+                        GL_COLOR_BUFFER_BIT, GL_NEAREST);
+
+      // below and above the overlap across the whole width, then beside it
+      const int strips[4][4] = {
+         { rect[0], rect[1], rect[2], overlap[1] },
+         { rect[0], overlap[3], rect[2], rect[3] },
+         { rect[0], overlap[1], overlap[0], overlap[3] },
+         { overlap[2], overlap[1], rect[2], overlap[3] }
+      };
+      for (int i = 0; i < 4 && success; i++)
+         if (strips[i][0] < strips[i][2] && strips[i][1] < strips[i][3])
+            success = ProcessImageRegion(cache, pipeline, texture, chain, strips[i], target,
+                                         strips[i][0] - rect[0], strips[i][1] - rect[1]);
+   }
+   else
+      success = ProcessImageRegion(cache, pipeline, texture, chain, rect, target, 0, 0);
+
+   ReleaseRenderTarget(&pipeline->targets, cache->target);
+   glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+   cache->target = target;
+   copy(rect, rect + 4, cache->rect);
+   cache->source = texture.textureID;
+   cache->chainKey = success ? chainKey : "";
+   return success;
+}
+
+// draws a whole image with the chain applied into the current framebuffer
+// from the cache, first processing whatever part of the view it lacks.
+// Returns false, leaving the image to be processed whole, when the chain has
+// no effects or the view needs too much of the image for a region to pay off.
+bool RenderImageRegion(RegionCache *cache, EffectPipeline *pipeline, const MyTexture &texture,
+                       const vector<EffectStage> &chain, const ViewTransform &view)
+{
+   string chainKey = EffectChainKey(chain);
+   if (chainKey.empty())
+      return false;
+
+   GLfloat width, height;
+   ImageAspectExtents(texture, &width, &height);
+   double visible[4];
+   VisibleImageRect(view, width, height, visible);
+   // pixels at the edge of the view filter between the texels either side
+   int needed[4] = {
+      max(static_cast<int>(floor(visible[0] * texture.width)) - 1, 0),
+      max(static_cast<int>(floor(visible[1] * texture.height)) - 1, 0),
+      min(static_cast<int>(ceil(visible[2] * texture.width)) + 1, texture.width),
+      min(static_cast<int>(ceil(visible[3] * texture.height)) + 1, texture.height)
+   };
+   if (needed[0] >= needed[2] || needed[1] >= needed[3])
+      return false;
+
+   bool covered = cache->target.framebuffer && cache->source == texture.textureID && cache->chainKey == chainKey
+      && needed[0] >= cache->rect[0] && needed[1] >= cache->rect[1]
+      && needed[2] <= cache->rect[2] && needed[3] <= cache->rect[3];
+   if (!covered)
+   {
+      // a margin of a quarter of the view on each side lets small pans
+      // through without processing anything
+      int marginX = (needed[2] - needed[0]) / 4;
+      int marginY = (needed[3] - needed[1]) / 4;
+      int rect[4] = {
+         max(needed[0] - marginX, 0), max(needed[1] - marginY, 0),
+         min(needed[2] + marginX, texture.width), min(needed[3] + marginY, texture.height)
+      };
+      if (static_cast<double>(rect[2] - rect[0]) * (rect[3] - rect[1])
+          > REGION_MAX_FRACTION * texture.width * texture.height)
+         return false;
+
+      if (!cache->drawQuad.vertexArray)
+         InitializeStreamGeometry(&cache->drawQuad);
+      double start = ProfileBegin();
+      bool success = UpdateRegionCache(cache, pipeline, texture, chain, chainKey, rect);
+      ProfileEnd("region", start);
+      if (!success)
+         return false;
+   }
+
+   // the part of the image quad the cache covers, and its texels
+   GLfloat quad[4] = {
+      (2.0f * cache->rect[0] / texture.width - 1) * width, (2.0f * cache->rect[1] / texture.height - 1) * height,
+      (2.0f * cache->rect[2] / texture.width - 1) * width, (2.0f * cache->rect[3] / texture.height - 1) * height
+   };
+   GLfloat coords[4] = {
+      0.0f, 0.0f, static_cast<GLfloat>(cache->target.width), static_cast<GLfloat>(cache->target.height)
+   };
+   FillRegionQuad(&cache->drawQuad, quad, coords);
+
+   // the cache already has the effects, so it is drawn with the program for
+   // no effect at all
+   MyShader *shader = PassProgram(pipeline, EffectPass());
+   if (!shader)
+      return false;
+   GLfloat modelView[16];
+   BuildModelViewMatrix(view, modelView);
+   MyTexture processed = RenderTargetTexture(cache->target);
+   RenderScene(&cache->drawQuad, &processed, shader, modelView);
+   return true;
+}
+
+// forgets the cached region, e.g. when another image is shown, handing its
+// target back to the pipeline's pool
+void ClearRegionCache(RegionCache *cache, EffectPipeline *pipeline)
+{
+   ReleaseRenderTarget(&pipeline->targets, cache->target);
+   cache->target = MyRenderTarget();
+   fill(cache->rect, cache->rect + 4, 0);
+   cache->source = 0;
+   cache->chainKey.clear();
+}
+
+void PrintRegionCacheStats(const RegionCache *cache)
+{
+   if (cache->processedTexels)
+      cout << "Region cache: " << cache->processedTexels << " texels processed" << endl;
+}
+
+void DestroyRegionCache(RegionCache *cache, EffectPipeline *pipeline)
+{
+   ClearRegionCache(cache, pipeline);
+   DestroyGeometry(&cache->drawQuad);
+   *cache = RegionCache();
+}
+
+// --------------------------------------------------------------------------
+// Contact sheet. The g key shows every image at once as a grid of
+// thumbnails, a page at a time. Thumbnails are decoded and shrunk on worker
+// threads and uploaded into the layers of one texture array; a page is drawn
+// by a single instanced draw, each tile taking its image's blur, filter and
+// colour effects from a uniform buffer.
+
+// longest side of a thumbnail, and the images per page: the uniform buffer
+// holds one entry of 32 bytes per image, well within the 16 KB every
+// implementation supports
+static const int THUMBNAIL_SIZE = 128;
+static const int GALLERY_PAGE_SIZE = 256;
+
+// an image shrunk to fit THUMBNAIL_SIZE, as RGBA rows bottom first
+struct Thumbnail
+{
+   int image;
+   int width;
+   int height;
+   vector<unsigned char> pixels;
+
+   // the thumbnail's size over the image's
+   float scale;
+
+   Thumbnail() : image(0), width(0), height(0), scale(0.0f)
+   {}
+};
+
+// worker threads making thumbnails for the images queued by index, first
+// come first served
+struct ThumbnailPool
+{
+   vector<thread> workers;
+   mutex lock;
+   condition_variable wake;
+   deque<int> queue;
+   deque<Thumbnail> completed;
+   bool stopping;
+
+   // called on a worker thread after each thumbnail, as for DecodePool
+   void (*onCompleted)();
+
+   ThumbnailPool() : stopping(false), onCompleted(0)
+   {}
+};
+
+// averages the block of the image under each thumbnail texel; grey images
+// are spread to RGB, and images without alpha get an opaque one
+void ShrinkToThumbnail(const DecodedImage &image, Thumbnail *thumbnail)
+{
+   double scale = min(static_cast<double>(THUMBNAIL_SIZE) / max(image.width, image.height), 1.0);
+   thumbnail->width = max(static_cast<int>(image.width * scale + 0.5), 1);
+   thumbnail->height = max(static_cast<int>(image.height * scale + 0.5), 1);
+   thumbnail->scale = static_cast<float>(thumbnail->width) / image.width;
+   thumbnail->pixels.assign(static_cast<size_t>(thumbnail->width) * thumbnail->height * 4, 0);
+
+   int n = image.numComponents;
+   for (int y = 0; y < thumbnail->height; y++)
+   {
+      int y0 = static_cast<int>(static_cast<long long>(y) * image.height / thumbnail->height);
+      int y1 = max(static_cast<int>(static_cast<long long>(y + 1) * image.height / thumbnail->height), y0 + 1);
+      for (int x = 0; x < thumbnail->width; x++)
+      {
+         int x0 = static_cast<int>(static_cast<long long>(x) * image.width / thumbnail->width);
+         int x1 = max(static_cast<int>(static_cast<long long>(x + 1) * image.width / thumbnail->width), x0 + 1);
+         unsigned int sums[4] = { 0, 0, 0, 0 };
+         for (int sy = y0; sy < y1; sy++)
+         {
+            const unsigned char *p = image.pixels + (static_cast<size_t>(sy) * image.width + x0) * n;
+            for (int sx = x0; sx < x1; sx++, p += n)
+            {
+               for (int c = 0; c < 3; c++)
+                  sums[c] += p[n < 3 ? 0 : c];
+               sums[3] += n == 2 || n == 4 ? p[n - 1] : 255;
+            }
+         }
+
+         unsigned int count = static_cast<unsigned int>((y1 - y0) * (x1 - x0));
+         unsigned char *out = &thumbnail->pixels[(static_cast<size_t>(y) * thumbnail->width + x) * 4];
+         for (int c = 0; c < 4; c++)
+            out[c] = static_cast<unsigned char>((sums[c] + count / 2) / count);
+      }
+   }
+}
+
+void ThumbnailWorker(ThumbnailPool *pool)
+{
+   unique_lock<mutex> guard(pool->lock);
+   while (true)
+   {
+      while (!pool->stopping && pool->queue.empty())
+         pool->wake.wait(guard);
+      if (pool->stopping) return;
+
+      Thumbnail thumbnail;
+      thumbnail.image = pool->queue.front();
+      pool->queue.pop_front();
+      string filename = imageFileNames_[thumbnail.image];
+      guard.unlock();
+
+      double start = ProfileBegin();
+      DecodedImage image;
+      DecodeImage(&image, filename);
+      if (image.pixels)
+         ShrinkToThumbnail(image, &thumbnail);
+      else
+         cout << "Unable to load image: " << filename << endl;
+      DestroyDecodedImage(&image);
+      ProfileEnd("thumbnail", start, filename);
+
+      guard.lock();
+      if (!thumbnail.pixels.empty())
+         pool->completed.push_back(thumbnail);
+      if (pool->onCompleted)
+         pool->onCompleted();
+   }
+}
+
+void InitializeThumbnailPool(ThumbnailPool *pool, unsigned int threadCount)
+{
+   for (unsigned int i = 0; i < max(threadCount, 1u); i++)
+      pool->workers.push_back(thread(ThumbnailWorker, pool));
+}
+
+void DestroyThumbnailPool(ThumbnailPool *pool)
+{
+   {
+      lock_guard<mutex> guard(pool->lock);
+      pool->stopping = true;
+   }
+   pool->wake.notify_all();
+   for (size_t i = 0; i < pool->workers.size(); i++)
+      pool->workers[i].join();
+   pool->workers.clear();
+   pool->queue.clear();
+   pool->completed.clear();
+}
+
+// queues thumbnails for a list of images, in order
+void RequestThumbnails(ThumbnailPool *pool, const vector<int> &images)
+{
+   {
+      lock_guard<mutex> guard(pool->lock);
+      pool->queue.insert(pool->queue.end(), images.begin(), images.end());
+   }
+   pool->wake.notify_all();
+}
+
+struct ContactSheet
+{
+   // one THUMBNAIL_SIZE square layer per image, and for each image the
+   // part of its layer the thumbnail fills (zero until it is uploaded) and
+   // its thumbnail's scale
+   GLuint textureArray;
+   int layers;
+   vector<GLfloat> extents;
+   vector<GLfloat> scales;
+
+   // the tile entries, the empty vertex array the instanced draw needs, and
+   // the program
+   GLuint uniformBuffer;
+   GLuint vertexArray;
+   MyShader *shader;
+
+   ThumbnailPool thumbnails;
+
+   ContactSheet() : textureArray(0), layers(0), uniformBuffer(0), vertexArray(0), shader(0)
+   {}
+};
+
+// the columns and rows of a page holding count images, as near square as
+// the count allows
+void GalleryGrid(int count, int *columns, int *rows)
+{
+   *columns = max(static_cast<int>(ceil(sqrt(static_cast<double>(count)))), 1);
+   *rows = max((count + *columns - 1) / *columns, 1);
+}
+
+int GalleryPageCount()
+{
+   return (imageCount_ + GALLERY_PAGE_SIZE - 1) / GALLERY_PAGE_SIZE;
+}
+
+// the image under a point of a window of the given size showing the page,
+// or -1 between images
+int GalleryImageAt(int page, double x, double y, int width, int height)
+{
+   int first = page * GALLERY_PAGE_SIZE;
+   int count = min(imageCount_ - first, GALLERY_PAGE_SIZE);
+   int columns, rows;
+   GalleryGrid(count, &columns, &rows);
+   int column = static_cast<int>(x * columns / width);
+   int row = static_cast<int>(y * rows / height);
+   if (column < 0 || column >= columns || row < 0 || row >= rows || row * columns + column >= count)
+      return -1;
+   return first + row * columns + column;
+}
+
+// builds the program and buffers, allocates a layer for every image the
+// array can hold, and starts making thumbnails for all of them with those
+// on the given page first
+bool InitializeContactSheet(ContactSheet *sheet, EffectPipeline *pipeline, int page, unsigned int threadCount)
+{
+   ostringstream defines;
+   defines << "#version 410\n#define GALLERY_PAGE_SIZE " << GALLERY_PAGE_SIZE << "\n";
+   string vertexSource = LoadSource("galleryVertex.glsl");
+   string fragmentSource = LoadSource("galleryFragment.glsl");
+   if (vertexSource.empty() || fragmentSource.empty() ||
+       !AddShaderProgram(pipeline->shaders, "gallery", defines.str() + vertexSource,
+                         defines.str() + pipeline->librarySources["colour"] + "\n" + fragmentSource))
+      return false;
+   sheet->shader = FindShaderProgram(pipeline->shaders, "gallery");
+   glUseProgram(sheet->shader->program);
+   glUniform1i(glGetUniformLocation(sheet->shader->program, "thumbnails"), 0);
+   glUniformBlockBinding(sheet->shader->program, glGetUniformBlockIndex(sheet->shader->program, "Tiles"), 0);
+   glUseProgram(0);
+
+   GLint maxLayers = 0;
+   glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+   sheet->layers = min(imageCount_, static_cast<int>(maxLayers));
+   glGenTextures(1, &sheet->textureArray);
+   glBindTexture(GL_TEXTURE_2D_ARRAY, sheet->textureArray);
+   glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, THUMBNAIL_SIZE, THUMBNAIL_SIZE, sheet->layers, 0,
+                GL_RGBA, GL_UNSIGNED_BYTE, 0);
+   glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+   glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+   glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+   glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+   glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+   sheet->extents.assign(2 * imageCount_, 0.0f);
+   sheet->scales.assign(imageCount_, 0.0f);
+
+   glGenBuffers(1, &sheet->uniformBuffer);
+   glBindBuffer(GL_UNIFORM_BUFFER, sheet->uniformBuffer);
+   glBufferData(GL_UNIFORM_BUFFER, GALLERY_PAGE_SIZE * 8 * sizeof(GLint), 0, GL_STREAM_DRAW);
+   glBindBuffer(GL_UNIFORM_BUFFER, 0);
+   glGenVertexArrays(1, &sheet->vertexArray);
+
+   vector<int> images;
+   for (int i = 0; i < sheet->layers; i++)
+      images.push_back((page * GALLERY_PAGE_SIZE + i) % sheet->layers);
+   InitializeThumbnailPool(&sheet->thumbnails, threadCount);
+   RequestThumbnails(&sheet->thumbnails, images);
+   return !CheckGLErrors();
+}
+
+// uploads the thumbnails finished since the last call, returning whether
+// there were any
+bool UploadThumbnails(ContactSheet *sheet)
+{
+   deque<Thumbnail> finished;
+   {
+      lock_guard<mutex> guard(sheet->thumbnails.lock);
+      finished.swap(sheet->thumbnails.completed);
+   }
+   if (finished.empty())
+      return false;
+
+   double start = ProfileBegin();
+   glBindTexture(GL_TEXTURE_2D_ARRAY, sheet->textureArray);
+   for (size_t i = 0; i < finished.size(); i++)
+   {
+      const Thumbnail &thumbnail = finished[i];
+      glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, thumbnail.image, thumbnail.width, thumbnail.height, 1,
+                      GL_RGBA, GL_UNSIGNED_BYTE, thumbnail.pixels.data());
+      sheet->extents[2 * thumbnail.image] = static_cast<GLfloat>(thumbnail.width) / THUMBNAIL_SIZE;
+      sheet->extents[2 * thumbnail.image + 1] = static_cast<GLfloat>(thumbnail.height) / THUMBNAIL_SIZE;
+      sheet->scales[thumbnail.image] = thumbnail.scale;
+   }
+   glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+   ProfileEnd("upload thumbnails", start);
+   return !CheckGLErrors();
+}
+
+// draws a page of the sheet over the whole viewport, framing the selected
+// image
+void RenderContactSheet(ContactSheet *sheet, int page, int selected)
+{
+   glClearColor(0.2f, 0.2f, 0.2f, 1.0f);
+   glClear(GL_COLOR_BUFFER_BIT);
+
+   int first = page * GALLERY_PAGE_SIZE;
+   int count = min(sheet->layers - first, GALLERY_PAGE_SIZE);
+   if (count <= 0)
+      return;
+
+   // each entry is an ivec4 of effects and layer, then a vec4 of the
+   // thumbnail's extent, blur sigma in its texels and selection
+   vector<GLint> entries(8 * count);
+   for (int i = 0; i < count; i++)
+   {
+      int image = first + i;
+      GLint *entry = &entries[8 * i];
+      entry[0] = colourEffects_[image];
+      entry[1] = filters_[image];
+      entry[2] = blurs_[image];
+      entry[3] = image;
+
+      GLfloat shape[4] = {
+         sheet->extents[2 * image], sheet->extents[2 * image + 1],
+         blurs_[image] != NO_EFFECT ? BLUR_SIGMAS[blurs_[image] - 1] * sheet->scales[image] : 0.0f,
+         image == selected ? 1.0f : 0.0f
+      };
+      memcpy(entry + 4, shape, sizeof(shape));
+   }
+   glBindBuffer(GL_UNIFORM_BUFFER, sheet->uniformBuffer);
+   glBufferSubData(GL_UNIFORM_BUFFER, 0, entries.size() * sizeof(GLint), entries.data());
+   glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+   int columns, rows;
+   GalleryGrid(count, &columns, &rows);
+   double start = ProfileBegin();
+   BeginGpuTimer("contact sheet");
+   glUseProgram(sheet->shader->program);
+   glUniform2i(glGetUniformLocation(sheet->shader->program, "grid"), columns, rows);
+   glBindBufferBase(GL_UNIFORM_BUFFER, 0, sheet->uniformBuffer);
+   glBindTexture(GL_TEXTURE_2D_ARRAY, sheet->textureArray);
+   glBindVertexArray(sheet->vertexArray);
+   glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, count);
+   glBindVertexArray(0);
+   glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+   glBindBufferBase(GL_UNIFORM_BUFFER, 0, 0);
+   glUseProgram(0);
+   EndGpuTimer();
+   ProfileEnd("contact sheet", start);
+   CheckGLErrors();
+}
+
+// stops the workers and frees the sheet; safe on a sheet never initialized
+void DestroyContactSheet(ContactSheet *sheet)
+{
+   DestroyThumbnailPool(&sheet->thumbnails);
+   glDeleteTextures(1, &sheet->textureArray);
+   glDeleteBuffers(1, &sheet->uniformBuffer);
+   glDeleteVertexArrays(1, &sheet->vertexArray);
+   sheet->textureArray = 0;
+   sheet->uniformBuffer = 0;
+   sheet->vertexArray = 0;
+   sheet->shader = 0;
+}
+
+// --------------------------------------------------------------------------
+// Row kernels for the CPU effect engine. Each kernel has a scalar version and
+// SSE4.1 / AVX2 versions, picked at runtime from what the processor supports.
+
+struct CpuKernels
+{
+   const char *name;
+
+   // dst = src / 255
+   void (*expand)(float *dst, const unsigned char *src, int count);
+   // dst = round(clamp(src, 0, 1) * 255)
+   void (*quantize)(unsigned char *dst, const float *src, int count);
+   // dst += weight * src
+   void (*axpy)(float *dst, const float *src, float weight, int count);
+   // dst = weight * src
+   void (*scale)(float *dst, const float *src, float weight, int count);
+   // dst = weight * |src|
+   void (*absScale)(float *dst, const float *src, float weight, int count);
+   // dst = dot(rgb, weights)
+   void (*dot3)(float *dst, const float *r, const float *g, const float *b, const float weights[3], int count);
+   // dst = length(rgb)
+   void (*length3)(float *dst, const float *r, const float *g, const float *b, int count);
+   // rgba = trilinear lookup of clamp(rgb, 0, 1) in a size^3 RGBA table
+   void (*colourLut)(float *const planes[4], const float *table, int size, int count);
+};
+
+void ExpandScalar(float *dst, const unsigned char *src, int count)
+{
+   for (int i = 0; i < count; i++)
+      dst[i] = src[i] * (1.0f / 255.0f);
+}
+
+void QuantizeScalar(unsigned char *dst, const float *src, int count)
+{
+   for (int i = 0; i < count; i++)
+      dst[i] = static_cast<unsigned char>(min(max(src[i], 0.0f), 1.0f) * 255.0f + 0.5f);
+}
+
+void AxpyScalar(float *dst, const float *src, float weight, int count)
+{
+   for (int i = 0; i < count; i++)
+      dst[i] += weight * src[i];
+}
+
+void ScaleScalar(float *dst, const float *src, float weight, int count)
+{
+   for (int i = 0; i < count; i++)
+      dst[i] = weight * src[i];
+}
+
+void AbsScaleScalar(float *dst, const float *src, float weight, int count)
+{
+   for (int i = 0; i < count; i++)
+      dst[i] = weight * fabs(src[i]);
+}
+
+void Dot3Scalar(float *dst, const float *r, const float *g, const float *b, const float weights[3], int count)
+{
+   for (int i = 0; i < count; i++)
+      dst[i] = r[i] * weights[0] + g[i] * weights[1] + b[i] * weights[2];
+}
+
+void Length3Scalar(float *dst, const float *r, const float *g, const float *b, int count)
+{
+   for (int i = 0; i < count; i++)
+      dst[i] = sqrt(r[i] * r[i] + g[i] * g[i] + b[i] * b[i]);
+}
+
+void ColourLutScalar(float *const planes[4], const float *table, int size, int count)
+{
+   const float scale = size - 1.0f;
+   const int strides[3] = { 4, 4 * size, 4 * size * size };
+   for (int i = 0; i < count; i++)
+   {
+      // the cell holding the colour, and the position within it
+      int base = 0;
+      float fraction[3];
+      for (int c = 0; c < 3; c++)
+      {
+         float position = min(max(planes[c][i], 0.0f), 1.0f) * scale;
+         int cell = min(static_cast<int>(position), size - 2);
+         fraction[c] = position - cell;
+         base += cell * strides[c];
+      }
+
+      float result[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+      for (int corner = 0; corner < 8; corner++)
+      {
+         float weight = 1.0f;
+         int offset = base;
+         for (int c = 0; c < 3; c++)
+         {
+            bool upper = (corner >> c) & 1;
+            weight *= upper ? fraction[c] : 1.0f - fraction[c];
+            offset += upper ? strides[c] : 0;
+         }
+         for (int c = 0; c < 4; c++)
+            result[c] += weight * table[offset + c];
+      }
+      for (int c = 0; c < 4; c++)
+         planes[c][i] = result[c];
+   }
+}
+
+static const CpuKernels scalarKernels_ = {
+   "scalar", ExpandScalar, QuantizeScalar, AxpyScalar, ScaleScalar, AbsScaleScalar, Dot3Scalar, Length3Scalar,
+   ColourLutScalar
+};
+
+#ifdef CPU_X86
+
+CPU_TARGET("sse4.1") void ExpandSse4(float *dst, const unsigned char *src, int count)
+{
+   const __m128 norm = _mm_set1_ps(1.0f / 255.0f);
+   int i = 0;
+   for (; i + 4 <= count; i += 4)
+   {
+      int packed;
+      memcpy(&packed, src + i, 4);
+      __m128i wide = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed));
+      _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(wide), norm));
+   }
+   ExpandScalar(dst + i, src + i, count - i);
+}
+
+CPU_TARGET("sse4.1") void QuantizeSse4(unsigned char *dst, const float *src, int count)
+{
+   const __m128 zero = _mm_setzero_ps();
+   const __m128 one = _mm_set1_ps(1.0f);
+   const __m128 range = _mm_set1_ps(255.0f);
+   const __m128 half = _mm_set1_ps(0.5f);
+   int i = 0;
+   for (; i + 4 <= count; i += 4)
+   {
+      __m128 v = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(src + i), zero), one);
+      __m128i wide = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(v, range), half));
+      __m128i narrow = _mm_packus_epi16(_mm_packs_epi32(wide, wide), wide);
+      int packed = _mm_cvtsi128_si32(narrow);
+      memcpy(dst + i, &packed, 4);
+   }
+   QuantizeScalar(dst + i, src + i, count - i);
+}
+
+CPU_TARGET("sse4.1") void AxpySse4(float *dst, const float *src, float weight, int count)
+{
+   const __m128 w = _mm_set1_ps(weight);
+   int i = 0;
+   for (; i + 4 <= count; i += 4)
+      _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_mul_ps(w, _mm_loadu_ps(src + i))));
+   AxpyScalar(dst + i, src + i, weight, count - i);
+}
+
+CPU_TARGET("sse4.1") void ScaleSse4(float *dst, const float *src, float weight, int count)
+{
+   const __m128 w = _mm_set1_ps(weight);
+   int i = 0;
+   for (; i + 4 <= count; i += 4)
+      _mm_storeu_ps(dst + i, _mm_mul_ps(w, _mm_loadu_ps(src + i)));
+   ScaleScalar(dst + i, src + i, weight, count - i);
+}
+
+CPU_TARGET("sse4.1") void AbsScaleSse4(float *dst, const float *src, float weight, int count)
+{
+   const __m128 w = _mm_set1_ps(weight);
+   const __m128 sign = _mm_set1_ps(-0.0f);
+   int i = 0;
+   for (; i + 4 <= count; i += 4)
+      _mm_storeu_ps(dst + i, _mm_mul_ps(w, _mm_andnot_ps(sign, _mm_loadu_ps(src + i))));
+   AbsScaleScalar(dst + i, src + i, weight, count - i);
+}
+
+CPU_TARGET("sse4.1") void Dot3Sse4(float *dst, const float *r, const float *g, const float *b, const float weights[3], int count)
+{
+   const __m128 wr = _mm_set1_ps(weights[0]);
+   const __m128 wg = _mm_set1_ps(weights[1]);
+   const __m128 wb = _mm_set1_ps(weights[2]);
+   int i = 0;
+   for (; i + 4 <= count; i += 4)
+   {
+      __m128 sum = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(r + i), wr),
+         _mm_mul_ps(_mm_loadu_ps(g + i), wg)), _mm_mul_ps(_mm_loadu_ps(b + i), wb));
+      _mm_storeu_ps(dst + i, sum);
+   }
+   Dot3Scalar(dst + i, r + i, g + i, b + i, weights, count - i);
+}
+
+CPU_TARGET("sse4.1") void Length3Sse4(float *dst, const float *r, const float *g, const float *b, int count)
+{
+   int i = 0;
+   for (; i + 4 <= count; i += 4)
+   {
+      __m128 vr = _mm_loadu_ps(r + i);
+      __m128 vg = _mm_loadu_ps(g + i);
+      __m128 vb = _mm_loadu_ps(b + i);
+      __m128 sum = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vr, vr), _mm_mul_ps(vg, vg)), _mm_mul_ps(vb, vb));
+      _mm_storeu_ps(dst + i, _mm_sqrt_ps(sum));
+   }
+   Length3Scalar(dst + i, r + i, g + i, b + i, count - i);
+}
+
+// SSE4.1 has no gather, so table lookups stay scalar
+static const CpuKernels sse4Kernels_ = {
+   "sse4", ExpandSse4, QuantizeSse4, AxpySse4, ScaleSse4, AbsScaleSse4, Dot3Sse4, Length3Sse4,
+   ColourLutScalar
+};
+
+CPU_TARGET("avx2") void ExpandAvx2(float *dst, const unsigned char *src, int count)
+{
+   const __m256 norm = _mm256_set1_ps(1.0f / 255.0f);
+   int i = 0;
+   for (; i + 8 <= count; i += 8)
+   {
+      __m256i wide = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(src + i)));
+      _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(wide), norm));
+   }
+   ExpandScalar(dst + i, src + i, count - i);
+}
+
+CPU_TARGET("avx2") void QuantizeAvx2(unsigned char *dst, const float *src, int count)
+{
+   const __m256 zero = _mm256_setzero_ps();
+   const __m256 one = _mm256_set1_ps(1.0f);
+   const __m256 range = _mm256_set1_ps(255.0f);
+   const __m256 half = _mm256_set1_ps(0.5f);
+   int i = 0;
+   for (; i + 8 <= count; i += 8)
+   {
+      __m256 v = _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(src + i), zero), one);
+      __m256i wide = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(v, range), half));
+      __m128i words = _mm_packs_epi32(_mm256_castsi256_si128(wide), _mm256_extracti128_si256(wide, 1));
+      _mm_storel_epi64(reinterpret_cast<__m128i *>(dst + i), _mm_packus_epi16(words, words));
+   }
+   QuantizeScalar(dst + i, src + i, count - i);
+}
+
+CPU_TARGET("avx2") void AxpyAvx2(float *dst, const float *src, float weight, int count)
+{
+   const __m256 w = _mm256_set1_ps(weight);
+   int i = 0;
+   for (; i + 8 <= count; i += 8)
+      _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(dst + i), _mm256_mul_ps(w, _mm256_loadu_ps(src + i))));
+   AxpyScalar(dst + i, src + i, weight, count - i);
+}
+
+CPU_TARGET("avx2") void ScaleAvx2(float *dst, const float *src, float weight, int count)
+{
+   const __m256 w = _mm256_set1_ps(weight);
+   int i = 0;
+   for (; i + 8 <= count; i += 8)
+      _mm256_storeu_ps(dst + i, _mm256_mul_ps(w, _mm256_loadu_ps(src + i)));
+   ScaleScalar(dst + i, src + i, weight, count - i);
+}
+
+CPU_TARGET("avx2") void AbsScaleAvx2(float *dst, const float *src, float weight, int count)
+{
+   const __m256 w = _mm256_set1_ps(weight);
+   const __m256 sign = _mm256_set1_ps(-0.0f);
+   int i = 0;
+   for (; i + 8 <= count; i += 8)
+      _mm256_storeu_ps(dst + i, _mm256_mul_ps(w, _mm256_andnot_ps(sign, _mm256_loadu_ps(src + i))));
+   AbsScaleScalar(dst + i, src + i, weight, count - i);
+}
+
+CPU_TARGET("avx2") void Dot3Avx2(float *dst, const float *r, const float *g, const float *b, const float weights[3], int count)
+{
+   const __m256 wr = _mm256_set1_ps(weights[0]);
+   const __m256 wg = _mm256_set1_ps(weights[1]);
+   const __m256 wb = _mm256_set1_ps(weights[2]);
+   int i = 0;
+   for (; i + 8 <= count; i += 8)
+   {
+      __m256 sum = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(r + i), wr),
+         _mm256_mul_ps(_mm256_loadu_ps(g + i), wg)), _mm256_mul_ps(_mm256_loadu_ps(b + i), wb));
+      _mm256_storeu_ps(dst + i, sum);
+   }
+   Dot3Scalar(dst + i, r + i, g + i, b + i, weights, count - i);
+}
+
+CPU_TARGET("avx2") void Length3Avx2(float *dst, const float *r, const float *g, const float *b, int count)
+{
+   int i = 0;
+   for (; i + 8 <= count; i += 8)
+   {
+      __m256 vr = _mm256_loadu_ps(r + i);
+      __m256 vg = _mm256_loadu_ps(g + i);
+      __m256 vb = _mm256_loadu_ps(b + i);
+      __m256 sum = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(vr, vr), _mm256_mul_ps(vg, vg)), _mm256_mul_ps(vb, vb));
+      _mm256_storeu_ps(dst + i, _mm256_sqrt_ps(sum));
+   }
+   Length3Scalar(dst + i, r + i, g + i, b + i, count - i);
+}
+
+// eight colours at a time, gathering each corner of their cells from the table
+CPU_TARGET("avx2") void ColourLutAvx2(float *const planes[4], const float *table, int size, int count)
+{
+   const __m256 zero = _mm256_setzero_ps();
+   const __m256 one = _mm256_set1_ps(1.0f);
+   const __m256 scale = _mm256_set1_ps(size - 1.0f);
+   const __m256i lastCell = _mm256_set1_epi32(size - 2);
+   const int strides[3] = { 4, 4 * size, 4 * size * size };
+   int i = 0;
+   for (; i + 8 <= count; i += 8)
+   {
+      __m256i base = _mm256_setzero_si256();
+      __m256 fraction[3];
+      for (int c = 0; c < 3; c++)
+      {
+         __m256 position = _mm256_mul_ps(_mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(planes[c] + i), zero), one), scale);
+         __m256i cell = _mm256_min_epi32(_mm256_cvttps_epi32(position), lastCell);
+         fraction[c] = _mm256_sub_ps(position, _mm256_cvtepi32_ps(cell));
+         base = _mm256_add_epi32(base, _mm256_mullo_epi32(cell, _mm256_set1_epi32(strides[c])));
+      }
+
+      __m256 result[4] = { zero, zero, zero, zero };
+      for (int corner = 0; corner < 8; corner++)
+      {
+         __m256 weight = one;
+         int offset = 0;
+         for (int c = 0; c < 3; c++)
+         {
+            bool upper = (corner >> c) & 1;
+            weight = _mm256_mul_ps(weight, upper ? fraction[c] : _mm256_sub_ps(one, fraction[c]));
+            offset += upper ? strides[c] : 0;
+         }
+         __m256i index = _mm256_add_epi32(base, _mm256_set1_epi32(offset));
+         for (int c = 0; c < 4; c++)
+            result[c] = _mm256_add_ps(result[c], _mm256_mul_ps(weight, _mm256_i32gather_ps(table + c, index, 4)));
+      }
+      for (int c = 0; c < 4; c++)
+         _mm256_storeu_ps(planes[c] + i, result[c]);
+   }
+
+   float *rest[4] = { planes[0] + i, planes[1] + i, planes[2] + i, planes[3] + i };
+   ColourLutScalar(rest, table, size, count - i);
+}
+
+static const CpuKernels avx2Kernels_ = {
+   "avx2", ExpandAvx2, QuantizeAvx2, AxpyAvx2, ScaleAvx2, AbsScaleAvx2, Dot3Avx2, Length3Avx2,
+   ColourLutAvx2
+};
+
+// checks CPUID (and that the OS saves AVX state) for the instruction sets used
+void DetectCpuFeatures(bool *sse4, bool *avx2)
+{
+#ifdef _MSC_VER
+   int info[4];
+   __cpuid(info, 0);
+   int maxLeaf = info[0];
+   __cpuid(info, 1);
+   *sse4 = (info[2] & (1 << 19)) != 0;
+   bool avx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+   *avx2 = false;
+   if (avx && maxLeaf >= 7)
+   {
+      __cpuidex(info, 7, 0);
+      *avx2 = (info[1] & (1 << 5)) != 0;
+   }
+#else
+   __builtin_cpu_init();
+   *sse4 = __builtin_cpu_supports("sse4.1") != 0;
+   *avx2 = __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+#endif
+
+// returns the fastest kernel set supported here, or the named one if given
+const CpuKernels *SelectCpuKernels(const string &name = "")
+{
+   vector<const CpuKernels *> available(1, &scalarKernels_);
+#ifdef CPU_X86
+   bool sse4, avx2;
+   DetectCpuFeatures(&sse4, &avx2);
+   if (sse4) available.push_back(&sse4Kernels_);
+   if (avx2) available.push_back(&avx2Kernels_);
+#endif
+
+   if (name.empty()) return available.back();
+   for (size_t i = 0; i < available.size(); i++)
+      if (name == available[i]->name) return available[i];
+   return 0;
+}
+
+// --------------------------------------------------------------------------
+// CPU implementation of the colour, filter and blur effects. It reproduces
+// the fragment shaders, including their bilinear texture sampling, so that
+// hosts without a usable GPU get the same images as the OpenGL path.
+
+// an 8-bit image in memory; strides are in bytes, so the same view describes
+// interleaved data straight from stbi_load, planar data, or rows stored top
+// first (negative row stride). Rows run bottom first, as in OpenGL.
+struct ImageView
+{
+   unsigned char *data;
+   int width;
+   int height;
+   int numComponents;
+   ptrdiff_t pixelStride;
+   ptrdiff_t rowStride;
+   ptrdiff_t channelStride;
+};
+
+ImageView InterleavedView(unsigned char *data, int width, int height, int numComponents)
+{
+   ImageView view = { data, width, height, numComponents, numComponents,
+      static_cast<ptrdiff_t>(width) * numComponents, 1 };
+   return view;
+}
+
+ImageView PlanarView(unsigned char *data, int width, int height, int numComponents)
+{
+   ImageView view = { data, width, height, numComponents, 1, width,
+      static_cast<ptrdiff_t>(width) * height };
+   return view;
+}
+
+// the same view with its rows in the opposite order
+ImageView FlippedView(const ImageView &view)
+{
+   ImageView flipped = view;
+   flipped.data = view.data + (view.height - 1) * view.rowStride;
+   flipped.rowStride = -view.rowStride;
+   return flipped;
+}
+
+// 3x3 kernels from filterFragment.glsl, indexed [dy + 1][dx + 1] with dy
+// pointing up the image
+static const float FILTER_KERNELS[3][3][3] = {
+   { { 1, 0, -1 }, { 2, 0, -2 }, { 1, 0, -1 } },        // vertical sobel
+   { { 1, 2, 1 }, { 0, 0, 0 }, { -1, -2, -1 } },        // horizontal sobel
+   { { 0, -1, 0 }, { -1, 5, -1 }, { 0, -1, 0 } },       // unsharp mask
+};
+
+// texels an effect reads beyond the pixel being computed
+int CpuEffectHalo(const EffectStage &stage)
+{
+   if (stage.mode == NO_EFFECT) return 0;
+   if (stage.shaderName == "filter") return 2;
+   if (stage.shaderName == "blur")
+   {
+      BlurKernel kernel;
+      BuildBlurKernel(&kernel, stage);
+      return kernel.radius;
+   }
+   if (stage.shaderName == "convolve")
+      return KernelHalo(stage);
+   return 0;
+}
+
+// a radix-2 FFT of one power-of-two size: the bit-reversed order of the
+// indices and the twiddle factors exp(-2 pi i k / size) for k < size / 2
+struct FftPlan
+{
+   int size;
+   vector<int> reversed;
+   vector<complex<float> > twiddles;
+
+   FftPlan() : size(0)
+   {}
+};
+
+void InitializeFftPlan(FftPlan *plan, int size)
+{
+   plan->size = size;
+   plan->reversed.resize(size);
+   int bits = 0;
+   while ((1 << bits) < size) bits++;
+   for (int i = 0; i < size; i++)
+   {
+      int reversed = 0;
+      for (int b = 0; b < bits; b++)
+         reversed |= ((i >> b) & 1) << (bits - 1 - b);
+      plan->reversed[i] = reversed;
+   }
+   plan->twiddles.resize(size / 2);
+   for (int k = 0; k < size / 2; k++)
+   {
+      double angle = -2.0 * M_PI * k / size;
+      plan->twiddles[k] = complex<float>(static_cast<float>(cos(angle)), static_cast<float>(sin(angle)));
+   }
+}
+
+// products are written out rather than using complex's operator*, which
+// checks for infinities on every call
+inline complex<float> MultiplyComplex(const complex<float> &a, const complex<float> &b)
+{
+   return complex<float>(a.real() * b.real() - a.imag() * b.imag(),
+                         a.real() * b.imag() + a.imag() * b.real());
+}
+
+// transforms data in place; the inverse is left unscaled
+void Fft(const FftPlan &plan, complex<float> *data, bool inverse)
+{
+   int size = plan.size;
+   for (int i = 0; i < size; i++)
+      if (i < plan.reversed[i])
+         swap(data[i], data[plan.reversed[i]]);
+
+   for (int length = 2; length <= size; length *= 2)
+   {
+      int half = length / 2;
+      int step = size / length;
+      for (int start = 0; start < size; start += length)
+         for (int k = 0; k < half; k++)
+         {
+            complex<float> twiddle = plan.twiddles[k * step];
+            if (inverse)
+               twiddle = conj(twiddle);
+            complex<float> odd = MultiplyComplex(data[start + k + half], twiddle);
+            data[start + k + half] = data[start + k] - odd;
+            data[start + k] += odd;
+         }
+   }
+}
+
+// transforms a rows x columns array (row-major) in place, one row at a time
+// and then one column at a time through a contiguous copy
+void Fft2d(const FftPlan &rowPlan, const FftPlan &columnPlan, complex<float> *data,
+           vector<complex<float> > *column, bool inverse)
+{
+   int columns = rowPlan.size;
+   int rows = columnPlan.size;
+   for (int y = 0; y < rows; y++)
+      Fft(rowPlan, data + static_cast<size_t>(y) * columns, inverse);
+
+   column->resize(rows);
+   for (int x = 0; x < columns; x++)
+   {
+      for (int y = 0; y < rows; y++)
+         (*column)[y] = data[static_cast<size_t>(y) * columns + x];
+      Fft(columnPlan, column->data(), inverse);
+      for (int y = 0; y < rows; y++)
+         data[static_cast<size_t>(y) * columns + x] = (*column)[y];
+   }
+}
+
+// smallest power of two at least value
+int NextPowerOfTwo(int value)
+{
+   int power = 1;
+   while (power < value) power *= 2;
+   return power;
+}
+
+// per-thread working memory, reused between calls
+struct CpuScratch
+{
+   vector<float> planes;
+   vector<float> result;
+   vector<float> temp;
+   vector<unsigned char> bytes;
+
+   // convolution: the result of a separable kernel's first factor, and the
+   // FFT plans, buffers and transformed kernel for the tile size last used
+   vector<float> intermediate;
+   FftPlan rowPlan;
+   FftPlan columnPlan;
+   vector<complex<float> > fftData;
+   vector<complex<float> > fftColumn;
+   vector<complex<float> > spectrum;
+   string spectrumKey;
+};
+
+// loads the rectangle plus halo as four padded float planes (RGBA), clamping
+// reads at the image edge like GL_CLAMP_TO_EDGE
+void LoadCpuPlanes(const CpuKernels *kernels, const ImageView &input, int x0, int y0,
+                   int width, int height, int halo, CpuScratch *scratch)
+{
+   int paddedWidth = width + 2 * halo;
+   int paddedHeight = height + 2 * halo;
+   size_t planeSize = static_cast<size_t>(paddedWidth) * paddedHeight;
+   scratch->planes.resize(4 * planeSize);
+   scratch->bytes.resize(paddedWidth);
+
+   for (int py = 0; py < paddedHeight; py++)
+   {
+      int y = min(max(y0 - halo + py, 0), input.height - 1);
+      const unsigned char *row = input.data + y * input.rowStride;
+
+      for (int c = 0; c < 4; c++)
+      {
+         float *dst = &scratch->planes[c * planeSize + static_cast<size_t>(py) * paddedWidth];
+
+         // greyscale images replicate their one channel; missing alpha is opaque
+         int channel = input.numComponents >= 3 ? c : (c < 3 ? 0 : 1);
+         if (channel >= input.numComponents)
+         {
+            fill(dst, dst + paddedWidth, 1.0f);
+            continue;
+         }
+
+         const unsigned char *src = row + channel * input.channelStride;
+         for (int px = 0; px < paddedWidth; px++)
+         {
+            int x = min(max(x0 - halo + px, 0), input.width - 1);
+            scratch->bytes[px] = src[x * input.pixelStride];
+         }
+         kernels->expand(dst, scratch->bytes.data(), paddedWidth);
+      }
+   }
+}
+
+// applies a colour effect in place to count values of four planes (RGBA)
+void ApplyCpuColour(const CpuKernels *kernels, int mode, float *const planes[4], int count)
+{
+   if (mode == NO_EFFECT) return;
+
+   const float *weights[] = { GREYSCALE1, GREYSCALE2, GREYSCALE3, GREYSCALE2 };
+   kernels->dot3(planes[0], planes[0], planes[1], planes[2], weights[mode - 1], count);
+
+   // greyscale leaves alpha at zero, sepia makes it opaque
+   float tint[3] = { 1.0f, 1.0f, 1.0f };
+   if (mode == EFFECT4)
+      copy(SEPIA, SEPIA + 3, tint);
+   kernels->scale(planes[1], planes[0], tint[1], count);
+   kernels->scale(planes[2], planes[0], tint[2], count);
+   kernels->scale(planes[0], planes[0], tint[0], count);
+   fill(planes[3], planes[3] + count, mode == EFFECT4 ? 1.0f : 0.0f);
+}
+
+// applies convolution taps to rows of count values: row y of dst gets the
+// taps summed around row y of src, whose rows are srcStride apart
+void ApplyCpuTaps(const CpuKernels *kernels, const vector<ConvolutionTap> &taps,
+                  const float *src, int srcStride, float *dst, int dstStride, int rows, int count)
+{
+   for (int y = 0; y < rows; y++)
+   {
+      float *out = dst + static_cast<size_t>(y) * dstStride;
+      fill(out, out + count, 0.0f);
+      for (size_t i = 0; i < taps.size(); i++)
+         kernels->axpy(out, src + static_cast<ptrdiff_t>(y + taps[i].dy) * srcStride + taps[i].dx,
+                       taps[i].weight, count);
+   }
+}
+
+// convolves padded planes through FFTs, two planes at a time as the real and
+// imaginary parts of one transform. The planes are zero-padded to powers of
+// two; the halo keeps the wrap-around of the circular convolution out of
+// the width x height block.
+void ConvolveCpuFft(const EffectStage &stage, const float *const sources[3], int channels,
+                    float *const result[3], int width, int height, int halo, CpuScratch *scratch)
+{
+   int paddedWidth = width + 2 * halo;
+   int paddedHeight = height + 2 * halo;
+   int fftWidth = NextPowerOfTwo(paddedWidth);
+   int fftHeight = NextPowerOfTwo(paddedHeight);
+   size_t fftSize = static_cast<size_t>(fftWidth) * fftHeight;
+   if (scratch->rowPlan.size != fftWidth)
+      InitializeFftPlan(&scratch->rowPlan, fftWidth);
+   if (scratch->columnPlan.size != fftHeight)
+      InitializeFftPlan(&scratch->columnPlan, fftHeight);
+
+   // the transformed kernel, mirrored so that the convolution applies it as
+   // written and scaled to undo the unscaled inverse transform
+   ostringstream key;
+   key << KernelKey(stage) << "@" << fftWidth << "x" << fftHeight;
+   if (scratch->spectrumKey != key.str())
+   {
+      scratch->spectrum.assign(fftSize, complex<float>(0.0f, 0.0f));
+      int left = KernelLeft(stage);
+      int top = KernelTop(stage);
+      for (int i = 0; i < stage.kernelHeight; i++)
+         for (int j = 0; j < stage.kernelWidth; j++)
+         {
+            int x = (fftWidth - (j - left)) % fftWidth;
+            int y = (fftHeight - (top - i)) % fftHeight;
+            scratch->spectrum[static_cast<size_t>(y) * fftWidth + x] =
+               stage.kernel[i * stage.kernelWidth + j] / static_cast<float>(fftSize);
+         }
+      Fft2d(scratch->rowPlan, scratch->columnPlan, scratch->spectrum.data(), &scratch->fftColumn, false);
+      scratch->spectrumKey = key.str();
+   }
+
+   scratch->fftData.resize(fftSize);
+   complex<float> *data = scratch->fftData.data();
+   for (int c = 0; c < channels; c += 2)
+   {
+      const float *real = sources[c];
+      const float *imaginary = c + 1 < channels ? sources[c + 1] : 0;
+      fill(data, data + fftSize, complex<float>(0.0f, 0.0f));
+      for (int y = 0; y < paddedHeight; y++)
+         for (int x = 0; x < paddedWidth; x++)
+         {
+            size_t i = static_cast<size_t>(y) * paddedWidth + x;
+            data[static_cast<size_t>(y) * fftWidth + x] = complex<float>(real[i], imaginary ? imaginary[i] : 0.0f);
+         }
+
+      Fft2d(scratch->rowPlan, scratch->columnPlan, data, &scratch->fftColumn, false);
+      for (size_t i = 0; i < fftSize; i++)
+         data[i] = MultiplyComplex(data[i], scratch->spectrum[i]);
+      Fft2d(scratch->rowPlan, scratch->columnPlan, data, &scratch->fftColumn, true);
+
+      for (int y = 0; y < height; y++)
+         for (int x = 0; x < width; x++)
+         {
+            const complex<float> &value = data[static_cast<size_t>(y + halo) * fftWidth + x + halo];
+            result[c][y * width + x] = value.real();
+            if (imaginary)
+               result[c + 1][y * width + x] = value.imag();
+         }
+   }
+}
+
+// computes a filter, blur or convolution (or a copy for NO_EFFECT) for a
+// width x height block from the padded planes into four result planes
+void ComputeCpuEffect(const CpuKernels *kernels, const EffectStage &stage,
+                      int width, int height, int halo, CpuScratch *scratch)
+{
+   const string &shaderName = stage.shaderName;
+   int mode = stage.mode;
+   int paddedWidth = width + 2 * halo;
+   size_t planeSize = static_cast<size_t>(paddedWidth) * (height + 2 * halo);
+   size_t resultSize = static_cast<size_t>(width) * height;
+   scratch->result.resize(4 * resultSize);
+
+   const float *planes[4];
+   float *result[4];
+   for (int c = 0; c < 4; c++)
+   {
+      planes[c] = &scratch->planes[c * planeSize];
+      result[c] = &scratch->result[c * resultSize];
+   }
+
+   if (mode == NO_EFFECT)
+   {
+      for (int c = 0; c < 4; c++)
+         for (int y = 0; y < height; y++)
+            kernels->scale(result[c] + y * width, planes[c] + (y + halo) * paddedWidth + halo, 1.0f, width);
+   }
+   else if (shaderName == "filter")
+   {
+      // The shader samples neighbours at integer texture coordinates, i.e. on
+      // texel corners, so each sample is the average of four texels; the
+      // kernel is then applied to the length of the averaged colour.
+      // corners[X, Y] holds that value for the corner below-left of padded
+      // texel (X, Y).
+      scratch->temp.resize(planeSize + 3 * paddedWidth);
+      float *corners = &scratch->temp[0];
+      float *average[3];
+      for (int c = 0; c < 3; c++)
+         average[c] = &scratch->temp[planeSize + c * paddedWidth];
+
+      for (int y = 1; y < height + 2 * halo; y++)
+      {
+         for (int c = 0; c < 3; c++)
+         {
+            const float *below = planes[c] + (y - 1) * paddedWidth;
+            const float *above = planes[c] + y * paddedWidth;
+            kernels->scale(average[c], below, 0.25f, paddedWidth - 1);
+            kernels->axpy(average[c], below + 1, 0.25f, paddedWidth - 1);
+            kernels->axpy(average[c], above, 0.25f, paddedWidth - 1);
+            kernels->axpy(average[c], above + 1, 0.25f, paddedWidth - 1);
+         }
+         kernels->length3(corners + y * paddedWidth + 1, average[0], average[1], average[2], paddedWidth - 1);
+      }
+
+      const float (*kernel)[3] = FILTER_KERNELS[mode - 1];
+      for (int y = 0; y < height; y++)
+      {
+         float *out = result[0] + y * width;
+         fill(out, out + width, 0.0f);
+         for (int dy = -1; dy <= 1; dy++)
+            for (int dx = -1; dx <= 1; dx++)
+               if (kernel[dy + 1][dx + 1] != 0.0f)
+                  kernels->axpy(out, corners + (y + halo + dy) * paddedWidth + halo + dx,
+                                kernel[dy + 1][dx + 1], width);
+
+         kernels->absScale(out, out, 0.5f, width);
+         for (int c = 1; c < 4; c++)
+            copy(out, out + width, result[c] + y * width);
+      }
+   }
+   else if (shaderName == "blur")
+   {
+      // Horizontal pass over every padded row, then a vertical pass. Like the
+      // GPU, which keeps the horizontal result in an RGBA8 target, the
+      // intermediate values are rounded to 8 bits.
+      BlurKernel blur;
+      BuildBlurKernel(&blur, stage);
+      int paddedHeight = height + 2 * halo;
+      scratch->temp.resize(static_cast<size_t>(width) * paddedHeight);
+      scratch->bytes.resize(width);
+      float *horizontal = &scratch->temp[0];
+
+      for (int c = 0; c < 4; c++)
+      {
+         for (int y = 0; y < paddedHeight; y++)
+         {
+            float *out = horizontal + y * width;
+            const float *centre = planes[c] + y * paddedWidth + halo;
+            kernels->scale(out, centre, blur.weights[0], width);
+            for (int i = 1; i <= blur.radius; i++)
+            {
+               kernels->axpy(out, centre + i, blur.weights[i], width);
+               kernels->axpy(out, centre - i, blur.weights[i], width);
+            }
+            kernels->quantize(scratch->bytes.data(), out, width);
+            kernels->expand(out, scratch->bytes.data(), width);
+         }
+
+         for (int y = 0; y < height; y++)
+         {
+            float *out = result[c] + y * width;
+            const float *centre = horizontal + (y + halo) * width;
+            kernels->scale(out, centre, blur.weights[0], width);
+            for (int i = 1; i <= blur.radius; i++)
+            {
+               kernels->axpy(out, centre + i * width, blur.weights[i], width);
+               kernels->axpy(out, centre - i * width, blur.weights[i], width);
+            }
+         }
+      }
+   }
+   else if (shaderName == "convolve")
+   {
+      // luminance kernels filter one grey plane and copy the result to RGB
+      int paddedHeight = height + 2 * halo;
+      int channels = stage.kernelLuminance ? 1 : 3;
+      const float *sources[3] = { planes[0], planes[1], planes[2] };
+      if (stage.kernelLuminance)
+      {
+         scratch->temp.resize(planeSize);
+         kernels->dot3(&scratch->temp[0], planes[0], planes[1], planes[2], GREYSCALE2, static_cast<int>(planeSize));
+         sources[0] = &scratch->temp[0];
+      }
+
+      KernelFactors factors;
+      FactorKernel(stage, &factors);
+      if (UsesFftConvolution(stage))
+         ConvolveCpuFft(stage, sources, channels, result, width, height, halo, scratch);
+      else if (factors.separable)
+      {
+         // one pass per factor in the GPU's order, rounding the intermediate
+         // to 8 bits when the GPU keeps it in its RGBA8 target
+         vector<ConvolutionTap> first, second;
+         ConvolutionTaps(stage, factors.firstAxis, &first);
+         ConvolutionTaps(stage, 1 - factors.firstAxis, &second);
+         int interWidth = factors.firstAxis == 0 ? width : paddedWidth;
+         int interHeight = factors.firstAxis == 0 ? paddedHeight : height;
+         size_t interSize = static_cast<size_t>(interWidth) * interHeight;
+         scratch->intermediate.resize(interSize);
+         scratch->bytes.resize(interSize);
+         float *intermediate = &scratch->intermediate[0];
+
+         for (int c = 0; c < channels; c++)
+         {
+            if (factors.firstAxis == 0)
+               ApplyCpuTaps(kernels, first, sources[c] + halo, paddedWidth, intermediate, interWidth,
+                            interHeight, interWidth);
+            else
+               ApplyCpuTaps(kernels, first, sources[c] + halo * paddedWidth, paddedWidth, intermediate,
+                            interWidth, interHeight, interWidth);
+            if (factors.fitsTarget)
+            {
+               kernels->quantize(scratch->bytes.data(), intermediate, static_cast<int>(interSize));
+               kernels->expand(intermediate, scratch->bytes.data(), static_cast<int>(interSize));
+            }
+
+            if (factors.firstAxis == 0)
+               ApplyCpuTaps(kernels, second, intermediate + halo * interWidth, interWidth, result[c], width,
+                            height, width);
+            else
+               ApplyCpuTaps(kernels, second, intermediate + halo, interWidth, result[c], width, height, width);
+         }
+      }
+      else
+      {
+         vector<ConvolutionTap> taps;
+         ConvolutionTaps(stage, -1, &taps);
+         for (int c = 0; c < channels; c++)
+            ApplyCpuTaps(kernels, taps, sources[c] + halo * paddedWidth + halo, paddedWidth, result[c], width,
+                         height, width);
+      }
+
+      for (int c = 0; c < channels; c++)
+         for (size_t i = 0; i < resultSize; i++)
+            result[c][i] += stage.kernelBias;
+      for (int c = channels; c < 3; c++)
+         copy(result[0], result[0] + resultSize, result[c]);
+      fill(result[3], result[3] + resultSize, 1.0f);
+   }
+}
+
+// writes the result planes into the output rectangle
+void StoreCpuResult(const CpuKernels *kernels, const ImageView &output, int x0, int y0,
+                    int width, int height, CpuScratch *scratch)
+{
+   size_t resultSize = static_cast<size_t>(width) * height;
+   scratch->bytes.resize(width);
+
+   for (int y = 0; y < height; y++)
+   {
+      unsigned char *row = output.data + (y0 + y) * output.rowStride + x0 * output.pixelStride;
+      for (int c = 0; c < min(output.numComponents, 4); c++)
+      {
+         kernels->quantize(scratch->bytes.data(), &scratch->result[c * resultSize + static_cast<size_t>(y) * width], width);
+         unsigned char *dst = row + c * output.channelStride;
+         for (int x = 0; x < width; x++)
+            dst[x * output.pixelStride] = scratch->bytes[x];
+      }
+   }
+}
+
+// applies a run of colour stages in place, through the baked table when the
+// pass uses one
+void ApplyCpuColourStages(const CpuKernels *kernels, const EffectPass &pass, bool post,
+                          float *const planes[4], int count)
+{
+   const vector<EffectStage> &stages = post ? pass.post : pass.pre;
+   if (UsesColourLut(pass, post))
+   {
+      const ColourLut *lut = FindColourLut(stages);
+      kernels->colourLut(planes, lut->table.data(), lut->size, count);
+   }
+   else
+      for (size_t i = 0; i < stages.size(); i++)
+         ApplyCpuColour(kernels, stages[i].mode, planes, count);
+}
+
+// applies one pass to a rectangle of the image. The pre stages run on the
+// loaded texels; since colour effects are affine this matches the GPU, which
+// applies them to each bilinear sample.
+void ApplyCpuEffectRect(const CpuKernels *kernels, const ImageView &input, const ImageView &output,
+                        const EffectPass &pass, int x0, int y0, int x1, int y1,
+                        CpuScratch *scratch)
+{
+   int width = x1 - x0;
+   int height = y1 - y0;
+   int halo = CpuEffectHalo(pass.stage);
+   LoadCpuPlanes(kernels, input, x0, y0, width, height, halo, scratch);
+
+   int planeSize = (width + 2 * halo) * (height + 2 * halo);
+   float *planes[4];
+   for (int c = 0; c < 4; c++)
+      planes[c] = &scratch->planes[c * planeSize];
+   ApplyCpuColourStages(kernels, pass, false, planes, planeSize);
+
+   ComputeCpuEffect(kernels, pass.stage, width, height, halo, scratch);
+
+   float *result[4];
+   for (int c = 0; c < 4; c++)
+      result[c] = &scratch->result[c * width * height];
+   ApplyCpuColourStages(kernels, pass, true, result, width * height);
+
+   StoreCpuResult(kernels, output, x0, y0, width, height, scratch);
+}
+
+struct TileTiming
+{
+   int x0;
+   int y0;
+   int x1;
+   int y1;
+   int participant;
+   double milliseconds;
+};
+
+// how an image is split into tiles and where they run. Tiles are sized so
+// their float planes fit in a core's cache; each tile loads its own halo.
+struct CpuTiling
+{
+   // null runs every tile on the calling thread
+   TaskPool *pool;
+   int tileWidth;
+   int tileHeight;
+
+   // working memory per participant, and the timing of every tile from the
+   // most recent call
+   vector<CpuScratch> scratch;
+   vector<TileTiming> timings;
+
+   // RGBA images between the passes of a chain, reused from image to image
+   vector<unsigned char> intermediates[2];
+
+   CpuTiling() : pool(0), tileWidth(128), tileHeight(128)
+   {}
+};
+
+// applies one pass of an effect chain to a whole image
+void ApplyCpuEffect(const CpuKernels *kernels, const ImageView &input, const ImageView &output,
+                    const EffectPass &pass, CpuTiling *tiling)
+{
+   // round the tile width so that tile edges fall on 64-byte offsets within
+   // each output row, keeping neighbouring tiles off each other's cache lines
+   int alignment = 1;
+   while ((alignment * output.pixelStride) % 64 != 0 && alignment < 64)
+      alignment++;
+   int tileWidth = max((tiling->tileWidth + alignment - 1) / alignment, 1) * alignment;
+   int tileHeight = max(tiling->tileHeight, 1);
+
+   // an FFT convolution transforms each tile with its halo, so tiles are
+   // sized to fill a power of two several times the halo across instead
+   if (UsesFftConvolution(pass.stage))
+   {
+      int halo = CpuEffectHalo(pass.stage);
+      int fftSize = max(64, NextPowerOfTwo(16 * halo));
+      tileWidth = max((fftSize - 2 * halo) / alignment, 1) * alignment;
+      tileHeight = fftSize - 2 * halo;
+   }
+
+   int columns = (input.width + tileWidth - 1) / tileWidth;
+   int rows = (input.height + tileHeight - 1) / tileHeight;
+   int participants = tiling->pool ? TaskPoolSize(tiling->pool) : 1;
+   tiling->scratch.resize(participants);
+   tiling->timings.resize(columns * rows);
+
+   function<void(int, int)> processTile = [&](int tile, int participant)
+   {
+      chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+
+      TileTiming &timing = tiling->timings[tile];
+      timing.x0 = (tile % columns) * tileWidth;
+      timing.y0 = (tile / columns) * tileHeight;
+      timing.x1 = min(timing.x0 + tileWidth, input.width);
+      timing.y1 = min(timing.y0 + tileHeight, input.height);
+      timing.participant = participant;
+      ApplyCpuEffectRect(kernels, input, output, pass, timing.x0, timing.y0,
+                         timing.x1, timing.y1, &tiling->scratch[participant]);
+
+      timing.milliseconds = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+   };
+
+   if (tiling->pool)
+      RunTasks(tiling->pool, columns * rows, processTile);
+   else
+      for (int tile = 0; tile < columns * rows; tile++)
+         processTile(tile, 0);
+}
+
+// applies an effect chain to a whole image in the same passes the GPU uses,
+// matching what the pipeline renders; returns false for an unknown effect
+bool ApplyCpuEffectChain(const CpuKernels *kernels, const ImageView &input, const ImageView &output,
+                         const vector<EffectStage> &chain, CpuTiling *tiling)
+{
+   for (size_t i = 0; i < chain.size(); i++)
+      if (!IsValidEffect(chain[i]))
+         return false;
+
+   vector<EffectPass> passes;
+   PlanEffectPasses(chain, &passes);
+
+   ImageView source = input;
+   for (size_t i = 0; i < passes.size(); i++)
+   {
+      ImageView target = output;
+      if (i + 1 < passes.size())
+      {
+         vector<unsigned char> &buffer = tiling->intermediates[i % 2];
+         buffer.resize(static_cast<size_t>(input.width) * input.height * 4);
+         target = InterleavedView(buffer.data(), input.width, input.height, 4);
+      }
+      double start = ProfileBegin();
+      ApplyCpuEffect(kernels, source, target, passes[i], tiling);
+      ProfileEnd("cpu pass", start, PassProgramName(passes[i]));
+      source = target;
+   }
+   return true;
+}
+
+// prints a summary of per-tile timings, to help pick a tile size per machine
+void PrintTileTimings(const CpuTiling *tiling)
+{
+   const vector<TileTiming> &timings = tiling->timings;
+   if (timings.empty()) return;
+
+   double total = 0.0, slowest = 0.0, fastest = timings[0].milliseconds;
+   size_t pixels = 0;
+   vector<int> perParticipant(tiling->scratch.size(), 0);
+   for (size_t i = 0; i < timings.size(); i++)
+   {
+      total += timings[i].milliseconds;
+      slowest = max(slowest, timings[i].milliseconds);
+      fastest = min(fastest, timings[i].milliseconds);
+      pixels += static_cast<size_t>(timings[i].x1 - timings[i].x0) * (timings[i].y1 - timings[i].y0);
+      perParticipant[timings[i].participant]++;
+   }
+
+   cout << "Tiles: " << timings.size() << " of " << tiling->tileWidth << "x" << tiling->tileHeight
+      << ", ms per tile min/mean/max " << fastest << "/" << total / timings.size() << "/" << slowest
+      << ", " << pixels / (total * 1000.0) << " Mpx/s per thread, tiles per thread";
+   for (size_t i = 0; i < perParticipant.size(); i++)
+      cout << " " << perParticipant[i];
+   cout << endl;
+}
+
+// --------------------------------------------------------------------------
+// Streaming decode and encode: images read and written a few rows at a time,
+// top row first, so that processing an image in bands never holds all of it.
+// Raw pixel cache entries and binary PNM files are read directly, PNG and
+// JPEG files through libpng and libjpeg when built with HAVE_LIBPNG and
+// HAVE_LIBJPEG; anything else is decoded whole by stb_image and handed out
+// from memory. PNG output goes through libpng when available, and otherwise
+// as uncompressed deflate blocks.
+
+// peak resident memory of the process so far, in megabytes
+double PeakResidentMB()
+{
+#ifdef _WIN32
+   PROCESS_MEMORY_COUNTERS counters;
+   if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+      return counters.PeakWorkingSetSize / 1048576.0;
+   return 0.0;
+#else
+   rusage usage;
+   getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+   return usage.ru_maxrss / 1048576.0;
+#else
+   return usage.ru_maxrss / 1024.0;
+#endif
+#endif
+}
+
+enum StripFormat
+{
+   STRIP_RAW,
+   STRIP_PNM,
+   STRIP_PNG,
+   STRIP_JPEG,
+   STRIP_DECODED
+};
+
+#ifdef HAVE_LIBJPEG
+// reports a libjpeg error and jumps back to the call that failed
+struct JpegErrorManager
+{
+   jpeg_error_mgr base;
+   jmp_buf failed;
+};
+
+void JpegErrorExit(j_common_ptr info)
+{
+   char message[JMSG_LENGTH_MAX];
+   info->err->format_message(info, message);
+   cout << "JPEG error: " << message << endl;
+   longjmp(reinterpret_cast<JpegErrorManager *>(info->err)->failed, 1);
+}
+#endif
+
+struct StripReader
+{
+   StripFormat format;
+   int width;
+   int height;
+   int numComponents;
+
+   // rows handed out so far
+   int nextRow;
+
+   // raw and PNM files: where the first row starts; raw rows are stored
+   // bottom first, so they are read from the end of the file back
+   FILE *file;
+   long long dataOffset;
+
+#ifdef HAVE_LIBPNG
+   png_structp png;
+   png_infop pngInfo;
+#endif
+#ifdef HAVE_LIBJPEG
+   jpeg_decompress_struct jpeg;
+   JpegErrorManager jpegError;
+#endif
+
+   // the whole image, bottom row first, for formats read in one go
+   DecodedImage decoded;
+
+   StripReader() : format(STRIP_DECODED), width(0), height(0), numComponents(0), nextRow(0),
+      file(0), dataOffset(0)
+   {}
+};
+
+bool SeekFile(FILE *file, long long offset)
+{
+#ifdef _WIN32
+   return _fseeki64(file, offset, SEEK_SET) == 0;
+#else
+   return fseeko(file, offset, SEEK_SET) == 0;
+#endif
+}
+
+// reads a decimal number from a PNM header, skipping whitespace and
+// comments, along with the single whitespace character that ends it
+bool ReadPnmNumber(FILE *file, int *value)
+{
+   int c = getc(file);
+   while (c == '#' || isspace(c))
+   {
+      if (c == '#')
+         while (c != '\n' && c != EOF)
+            c = getc(file);
+      c = getc(file);
+   }
+   if (!isdigit(c)) return false;
+
+   *value = 0;
+   for (; isdigit(c); c = getc(file))
+   {
+      if (*value > 1 << 20) return false;
+      *value = *value * 10 + (c - '0');
+   }
+   return isspace(c) != 0;
+}
+
+// reads a binary PNM header (P5 grey or P6 RGB, at most 8 bits a sample)
+bool ReadPnmHeader(FILE *file, int *width, int *height, int *numComponents)
+{
+   int maxValue = 0;
+   int magic = getc(file);
+   int kind = getc(file);
+   if (magic != 'P' || (kind != '5' && kind != '6') || !ReadPnmNumber(file, width) ||
+       !ReadPnmNumber(file, height) || !ReadPnmNumber(file, &maxValue))
+      return false;
+   *numComponents = kind == '5' ? 1 : 3;
+   return *width > 0 && *height > 0 && maxValue > 0 && maxValue <= 255;
+}
+
+#ifdef HAVE_LIBPNG
+// starts reading a non-interlaced PNG with its samples expanded or reduced to
+// 8 bits; interlaced images need every pass before any row is complete
+bool OpenPngReader(StripReader *reader)
+{
+   reader->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0);
+   reader->pngInfo = reader->png ? png_create_info_struct(reader->png) : 0;
+   if (!reader->pngInfo)
+      return false;
+   if (setjmp(png_jmpbuf(reader->png)))
+      return false;
+
+   png_init_io(reader->png, reader->file);
+   png_read_info(reader->png, reader->pngInfo);
+   if (png_get_interlace_type(reader->png, reader->pngInfo) != PNG_INTERLACE_NONE)
+      return false;
+   png_set_strip_16(reader->png);
+   png_set_packing(reader->png);
+   png_set_palette_to_rgb(reader->png);
+   png_set_expand_gray_1_2_4_to_8(reader->png);
+   if (png_get_valid(reader->png, reader->pngInfo, PNG_INFO_tRNS))
+      png_set_tRNS_to_alpha(reader->png);
+   png_read_update_info(reader->png, reader->pngInfo);
+
+   reader->width = png_get_image_width(reader->png, reader->pngInfo);
+   reader->height = png_get_image_height(reader->png, reader->pngInfo);
+   reader->numComponents = png_get_channels(reader->png, reader->pngInfo);
+   return true;
+}
+
+bool ReadPngRows(StripReader *reader, unsigned char *rows, int count)
+{
+   if (setjmp(png_jmpbuf(reader->png)))
+      return false;
+   for (int i = 0; i < count; i++)
+      png_read_row(reader->png, rows + static_cast<size_t>(i) * reader->width * reader->numComponents, 0);
+   return true;
+}
+#endif
+
+#ifdef HAVE_LIBJPEG
+// starts reading a JPEG as RGB or grey
+bool OpenJpegReader(StripReader *reader)
+{
+   reader->jpeg.err = jpeg_std_error(&reader->jpegError.base);
+   reader->jpegError.base.error_exit = JpegErrorExit;
+   jpeg_create_decompress(&reader->jpeg);
+   if (setjmp(reader->jpegError.failed))
+      return false;
+
+   jpeg_stdio_src(&reader->jpeg, reader->file);
+   jpeg_read_header(&reader->jpeg, TRUE);
+   reader->jpeg.out_color_space = reader->jpeg.jpeg_color_space == JCS_GRAYSCALE ? JCS_GRAYSCALE : JCS_RGB;
+   jpeg_start_decompress(&reader->jpeg);
+   reader->width = reader->jpeg.output_width;
+   reader->height = reader->jpeg.output_height;
+   reader->numComponents = reader->jpeg.output_components;
+   return true;
+}
+
+bool ReadJpegRows(StripReader *reader, unsigned char *rows, int count)
+{
+   if (setjmp(reader->jpegError.failed))
+      return false;
+   for (int i = 0; i < count; )
+   {
+      JSAMPROW row = rows + static_cast<size_t>(i) * reader->width * reader->numComponents;
+      i += jpeg_read_scanlines(&reader->jpeg, &row, 1);
+   }
+   return true;
+}
+#endif
+
+// the raw pixel cache entry of an image, if it is current
+bool OpenRawReader(StripReader *reader, const string &filename)
+{
+   long long sourceSize, sourceTime;
+   if (!pixelCache_.enabled || !FileStamp(filename, &sourceSize, &sourceTime)) return false;
+   long long bytes, time;
+   string path = PixelCachePath(filename);
+   if (!FileStamp(path, &bytes, &time)) return false;
+   reader->file = fopen(path.c_str(), "rb");
+   if (!reader->file) return false;
+
+   PixelCacheHeader header;
+   if (fread(&header, sizeof(header), 1, reader->file) != 1 ||
+       !IsCurrentPixelCacheEntry(header, sourceSize, sourceTime, static_cast<size_t>(bytes)))
+      return false;
+   reader->width = header.width;
+   reader->height = header.height;
+   reader->numComponents = header.numComponents;
+   reader->dataOffset = PIXEL_CACHE_HEADER;
+   return true;
+}
+
+void CloseStripReader(StripReader *reader)
+{
+#ifdef HAVE_LIBPNG
+   if (reader->format == STRIP_PNG)
+      png_destroy_read_struct(&reader->png, &reader->pngInfo, 0);
+#endif
+#ifdef HAVE_LIBJPEG
+   if (reader->format == STRIP_JPEG)
+      jpeg_destroy_decompress(&reader->jpeg);
+#endif
+   if (reader->file)
+      fclose(reader->file);
+   reader->file = 0;
+   DestroyDecodedImage(&reader->decoded);
+}
+
+// opens an image to be read top row first, trying the streaming readers
+// before decoding it whole; returns false if it cannot be read at all
+bool OpenStripReader(StripReader *reader, const string &filename)
+{
+   reader->nextRow = 0;
+   reader->format = STRIP_RAW;
+   if (OpenRawReader(reader, filename))
+      return true;
+   if (reader->file)
+      fclose(reader->file);
+
+   reader->file = fopen(filename.c_str(), "rb");
+   if (!reader->file) return false;
+   unsigned char signature[2] = {};
+   size_t signatureBytes = fread(signature, 1, 2, reader->file);
+   rewind(reader->file);
+
+   reader->format = STRIP_PNM;
+   if (signatureBytes == 2 && signature[0] == 'P' &&
+       ReadPnmHeader(reader->file, &reader->width, &reader->height, &reader->numComponents))
+   {
+      reader->dataOffset = ftell(reader->file);
+      return true;
+   }
+#ifdef HAVE_LIBPNG
+   reader->format = STRIP_PNG;
+   rewind(reader->file);
+   if (signatureBytes == 2 && signature[0] == 0x89 && signature[1] == 'P')
+   {
+      if (OpenPngReader(reader))
+         return true;
+      png_destroy_read_struct(&reader->png, &reader->pngInfo, 0);
+   }
+#endif
+#ifdef HAVE_LIBJPEG
+   reader->format = STRIP_JPEG;
+   rewind(reader->file);
+   if (signatureBytes == 2 && signature[0] == 0xFF && signature[1] == 0xD8)
+   {
+      if (OpenJpegReader(reader))
+         return true;
+      jpeg_destroy_decompress(&reader->jpeg);
+   }
+#endif
+   fclose(reader->file);
+   reader->file = 0;
+
+   reader->format = STRIP_DECODED;
+   stbi_set_flip_vertically_on_load(true);
+   DecodeImage(&reader->decoded, filename);
+   reader->width = reader->decoded.width;
+   reader->height = reader->decoded.height;
+   reader->numComponents = reader->decoded.numComponents;
+   return reader->decoded.pixels != 0;
+}
+
+// reads the next rows of the image, top first, tightly packed
+bool ReadStripRows(StripReader *reader, unsigned char *rows, int count)
+{
+   count = min(count, reader->height - reader->nextRow);
+   size_t rowBytes = static_cast<size_t>(reader->width) * reader->numComponents;
+   bool success = true;
+   switch (reader->format)
+   {
+   case STRIP_RAW:
+      for (int i = 0; i < count && success; i++)
+      {
+         long long stored = reader->height - 1 - (reader->nextRow + i);
+         success = SeekFile(reader->file, reader->dataOffset + stored * static_cast<long long>(rowBytes)) &&
+            fread(rows + i * rowBytes, rowBytes, 1, reader->file) == 1;
+      }
+      break;
+   case STRIP_PNM:
+      success = count == 0 || fread(rows, rowBytes, count, reader->file) == static_cast<size_t>(count);
+      break;
+#ifdef HAVE_LIBPNG
+   case STRIP_PNG:
+      success = ReadPngRows(reader, rows, count);
+      break;
+#endif
+#ifdef HAVE_LIBJPEG
+   case STRIP_JPEG:
+      success = ReadJpegRows(reader, rows, count);
+      break;
+#endif
+   default:
+      for (int i = 0; i < count; i++)
+      {
+         int stored = reader->height - 1 - (reader->nextRow + i);
+         memcpy(rows + i * rowBytes, reader->decoded.pixels + stored * rowBytes, rowBytes);
+      }
+   }
+   reader->nextRow += count;
+   return success;
+}
+
+// a PNG of RGB rows written top first as they come
+struct PngWriter
+{
+   FILE *file;
+   int width;
+   int height;
+
+#ifdef HAVE_LIBPNG
+   png_structp png;
+   png_infop info;
+#else
+   // the image data's zlib stream as stored deflate blocks: the block being
+   // filled, the Adler-32 checksum of everything so far, and whether the
+   // stream header has gone out yet
+   vector<unsigned char> block;
+   unsigned int adlerLow;
+   unsigned int adlerHigh;
+   bool started;
+#endif
+
+   PngWriter() : file(0), width(0), height(0)
+   {}
+};
+
+#ifndef HAVE_LIBPNG
+// largest stored deflate block
+static const size_t DEFLATE_STORED_BLOCK = 65535;
+
+vector<unsigned int> BuildCrcTable()
+{
+   vector<unsigned int> table(256);
+   for (unsigned int i = 0; i < 256; i++)
+   {
+      unsigned int c = i;
+      for (int k = 0; k < 8; k++)
+         c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      table[i] = c;
+   }
+   return table;
+}
+
+// the CRC-32 PNG chunks end with, continued from an earlier value
+unsigned int Crc32(unsigned int crc, const unsigned char *data, size_t length)
+{
+   static const vector<unsigned int> table = BuildCrcTable();
+   crc = ~crc;
+   for (size_t i = 0; i < length; i++)
+      crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+   return ~crc;
+}
+
+void PutBigEndian(vector<unsigned char> *bytes, unsigned int value)
+{
+   for (int shift = 24; shift >= 0; shift -= 8)
+      bytes->push_back(static_cast<unsigned char>(value >> shift));
+}
+
+bool WritePngChunk(FILE *file, const char *type, const vector<unsigned char> &data)
+{
+   vector<unsigned char> chunk;
+   PutBigEndian(&chunk, static_cast<unsigned int>(data.size()));
+   chunk.insert(chunk.end(), type, type + 4);
+   chunk.insert(chunk.end(), data.begin(), data.end());
+   PutBigEndian(&chunk, Crc32(0, chunk.data() + 4, chunk.size() - 4));
+   return fwrite(chunk.data(), 1, chunk.size(), file) == chunk.size();
+}
+
+// writes the filled block as an IDAT chunk, ending the stream with its
+// checksum if it is the last
+bool FlushPngBlock(PngWriter *writer, bool last)
+{
+   vector<unsigned char> data;
+   if (!writer->started)
+   {
+      // zlib header: deflate with a 32K window, no preset dictionary
+      data.push_back(0x78);
+      data.push_back(0x01);
+      writer->started = true;
+   }
+   unsigned int length = static_cast<unsigned int>(writer->block.size());
+   data.push_back(last ? 1 : 0);
+   data.push_back(length & 0xFF);
+   data.push_back(length >> 8);
+   data.push_back(~length & 0xFF);
+   data.push_back((~length >> 8) & 0xFF);
+   data.insert(data.end(), writer->block.begin(), writer->block.end());
+   if (last)
+      PutBigEndian(&data, writer->adlerHigh << 16 | writer->adlerLow);
+   writer->block.clear();
+   return WritePngChunk(writer->file, "IDAT", data);
+}
+
+// adds bytes to the image data, writing out each block as it fills
+bool AppendPngData(PngWriter *writer, const unsigned char *data, size_t length)
+{
+   while (length > 0)
+   {
+      size_t taken = min(length, DEFLATE_STORED_BLOCK - writer->block.size());
+      writer->block.insert(writer->block.end(), data, data + taken);
+
+      // the sums stay within 32 bits for 5552 bytes between reductions
+      for (size_t done = 0; done < taken; )
+      {
+         size_t run = min(taken - done, static_cast<size_t>(5552));
+         for (size_t i = done; i < done + run; i++)
+         {
+            writer->adlerLow += data[i];
+            writer->adlerHigh += writer->adlerLow;
+         }
+         writer->adlerLow %= 65521;
+         writer->adlerHigh %= 65521;
+         done += run;
+      }
+      data += taken;
+      length -= taken;
+      if (writer->block.size() == DEFLATE_STORED_BLOCK && !FlushPngBlock(writer, false))
+         return false;
+   }
+   return true;
+}
+#endif
+
+bool OpenPngWriter(PngWriter *writer, const string &filename, int width, int height)
+{
+   writer->width = width;
+   writer->height = height;
+   writer->file = fopen(filename.c_str(), "wb");
+   if (!writer->file) return false;
+#ifdef HAVE_LIBPNG
+   writer->png = png_create_write_struct(PNG_LIBPNG_VER_STRING, 0, 0, 0);
+   writer->info = writer->png ? png_create_info_struct(writer->png) : 0;
+   if (!writer->info)
+      return false;
+   if (setjmp(png_jmpbuf(writer->png)))
+      return false;
+   png_init_io(writer->png, writer->file);
+   png_set_IHDR(writer->png, writer->info, width, height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+                PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+   png_write_info(writer->png, writer->info);
+   return true;
+#else
+   writer->adlerLow = 1;
+   writer->adlerHigh = 0;
+   writer->started = false;
+   writer->block.reserve(DEFLATE_STORED_BLOCK);
+
+   static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+   vector<unsigned char> header;
+   PutBigEndian(&header, width);
+   PutBigEndian(&header, height);
+   // 8 bits a sample, RGB, deflate, standard filters, not interlaced
+   const unsigned char format[5] = { 8, 2, 0, 0, 0 };
+   header.insert(header.end(), format, format + 5);
+   return fwrite(signature, 1, 8, writer->file) == 8 && WritePngChunk(writer->file, "IHDR", header);
+#endif
+}
+
+// writes the next rows of the image, top first, tightly packed
+bool WritePngRows(PngWriter *writer, const unsigned char *rows, int count)
+{
+   size_t rowBytes = static_cast<size_t>(writer->width) * 3;
+#ifdef HAVE_LIBPNG
+   if (setjmp(png_jmpbuf(writer->png)))
+      return false;
+   for (int i = 0; i < count; i++)
+      png_write_row(writer->png, const_cast<unsigned char *>(rows + i * rowBytes));
+   return true;
+#else
+   // every row goes out unfiltered
+   const unsigned char filter = 0;
+   for (int i = 0; i < count; i++)
+      if (!AppendPngData(writer, &filter, 1) || !AppendPngData(writer, rows + i * rowBytes, rowBytes))
+         return false;
+   return true;
+#endif
+}
+
+// finishes the file, returning false if any of it could not be written
+bool ClosePngWriter(PngWriter *writer)
+{
+   if (!writer->file) return false;
+   bool success = true;
+#ifdef HAVE_LIBPNG
+   if (!writer->info)
+      success = false;
+   else if (setjmp(png_jmpbuf(writer->png)))
+      success = false;
+   else
+      png_write_end(writer->png, writer->info);
+   png_destroy_write_struct(&writer->png, &writer->info);
+#else
+   success = FlushPngBlock(writer, true) && WritePngChunk(writer->file, "IEND", vector<unsigned char>());
+#endif
+   success = fclose(writer->file) == 0 && success;
+   writer->file = 0;
+   return success;
+}
+
+// --------------------------------------------------------------------------
+// Headless batch processing: every image in a directory is decoded on the
+// worker pool, rendered at native resolution into a render target, read back
+// and encoded to PNG on separate threads so the three stages overlap
+
+struct BatchOptions
+{
+   bool enabled;
+   string inputDirectory;
+   string outputDirectory;
+
+   // effects applied to every image, in command line order
+   vector<EffectStage> chain;
+
+   // process on the CPU engine instead of OpenGL, optionally forcing a
+   // kernel set ("scalar", "sse4" or "avx2"), with the image split into tiles
+   // spread over a number of threads
+   bool useCpu;
+   string cpuKernels;
+   int cpuThreads;
+   int tileWidth;
+   int tileHeight;
+   bool tileReport;
+
+   // decode, process and encode each image this many rows at a time, with
+   // the rows its effects read around them, rather than whole; 0 is whole
+   int stripRows;
+
+   BatchOptions() : enabled(false), useCpu(false),
+      cpuThreads(0), tileWidth(128), tileHeight(128), tileReport(false), stripRows(0)
+   {}
+};
+
+// lists the image files in a directory, sorted by name
+vector<string> ListImageFiles(const string &directory)
+{
+   vector<string> names;
+#ifdef _WIN32
+   WIN32_FIND_DATAA entry;
+   HANDLE search = FindFirstFileA((directory + "\\*").c_str(), &entry);
+   if (search != INVALID_HANDLE_VALUE)
+   {
+      do names.push_back(entry.cFileName);
+      while (FindNextFileA(search, &entry));
+      FindClose(search);
+   }
+#else
+   DIR *dir = opendir(directory.c_str());
+   if (dir)
+   {
+      for (dirent *entry = readdir(dir); entry; entry = readdir(dir))
+         names.push_back(entry->d_name);
+      closedir(dir);
+   }
+#endif
+
+   const char *extensions[] = { ".png", ".jpg", ".jpeg", ".bmp", ".tga", ".gif", ".psd", ".hdr", ".pgm", ".ppm" };
+   vector<string> files;
+   for (size_t i = 0; i < names.size(); i++)
+   {
+      string lower = names[i];
+      transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+      for (size_t e = 0; e < sizeof(extensions) / sizeof(extensions[0]); e++)
+      {
+         string extension = extensions[e];
+         if (lower.size() > extension.size() &&
+             lower.compare(lower.size() - extension.size(), extension.size(), extension) == 0)
+         {
+            files.push_back(directory + "/" + names[i]);
+            break;
+         }
+      }
+   }
+   sort(files.begin(), files.end());
+   return files;
+}
+
+// output path for an input image: PNG inputs keep their name, others have
+// .png appended, so that a.jpg and a.png in one directory do not collide
+string BatchOutputPath(const string &outputDirectory, const string &inputPath)
+{
+   size_t slash = inputPath.find_last_of("/\\");
+   string name = slash == string::npos ? inputPath : inputPath.substr(slash + 1);
+   string lower = name;
+   transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+   if (lower.size() > 4 && lower.compare(lower.size() - 4, 4, ".png") == 0)
+      return outputDirectory + "/" + name;
+   return outputDirectory + "/" + name + ".png";
+}
+
+struct EncodeJob
+{
+   string filename;
+   int width;
+   int height;
+   vector<unsigned char> pixels;
+
+   EncodeJob() : width(0), height(0)
+   {}
+};
+
+// bounded queue of rendered images waiting to be written by encoder threads
+struct EncodeQueue
+{
+   vector<thread> workers;
+   mutex lock;
+   condition_variable changed;
+   deque<EncodeJob> jobs;
+   size_t maxPending;
+   bool stopping;
+
+   // images that could not be written
+   atomic<int> failures;
+
+   EncodeQueue() : maxPending(4), stopping(false), failures(0)
+   {}
+};
+
+void EncodeWorker(EncodeQueue *queue)
+{
+   unique_lock<mutex> guard(queue->lock);
+   while (true)
+   {
+      while (!queue->stopping && queue->jobs.empty())
+         queue->changed.wait(guard);
+      if (queue->jobs.empty()) return;
+
+      EncodeJob job;
+      swap(job, queue->jobs.front());
+      queue->jobs.pop_front();
+      queue->changed.notify_all();
+
+      guard.unlock();
+      double start = ProfileBegin();
+      if (!SaveImage(job.filename.c_str(), job.width, job.height, job.pixels.data(), 3))
+         queue->failures++;
+      ProfileEnd("encode", start, job.filename);
+      guard.lock();
+   }
+}
+
+void InitializeEncodeQueue(EncodeQueue *queue, unsigned int threadCount)
+{
+   for (unsigned int i = 0; i < max(threadCount, 1u); i++)
+      queue->workers.push_back(thread(EncodeWorker, queue));
+}
+
+// queues an image for encoding, blocking while the queue is full
+void PushEncodeJob(EncodeQueue *queue, EncodeJob &job)
+{
+   unique_lock<mutex> guard(queue->lock);
+   while (queue->jobs.size() >= queue->maxPending)
+      queue->changed.wait(guard);
+   queue->jobs.push_back(EncodeJob());
+   swap(queue->jobs.back(), job);
+   queue->changed.notify_all();
+}
+
+// finishes all queued jobs and stops the encoder threads
+void DestroyEncodeQueue(EncodeQueue *queue)
+{
+   {
+      lock_guard<mutex> guard(queue->lock);
+      queue->stopping = true;
+   }
+   queue->changed.notify_all();
+   for (size_t i = 0; i < queue->workers.size(); i++)
+      queue->workers[i].join();
+   queue->workers.clear();
+}
+
+// renders a texture through the effect chain at native resolution into the
+// target and reads it back as tightly packed RGB rows, top row first
+bool RenderToReadback(MyRenderTarget *target, MyTexture *texture, EffectPipeline *pipeline,
+                      const vector<EffectStage> &chain, PixelTransfer *transfer)
+{
+   EnsureRenderTarget(target, texture->width, texture->height);
+
+   MyGeometry geometry;
+   InitializeGeometry(&geometry, texture);
+
+   GLfloat fillMatrix[16];
+   BuildFillMatrix(*texture, true, fillMatrix);
+
+   glBindFramebuffer(GL_FRAMEBUFFER, target->framebuffer);
+   glViewport(0, 0, target->width, target->height);
+   bool success = RenderEffectChain(pipeline, &geometry, texture, chain, fillMatrix);
+
+   // the readback is only queued here; the pixels are collected images later
+   if (success)
+      BeginReadback(transfer, target->width, target->height);
+   glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+   DestroyGeometry(&geometry);
+   return success;
+}
+
+// rows beyond a band that its effects read, through the whole chain, on
+// either engine
+int StripHalo(const vector<EffectStage> &chain)
+{
+   int cpuHalo = 0;
+   for (size_t i = 0; i < chain.size(); i++)
+      cpuHalo += CpuEffectHalo(chain[i]);
+   return max(cpuHalo, EffectChainHalo(chain));
+}
+
+// decodes, processes and encodes an image a band of rows at a time, top band
+// first, keeping only the band and the rows around it that its effects read;
+// those rows make each band come out as it would from the whole image. On
+// the GPU, bands go through a texture of their own size.
+bool ProcessImageInStrips(const string &inputPath, const string &outputPath, const BatchOptions &options,
+                          const CpuKernels *kernels, CpuTiling *tiling, EffectPipeline *pipeline,
+                          MyRenderTarget *target, PixelTransfer *transfer, MyTexture *bandTexture)
+{
+   StripReader reader;
+   if (!OpenStripReader(&reader, inputPath))
+   {
+      CloseStripReader(&reader);
+      return false;
+   }
+   PngWriter writer;
+   if (!OpenPngWriter(&writer, outputPath, reader.width, reader.height))
+   {
+      CloseStripReader(&reader);
+      ClosePngWriter(&writer);
+      return false;
+   }
+
+   int width = reader.width;
+   int height = reader.height;
+   int components = reader.numComponents;
+   int halo = StripHalo(options.chain);
+   int bandRows = max(options.stripRows, 1);
+   size_t rowBytes = static_cast<size_t>(width) * components;
+
+   // image rows windowTop onwards, top first, as read so far
+   vector<unsigned char> window(static_cast<size_t>(min(bandRows + 2 * halo, height)) * rowBytes);
+   vector<unsigned char> result;
+   int windowTop = 0;
+   int windowRows = 0;
+   bool success = true;
+   for (int bandTop = 0; bandTop < height && success; bandTop += bandRows)
+   {
+      int bandBottom = min(bandTop + bandRows, height);
+      int top = max(bandTop - halo, 0);
+      int bottom = min(bandBottom + halo, height);
+
+      // keep the rows shared with the previous band and read the rest
+      int kept = max(windowTop + windowRows - top, 0);
+      memmove(window.data(), window.data() + static_cast<size_t>(top - windowTop) * rowBytes, kept * rowBytes);
+      success = ReadStripRows(&reader, window.data() + kept * rowBytes, bottom - top - kept);
+      windowTop = top;
+      windowRows = bottom - top;
+      if (!success) break;
+
+      // both engines take rows bottom first, so the window goes in upside down
+      unsigned char *lastRow = window.data() + (windowRows - 1) * rowBytes;
+      if (kernels)
+      {
+         result.resize(static_cast<size_t>(width) * windowRows * 3);
+         ImageView input = FlippedView(InterleavedView(window.data(), width, windowRows, components));
+         ImageView output = FlippedView(InterleavedView(result.data(), width, windowRows, 3));
+         success = ApplyCpuEffectChain(kernels, input, output, options.chain, tiling);
+      }
+      else
+      {
+         if (bandTexture->width != width || bandTexture->height != windowRows)
+         {
+            if (bandTexture->textureID)
+               DestroyTexture(bandTexture);
+            CreateTexture(bandTexture, width, windowRows, components, GL_TEXTURE_RECTANGLE, 0);
+         }
+         success = RefillTexture(transfer, bandTexture, lastRow, components, -static_cast<ptrdiff_t>(rowBytes)) &&
+            RenderToReadback(target, bandTexture, pipeline, options.chain, transfer) &&
+            FinishReadback(transfer, &result, true);
+      }
+
+      // only the band's own rows go out; the rest belong to its neighbours
+      if (success)
+         success = WritePngRows(&writer, result.data() + static_cast<size_t>(bandTop - top) * width * 3,
+                                bandBottom - bandTop);
+   }
+
+   CloseStripReader(&reader);
+   success = ClosePngWriter(&writer) && success;
+   if (!success)
+      remove(outputPath.c_str());
+   return success;
+}
+
+// hands the oldest GPU result to the encoders once its readback is in,
+// returning false if it could not be read
+bool CollectReadback(PixelTransfer *transfer, deque<EncodeJob> *jobs, EncodeQueue *encoder)
+{
+   EncodeJob job;
+   swap(job, jobs->front());
+   jobs->pop_front();
+   if (!FinishReadback(transfer, &job.pixels, true))
+   {
+      cout << "Unable to read back image: " << job.filename << endl;
+      return false;
+   }
+   PushEncodeJob(encoder, job);
+   return true;
+}
+
+// processes every image in the input directory, returning the number of
+// images that failed
+int RunBatch(const BatchOptions &options, EffectPipeline *pipeline)
+{
+   for (size_t i = 0; i < options.chain.size(); i++)
+   {
+      if (!IsValidEffect(options.chain[i]))
+      {
+         cout << "Unknown effect: --" << options.chain[i].shaderName << " " << options.chain[i].mode << endl;
+         return 1;
+      }
+   }
+
+   if (!options.useCpu && !PrepareEffectChain(pipeline, options.chain))
+   {
+      cout << "Program could not initialize shaders" << endl;
+      return 1;
+   }
+
+   vector<string> inputs = ListImageFiles(options.inputDirectory);
+   if (inputs.empty())
+   {
+      cout << "No images found in " << options.inputDirectory << endl;
+      return 1;
+   }
+   MakeDirectory(options.outputDirectory);
+   if (!DirectoryWritable(options.outputDirectory))
+   {
+      cout << "Unable to write to output directory " << options.outputDirectory << endl;
+      return 1;
+   }
+
+   const CpuKernels *kernels = 0;
+   if (options.useCpu)
+   {
+      kernels = SelectCpuKernels(options.cpuKernels);
+      if (!kernels)
+      {
+         cout << "CPU kernels " << options.cpuKernels << " are not supported here" << endl;
+         return 1;
+      }
+      cout << "Processing on the CPU with " << kernels->name << " kernels" << endl;
+   }
+
+   TaskPool tilePool;
+   CpuTiling tiling;
+   if (kernels)
+   {
+      InitializeTaskPool(&tilePool, options.cpuThreads > 0 ? options.cpuThreads : max(thread::hardware_concurrency(), 1u));
+      tiling.pool = &tilePool;
+      tiling.tileWidth = options.tileWidth;
+      tiling.tileHeight = options.tileHeight;
+   }
+
+   // decode a few images ahead of the GPU. The image being waited for and
+   // the lookahead behind it must all fit in what the decode pool holds on
+   // to, or finished images would be dropped and decoded again
+   unsigned int cores = max(thread::hardware_concurrency(), 2u);
+   DecodePool decoder;
+   decoder.maxCompleted = 2 * cores;
+   InitializeDecodePool(&decoder, cores - 1);
+   EncodeQueue encoder;
+   InitializeEncodeQueue(&encoder, max(cores / 2, 1u));
+
+   // images processed in strips are read as they go, one at a time
+   chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+   size_t lookahead = options.stripRows > 0 ? 0 : decoder.maxCompleted - 1;
+   for (size_t i = 0; i < min(lookahead, inputs.size()); i++)
+      RequestDecode(&decoder, inputs[i], false);
+
+   MyRenderTarget target;
+   PixelTransfer transfer;
+   MyTexture bandTexture;
+   deque<EncodeJob> readbackJobs;
+   int failures = 0;
+   for (size_t i = 0; i < inputs.size(); i++)
+   {
+      if (options.stripRows > 0)
+      {
+         if (!ProcessImageInStrips(inputs[i], BatchOutputPath(options.outputDirectory, inputs[i]), options,
+                                   kernels, &tiling, pipeline, &target, &transfer, &bandTexture))
+         {
+            cout << "Unable to process image: " << inputs[i] << endl;
+            failures++;
+         }
+         ReportProfile();
+         continue;
+      }
+      if (i + lookahead < inputs.size())
+         RequestDecode(&decoder, inputs[i + lookahead], false);
+
+      DecodedImage decoded;
+      WaitDecodedImage(&decoder, inputs[i], &decoded);
+
+      EncodeJob job;
+      job.filename = BatchOutputPath(options.outputDirectory, inputs[i]);
+      job.width = decoded.width;
+      job.height = decoded.height;
+
+      bool success = decoded.pixels != 0;
+      if (success && kernels)
+      {
+         // decoded rows run bottom first, so write them into the PNG buffer
+         // through a flipped view
+         job.pixels.resize(static_cast<size_t>(job.width) * job.height * 3);
+         ImageView input = InterleavedView(decoded.pixels, decoded.width, decoded.height, decoded.numComponents);
+         ImageView output = FlippedView(InterleavedView(job.pixels.data(), job.width, job.height, 3));
+         success = ApplyCpuEffectChain(kernels, input, output, options.chain, &tiling);
+         if (success && options.tileReport)
+            PrintTileTimings(&tiling);
+      }
+      else if (success)
+      {
+         TextureUpload upload;
+         success = BeginTextureUpload(&upload, &decoded, GL_TEXTURE_RECTANGLE);
+         if (success)
+         {
+            ContinueTextureUpload(&transfer, &upload, SIZE_MAX);
+            success = upload.texture.textureID != 0;
+         }
+         if (success)
+            success = RenderToReadback(&target, &upload.texture, pipeline, options.chain, &transfer);
+         if (upload.texture.textureID)
+            DestroyTexture(&upload.texture);
+      }
+      DestroyDecodedImage(&decoded);
+
+      if (!success)
+      {
+         cout << "Unable to process image: " << inputs[i] << endl;
+         failures++;
+         continue;
+      }
+
+      // GPU results wait in their readback buffers while the next images
+      // render, and go to the encoders READBACK_LAG images later
+      if (kernels)
+         PushEncodeJob(&encoder, job);
+      else
+      {
+         readbackJobs.push_back(EncodeJob());
+         swap(readbackJobs.back(), job);
+         if (readbackJobs.size() > READBACK_LAG)
+            failures += CollectReadback(&transfer, &readbackJobs, &encoder) ? 0 : 1;
+         CollectGpuTimers();
+      }
+      ReportProfile();
+   }
+   while (!readbackJobs.empty())
+      failures += CollectReadback(&transfer, &readbackJobs, &encoder) ? 0 : 1;
+
+   DestroyEncodeQueue(&encoder);
+   failures += encoder.failures;
+   DestroyDecodePool(&decoder);
+   if (kernels)
+      DestroyTaskPool(&tilePool);
+   else
+   {
+      PrintPixelTransferStats(&transfer);
+      DestroyPixelTransfer(&transfer);
+      DestroyRenderTarget(&target);
+      if (bandTexture.textureID)
+         DestroyTexture(&bandTexture);
+   }
+
+   double seconds = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+   cout << "Processed " << inputs.size() - failures << " of " << inputs.size() << " images in "
+      << seconds << " s" << endl;
+   if (options.stripRows > 0)
+      cout << "Peak resident memory: " << PeakResidentMB() << " MB" << endl;
+   PrintPixelCacheStats();
+   return failures;
+}
+
+// --------------------------------------------------------------------------
+// Streaming: frames read from stdin as a Y4M or PPM stream go through the
+// effect chain and are written to stdout in the same format. A reader
+// thread, the GL thread and a writer thread pass frames along through
+// bounded queues; frames come from a fixed pool and go back to it once
+// written, so a stream of one size allocates no pixel memory after its first
+// frames. The GL thread uploads, renders and reads back with up to
+// READBACK_LAG frames in flight on the GPU.
+
+enum StreamDropPolicy
+{
+   // the reader waits for room, slowing the producer down through the pipe
+   STREAM_BLOCK,
+   // the reader discards the frame it just read, or the oldest waiting one
+   STREAM_DROP_NEWEST,
+   STREAM_DROP_OLDEST
+};
+
+struct StreamOptions
+{
+   bool enabled;
+
+   // frames each queue between two stages holds
+   int queueDepth;
+   StreamDropPolicy dropPolicy;
+
+   // print every frame's latency, not just the summary
+   bool latencyReport;
+
+   StreamOptions() : enabled(false), queueDepth(4), dropPolicy(STREAM_BLOCK), latencyReport(false)
+   {}
+};
+
+// the layout of the frames on stdin, which is also used for stdout
+struct StreamFormat
+{
+   bool y4m;
+
+   // Y4M only: the stream header line, written back out unchanged, the
+   // chroma subsampling (420, 444, or 0 for greyscale) and the frame size
+   string header;
+   int chroma;
+   int width;
+   int height;
+
+   StreamFormat() : y4m(false), chroma(420), width(0), height(0)
+   {}
+};
+
+struct StreamFrame
+{
+   long long index;
+   int width;
+   int height;
+
+   // RGB rows as read, bottom first like a decoded image, and the processed
+   // result top first as it is written out
+   vector<unsigned char> pixels;
+   vector<unsigned char> result;
+
+   // when the reader had the whole frame
+   chrono::high_resolution_clock::time_point arrival;
+
+   StreamFrame() : index(0), width(0), height(0)
+   {}
+};
+
+// bounded queue of frames between two stages, kept in a fixed ring so that
+// passing frames along never allocates
+struct FrameQueue
+{
+   vector<StreamFrame *> ring;
+   size_t head;
+   size_t count;
+   bool closed;
+   mutex lock;
+   condition_variable changed;
+
+   FrameQueue() : head(0), count(0), closed(false)
+   {}
+};
+
+void InitializeFrameQueue(FrameQueue *queue, size_t capacity)
+{
+   queue->ring.assign(max(capacity, static_cast<size_t>(1)), static_cast<StreamFrame *>(0));
+   queue->head = 0;
+   queue->count = 0;
+   queue->closed = false;
+}
+
+// adds a frame, applying the policy when the queue is full; returns the
+// frame that was dropped to make room, or the frame itself if it was not
+// taken, or null
+StreamFrame *PushFrame(FrameQueue *queue, StreamFrame *frame, StreamDropPolicy policy = STREAM_BLOCK)
+{
+   unique_lock<mutex> guard(queue->lock);
+   StreamFrame *dropped = 0;
+   size_t capacity = queue->ring.size();
+   if (queue->count == capacity)
+   {
+      if (policy == STREAM_DROP_NEWEST)
+         return frame;
+      if (policy == STREAM_DROP_OLDEST)
+      {
+         dropped = queue->ring[queue->head];
+         queue->head = (queue->head + 1) % capacity;
+         queue->count--;
+      }
+      while (queue->count == capacity)
+         queue->changed.wait(guard);
+   }
+   queue->ring[(queue->head + queue->count) % capacity] = frame;
+   queue->count++;
+   queue->changed.notify_all();
+   return dropped;
+}
+
+// takes the oldest frame, waiting for one if asked to; returns null once the
+// queue is closed and empty, or straight away if it is empty and not waiting
+StreamFrame *PopFrame(FrameQueue *queue, bool wait = true)
+{
+   unique_lock<mutex> guard(queue->lock);
+   while (wait && !queue->closed && queue->count == 0)
+      queue->changed.wait(guard);
+   if (queue->count == 0) return 0;
+
+   StreamFrame *frame = queue->ring[queue->head];
+   queue->head = (queue->head + 1) % queue->ring.size();
+   queue->count--;
+   queue->changed.notify_all();
+   return frame;
+}
+
+// tells the consumer that no more frames are coming
+void CloseFrameQueue(FrameQueue *queue)
+{
+   lock_guard<mutex> guard(queue->lock);
+   queue->closed = true;
+   queue->changed.notify_all();
+}
+
+// reads the Y4M stream header, returning false if it is not a stream this
+// program understands
+bool ReadY4mHeader(FILE *file, StreamFormat *format)
+{
+   format->y4m = true;
+   format->header.clear();
+   for (int c = getc(file); c != '\n'; c = getc(file))
+   {
+      if (c == EOF || format->header.size() > 1024) return false;
+      format->header.push_back(static_cast<char>(c));
+   }
+
+   istringstream tokens(format->header);
+   string token;
+   tokens >> token;
+   if (token != "YUV4MPEG2") return false;
+   while (tokens >> token)
+   {
+      if (token[0] == 'W')
+         format->width = atoi(token.c_str() + 1);
+      else if (token[0] == 'H')
+         format->height = atoi(token.c_str() + 1);
+      else if (token == "C444")
+         format->chroma = 444;
+      else if (token == "Cmono")
+         format->chroma = 0;
+      else if (token[0] == 'C' && token.compare(0, 4, "C420") != 0)
+      {
+         cout << "Unsupported Y4M colour space: " << token.substr(1) << endl;
+         return false;
+      }
+   }
+   return format->width > 0 && format->height > 0;
+}
+
+// size of each chroma plane of a Y4M frame
+void Y4mChromaSize(const StreamFormat &format, int *width, int *height)
+{
+   *width = format.chroma == 420 ? (format.width + 1) / 2 : format.chroma ? format.width : 0;
+   *height = format.chroma == 420 ? (format.height + 1) / 2 : format.chroma ? format.height : 0;
+}
+
+size_t Y4mFrameBytes(const StreamFormat &format)
+{
+   int chromaWidth, chromaHeight;
+   Y4mChromaSize(format, &chromaWidth, &chromaHeight);
+   return static_cast<size_t>(format.width) * format.height + 2 * static_cast<size_t>(chromaWidth) * chromaHeight;
+}
+
+unsigned char ClampToByte(int value)
+{
+   return static_cast<unsigned char>(value < 0 ? 0 : value > 255 ? 255 : value);
+}
+
+// converts a Y4M frame, BT.601 with video range levels, to RGB rows stored
+// bottom first
+void Y4mToRgb(const StreamFormat &format, const unsigned char *planes, unsigned char *rgb)
+{
+   int chromaWidth, chromaHeight;
+   Y4mChromaSize(format, &chromaWidth, &chromaHeight);
+   const unsigned char *lumaPlane = planes;
+   const unsigned char *uPlane = planes + static_cast<size_t>(format.width) * format.height;
+   const unsigned char *vPlane = uPlane + static_cast<size_t>(chromaWidth) * chromaHeight;
+   int shift = format.chroma == 420 ? 1 : 0;
+
+   for (int y = 0; y < format.height; y++)
+   {
+      const unsigned char *luma = lumaPlane + static_cast<size_t>(y) * format.width;
+      const unsigned char *u = uPlane + static_cast<size_t>(y >> shift) * chromaWidth;
+      const unsigned char *v = vPlane + static_cast<size_t>(y >> shift) * chromaWidth;
+      unsigned char *out = rgb + static_cast<size_t>(format.height - 1 - y) * format.width * 3;
+      for (int x = 0; x < format.width; x++)
+      {
+         int c = 298 * (luma[x] - 16) + 128;
+         int d = format.chroma ? u[x >> shift] - 128 : 0;
+         int e = format.chroma ? v[x >> shift] - 128 : 0;
+         out[3 * x + 0] = ClampToByte((c + 409 * e) >> 8);
+         out[3 * x + 1] = ClampToByte((c - 100 * d - 208 * e) >> 8);
+         out[3 * x + 2] = ClampToByte((c + 516 * d) >> 8);
+      }
+   }
+}
+
+// converts RGB rows stored top first to a Y4M frame; 4:2:0 chroma comes from
+// the average colour of each 2x2 block
+void RgbToY4m(const StreamFormat &format, const unsigned char *rgb, unsigned char *planes)
+{
+   int chromaWidth, chromaHeight;
+   Y4mChromaSize(format, &chromaWidth, &chromaHeight);
+   unsigned char *uPlane = planes + static_cast<size_t>(format.width) * format.height;
+   unsigned char *vPlane = uPlane + static_cast<size_t>(chromaWidth) * chromaHeight;
+   size_t rowBytes = static_cast<size_t>(format.width) * 3;
+
+   for (int y = 0; y < format.height; y++)
+   {
+      const unsigned char *in = rgb + y * rowBytes;
+      unsigned char *luma = planes + static_cast<size_t>(y) * format.width;
+      for (int x = 0; x < format.width; x++)
+         luma[x] = ClampToByte(((66 * in[3 * x] + 129 * in[3 * x + 1] + 25 * in[3 * x + 2] + 128) >> 8) + 16);
+   }
+
+   int block = format.chroma == 420 ? 2 : 1;
+   for (int cy = 0; cy < chromaHeight; cy++)
+   {
+      int y0 = cy * block, y1 = min(y0 + block, format.height);
+      for (int cx = 0; cx < chromaWidth; cx++)
+      {
+         int x0 = cx * block, x1 = min(x0 + block, format.width);
+         int sum[3] = { 0, 0, 0 };
+         for (int y = y0; y < y1; y++)
+            for (int x = x0; x < x1; x++)
+               for (int k = 0; k < 3; k++)
+                  sum[k] += rgb[y * rowBytes + 3 * x + k];
+         int samples = (y1 - y0) * (x1 - x0);
+         int r = sum[0] / samples, g = sum[1] / samples, b = sum[2] / samples;
+         uPlane[static_cast<size_t>(cy) * chromaWidth + cx] = ClampToByte(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+         vPlane[static_cast<size_t>(cy) * chromaWidth + cx] = ClampToByte(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+      }
+   }
+}
+
+// reads the next frame into the frame's pixels, using planes as scratch for
+// Y4M; returns false at the end of the stream or on a malformed frame
+bool ReadStreamFrame(FILE *file, const StreamFormat &format, StreamFrame *frame, vector<unsigned char> *planes)
+{
+   int c = getc(file);
+   if (c == EOF) return false;
+
+   if (format.y4m)
+   {
+      char tag[5] = { static_cast<char>(c) };
+      if (fread(tag + 1, 1, 4, file) != 4 || memcmp(tag, "FRAME", 5) != 0)
+      {
+         cout << "Malformed Y4M frame header" << endl;
+         return false;
+      }
+      // frame parameters are ignored
+      while (c != '\n' && c != EOF)
+         c = getc(file);
+
+      frame->width = format.width;
+      frame->height = format.height;
+      planes->resize(Y4mFrameBytes(format));
+      if (fread(planes->data(), 1, planes->size(), file) != planes->size())
+      {
+         cout << "Truncated Y4M frame" << endl;
+         return false;
+      }
+      frame->pixels.resize(static_cast<size_t>(frame->width) * frame->height * 3);
+      Y4mToRgb(format, planes->data(), frame->pixels.data());
+      return true;
+   }
+
+   // binary PPM frames carry their own size, which may change between frames
+   int maxValue = 0;
+   if (c != 'P' || getc(file) != '6' || !ReadPnmNumber(file, &frame->width) ||
+       !ReadPnmNumber(file, &frame->height) || !ReadPnmNumber(file, &maxValue) || maxValue != 255)
+   {
+      cout << "Malformed or unsupported PPM frame header" << endl;
+      return false;
+   }
+   size_t rowBytes = static_cast<size_t>(frame->width) * 3;
+   frame->pixels.resize(rowBytes * frame->height);
+   for (int y = frame->height - 1; y >= 0; y--)
+   {
+      if (fread(frame->pixels.data() + y * rowBytes, 1, rowBytes, file) != rowBytes)
+      {
+         cout << "Truncated PPM frame" << endl;
+         return false;
+      }
+   }
+   return true;
+}
+
+// writes a frame's result, returning false once the output is gone
+bool WriteStreamFrame(FILE *file, const StreamFormat &format, const StreamFrame *frame, vector<unsigned char> *planes)
+{
+   if (format.y4m)
+   {
+      planes->resize(Y4mFrameBytes(format));
+      RgbToY4m(format, frame->result.data(), planes->data());
+      fputs("FRAME\n", file);
+      fwrite(planes->data(), 1, planes->size(), file);
+   }
+   else
+   {
+      fprintf(file, "P6\n%d %d\n255\n", frame->width, frame->height);
+      fwrite(frame->result.data(), 1, frame->result.size(), file);
+   }
+   return fflush(file) == 0 && !ferror(file);
+}
+
+// latencies are counted in buckets of a tenth of a millisecond up to a
+// second, the last bucket taking everything slower
+static const int LATENCY_BUCKETS = 10001;
+
+struct StreamState
+{
+   StreamOptions options;
+   StreamFormat format;
+
+   // frames flow free -> decoded -> (GPU in flight) -> processed -> free
+   vector<StreamFrame> pool;
+   FrameQueue free;
+   FrameQueue decoded;
+   FrameQueue processed;
+
+   // set by the writer when stdout is closed, stopping the reader
+   atomic<bool> outputFailed;
+
+   // statistics, each only changed by the thread that owns it
+   long long framesRead;
+   long long framesDropped;
+   long long framesWritten;
+   double latencyTotal;
+   double latencyMax;
+   vector<int> latencyHistogram;
+
+   StreamState() : outputFailed(false), framesRead(0), framesDropped(0), framesWritten(0),
+      latencyTotal(0.0), latencyMax(0.0)
+   {}
+};
+
+void StreamReader(StreamState *stream)
+{
+   vector<unsigned char> planes;
+   while (!stream->outputFailed)
+   {
+      StreamFrame *frame = PopFrame(&stream->free);
+      double start = ProfileBegin();
+      if (!ReadStreamFrame(stdin, stream->format, frame, &planes))
+      {
+         PushFrame(&stream->free, frame);
+         break;
+      }
+      ProfileEnd("stream read", start);
+      frame->index = stream->framesRead++;
+      frame->arrival = chrono::high_resolution_clock::now();
+
+      StreamFrame *dropped = PushFrame(&stream->decoded, frame, stream->options.dropPolicy);
+      if (dropped)
+      {
+         stream->framesDropped++;
+         PushFrame(&stream->free, dropped);
+      }
+   }
+   CloseFrameQueue(&stream->decoded);
+}
+
+void StreamWriter(StreamState *stream)
+{
+   vector<unsigned char> planes;
+   if (stream->format.y4m)
+      stream->outputFailed = fprintf(stdout, "%s\n", stream->format.header.c_str()) < 0;
+
+   for (StreamFrame *frame = PopFrame(&stream->processed); frame; frame = PopFrame(&stream->processed))
+   {
+      // once stdout is gone frames are only recycled, so that nothing
+      // upstream waits forever
+      if (!stream->outputFailed)
+      {
+         double start = ProfileBegin();
+         stream->outputFailed = !WriteStreamFrame(stdout, stream->format, frame, &planes);
+         ProfileEnd("stream write", start);
+         if (stream->outputFailed)
+            cout << "Unable to write to the output stream" << endl;
+      }
+      if (!stream->outputFailed)
+      {
+         double latency = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - frame->arrival).count();
+         stream->framesWritten++;
+         stream->latencyTotal += latency;
+         stream->latencyMax = max(stream->latencyMax, latency);
+         stream->latencyHistogram[min(static_cast<int>(latency * 10.0), LATENCY_BUCKETS - 1)]++;
+         if (stream->options.latencyReport)
+         {
+            ostringstream line;
+            line << "Frame " << frame->index << ": " << fixed << setprecision(2) << latency << " ms";
+            cout << line.str() << endl;
+         }
+      }
+      PushFrame(&stream->free, frame);
+   }
+}
+
+// a latency percentile in milliseconds, from the histogram
+double StreamLatencyPercentile(const StreamState *stream, int percent)
+{
+   long long target = (stream->framesWritten * percent + 99) / 100;
+   long long seen = 0;
+   for (int i = 0; i < LATENCY_BUCKETS; i++)
+   {
+      seen += stream->latencyHistogram[i];
+      if (seen >= max(target, 1LL))
+         return min((i + 1) / 10.0, stream->latencyMax);
+   }
+   return stream->latencyMax;
+}
+
+void PrintStreamStats(const StreamState *stream, double seconds)
+{
+   cout << "Stream: " << stream->framesRead << " frames read, " << stream->framesDropped << " dropped, "
+      << stream->framesWritten << " written in " << seconds << " s" << endl;
+   if (stream->framesWritten > 0)
+   {
+      cout << "Frame latency ms: mean " << stream->latencyTotal / stream->framesWritten
+         << ", p50 " << StreamLatencyPercentile(stream, 50) << ", p90 " << StreamLatencyPercentile(stream, 90)
+         << ", p99 " << StreamLatencyPercentile(stream, 99) << ", max " << stream->latencyMax << endl;
+   }
+}
+
+// processes frames from stdin to stdout until the input ends, with the
+// effects and CPU settings given for --batch; returns the number of frames
+// that failed
+int RunStream(const StreamOptions &options, const BatchOptions &batch, EffectPipeline *pipeline)
+{
+   for (size_t i = 0; i < batch.chain.size(); i++)
+   {
+      if (!IsValidEffect(batch.chain[i]))
+      {
+         cout << "Unknown effect: --" << batch.chain[i].shaderName << " " << batch.chain[i].mode << endl;
+         return 1;
+      }
+   }
+   if (!batch.useCpu && !PrepareEffectChain(pipeline, batch.chain))
+   {
+      cout << "Program could not initialize shaders" << endl;
+      return 1;
+   }
+
+   const CpuKernels *kernels = 0;
+   TaskPool tilePool;
+   CpuTiling tiling;
+   if (batch.useCpu)
+   {
+      kernels = SelectCpuKernels(batch.cpuKernels);
+      if (!kernels)
+      {
+         cout << "CPU kernels " << batch.cpuKernels << " are not supported here" << endl;
+         return 1;
+      }
+      InitializeTaskPool(&tilePool, batch.cpuThreads > 0 ? batch.cpuThreads : max(thread::hardware_concurrency(), 1u));
+      tiling.pool = &tilePool;
+      tiling.tileWidth = batch.tileWidth;
+      tiling.tileHeight = batch.tileHeight;
+   }
+
+#ifdef _WIN32
+   _setmode(_fileno(stdin), _O_BINARY);
+   _setmode(_fileno(stdout), _O_BINARY);
+#else
+   // a closed stdout shows up as a failed write rather than ending the program
+   signal(SIGPIPE, SIG_IGN);
+#endif
+
+   StreamState stream;
+   stream.options = options;
+   int first = getc(stdin);
+   ungetc(first, stdin);
+   if (first == 'Y' ? !ReadY4mHeader(stdin, &stream.format) : first != 'P')
+   {
+      cout << "Input is not a Y4M or binary PPM stream" << endl;
+      if (kernels)
+         DestroyTaskPool(&tilePool);
+      return 1;
+   }
+   cout << "Streaming " << (stream.format.y4m ? "Y4M" : "PPM") << " frames with "
+      << (kernels ? kernels->name : "OpenGL") << " effects" << endl;
+
+   // enough frames for full queues on both sides, the GPU's frames in flight
+   // and the one each thread is working on
+   size_t depth = max(options.queueDepth, 1);
+   stream.pool.resize(2 * depth + READBACK_LAG + 4);
+   InitializeFrameQueue(&stream.free, stream.pool.size());
+   InitializeFrameQueue(&stream.decoded, depth);
+   InitializeFrameQueue(&stream.processed, depth);
+   for (size_t i = 0; i < stream.pool.size(); i++)
+      PushFrame(&stream.free, &stream.pool[i]);
+   stream.latencyHistogram.assign(LATENCY_BUCKETS, 0);
+
+   chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+   thread reader(StreamReader, &stream);
+   thread writer(StreamWriter, &stream);
+
+   // frames rendered on the GPU wait here until their readback is collected
+   FrameQueue inFlight;
+   InitializeFrameQueue(&inFlight, READBACK_LAG + 1);
+   size_t inFlightCount = 0;
+
+   // two textures taken in turn, so that uploading a frame does not wait for
+   // the previous one to finish rendering
+   MyTexture textures[2];
+   int nextTexture = 0;
+   MyRenderTarget target;
+   PixelTransfer transfer;
+   int failures = 0;
+   while (true)
+   {
+      // with results on the GPU, collect one rather than wait for input that
+      // may be a frame interval away
+      StreamFrame *frame = PopFrame(&stream.decoded, inFlightCount == 0);
+      if (!frame && !inFlightCount) break;
+
+      if (frame && kernels)
+      {
+         frame->result.resize(frame->pixels.size());
+         ImageView input = InterleavedView(frame->pixels.data(), frame->width, frame->height, 3);
+         ImageView output = FlippedView(InterleavedView(frame->result.data(), frame->width, frame->height, 3));
+         if (ApplyCpuEffectChain(kernels, input, output, batch.chain, &tiling))
+            PushFrame(&stream.processed, frame);
+         else
+         {
+            cout << "Unable to process frame " << frame->index << endl;
+            failures++;
+            PushFrame(&stream.free, frame);
+         }
+      }
+      else if (frame)
+      {
+         MyTexture *texture = &textures[nextTexture];
+         nextTexture = 1 - nextTexture;
+         if (texture->width != frame->width || texture->height != frame->height)
+         {
+            if (texture->textureID)
+               DestroyTexture(texture);
+            CreateTexture(texture, frame->width, frame->height, 3, GL_TEXTURE_RECTANGLE, 0);
+         }
+
+         if (RefillTexture(&transfer, texture, frame->pixels.data(), 3) &&
+             RenderToReadback(&target, texture, pipeline, batch.chain, &transfer))
+         {
+            PushFrame(&inFlight, frame);
+            inFlightCount++;
+         }
+         else
+         {
+            cout << "Unable to process frame " << frame->index << endl;
+            failures++;
+            PushFrame(&stream.free, frame);
+         }
+         CollectGpuTimers();
+      }
+
+      // a GPU result is collected READBACK_LAG frames later, or as soon as
+      // no input is waiting
+      if (inFlightCount > (frame ? READBACK_LAG : 0))
+      {
+         StreamFrame *oldest = PopFrame(&inFlight);
+         inFlightCount--;
+         if (FinishReadback(&transfer, &oldest->result, true))
+            PushFrame(&stream.processed, oldest);
+         else
+         {
+            cout << "Unable to read back frame " << oldest->index << endl;
+            failures++;
+            PushFrame(&stream.free, oldest);
+         }
+      }
+      ReportProfile();
+   }
+   CloseFrameQueue(&stream.processed);
+   reader.join();
+   writer.join();
+
+   double seconds = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+   if (kernels)
+      DestroyTaskPool(&tilePool);
+   else
+   {
+      PrintPixelTransferStats(&transfer);
+      DestroyPixelTransfer(&transfer);
+      DestroyRenderTarget(&target);
+      for (int i = 0; i < 2; i++)
+         if (textures[i].textureID)
+            DestroyTexture(&textures[i]);
+   }
+   PrintStreamStats(&stream, seconds);
+   return failures + (stream.outputFailed ? 1 : 0);
+}
+
+// --------------------------------------------------------------------------
+// Server: a resident process that keeps the context, the compiled programs
+// and the textures of the images it has processed warm between jobs sent to
+// it over a Unix domain socket. A thread per connection reads its requests,
+// one per line, and waits for each job's result before reading the next;
+// shared memory inputs are copied in and results written out on these
+// threads. The GL thread takes every job waiting when it comes round,
+// decodes the images in the batch that are not resident on the decode pool
+// at once, and renders the jobs back to back with their readbacks in flight
+// as in batch mode.
+//
+// A request is "process INPUT OUTPUT" followed by effect options as on the
+// command line. INPUT is an image file, or shm:NAME:WxHxC for a POSIX shared
+// memory object holding C-channel rows top first; OUTPUT is a PNG file to
+// write, or shm:NAME for a shared memory object the server creates holding
+// the RGB rows top first, which the client unlinks once read. The reply is
+// "ok OUTPUT WIDTH HEIGHT" or "error MESSAGE".
+
+struct ServeOptions
+{
+   bool enabled;
+   string socketPath;
+
+   // the most jobs the GL thread takes at once
+   int maxBatch;
+
+   ServeOptions() : enabled(false), maxBatch(32)
+   {}
+};
+
+struct ServeJob
+{
+   // an image file and the key its texture is cached under, which changes
+   // with the file's size and modification time; or, with no file, pixels
+   // that came in through shared memory, copied bottom row first
+   string filename;
+   string cacheKey;
+   vector<unsigned char> sharedPixels;
+   int width;
+   int height;
+   int numComponents;
+   vector<EffectStage> chain;
+
+   // set by the GL thread: the RGB result top row first, or why there is none
+   bool finished;
+   string error;
+   vector<unsigned char> result;
+
+   ServeJob() : width(0), height(0), numComponents(0), finished(false)
+   {}
+};
+
+struct ServeQueue
+{
+   mutex lock;
+   condition_variable submitted;
+   condition_variable finished;
+   deque<ServeJob *> jobs;
+
+   // open connections, shut down to wake their threads when the server stops
+   set<int> connections;
+   bool stopping;
+
+   // statistics reported on exit
+   long long jobCount;
+   long long batchCount;
+
+   ServeQueue() : stopping(false), jobCount(0), batchCount(0)
+   {}
+};
+
+#ifndef _WIN32
+static volatile sig_atomic_t serveInterrupted_ = 0;
+
+void ServeSignalHandler(int)
+{
+   serveInterrupted_ = 1;
+}
+
+// splits "shm:NAME:WxHxC" into the object's name and the image layout
+bool ParseSharedImage(const string &spec, string *name, int *width, int *height, int *numComponents)
+{
+   size_t colon = spec.find_last_of(':');
+   if (colon <= 4 || sscanf(spec.c_str() + colon + 1, "%dx%dx%d", width, height, numComponents) != 3)
+      return false;
+   *name = spec.substr(4, colon - 4);
+   return *width > 0 && *height > 0 && *numComponents >= 1 && *numComponents <= 4;
+}
+
+// copies the rows of an image in shared memory into the job bottom first,
+// as an uploaded image expects
+bool ReadSharedImage(ServeJob *job, const string &name)
+{
+   int object = shm_open(name.c_str(), O_RDONLY, 0);
+   if (object < 0) return false;
+
+   size_t rowBytes = static_cast<size_t>(job->width) * job->numComponents;
+   size_t bytes = rowBytes * job->height;
+   struct stat info;
+   void *view = MAP_FAILED;
+   if (fstat(object, &info) == 0 && static_cast<size_t>(info.st_size) >= bytes)
+      view = mmap(0, bytes, PROT_READ, MAP_SHARED, object, 0);
+   close(object);
+   if (view == MAP_FAILED) return false;
+
+   job->sharedPixels.resize(bytes);
+   const unsigned char *rows = static_cast<const unsigned char *>(view);
+   for (int y = 0; y < job->height; y++)
+      memcpy(&job->sharedPixels[(job->height - 1 - y) * rowBytes], rows + y * rowBytes, rowBytes);
+   munmap(view, bytes);
+   return true;
+}
+
+// creates or replaces a shared memory object holding the given bytes
+bool WriteSharedImage(const string &name, const vector<unsigned char> &pixels)
+{
+   int object = shm_open(name.c_str(), O_CREAT | O_RDWR, 0600);
+   if (object < 0) return false;
+
+   void *view = MAP_FAILED;
+   if (ftruncate(object, pixels.size()) == 0)
+      view = mmap(0, pixels.size(), PROT_READ | PROT_WRITE, MAP_SHARED, object, 0);
+   close(object);
+   if (view == MAP_FAILED) return false;
+
+   memcpy(view, pixels.data(), pixels.size());
+   munmap(view, pixels.size());
+   return true;
+}
+
+// carries out one request line on a connection thread, returning the reply
+string ServeRequest(ServeQueue *queue, const string &line)
+{
+   istringstream words(line);
+   vector<string> args;
+   for (string word; words >> word; )
+      args.push_back(word);
+   if (args.size() < 3 || args[0] != "process")
+      return "error expected: process INPUT OUTPUT [effect options]";
+
+   ServeJob job;
+   for (size_t i = 3; i < args.size(); i++)
+   {
+      int used = ParseEffectOption(args[i], i + 1 < args.size() ? args[i + 1].c_str() : 0, &job.chain);
+      if (used == 0)
+         return "error unknown option: " + args[i];
+      if (used < 0 || !IsValidEffect(job.chain.back()))
+         return "error unknown effect: " + args[i] + " " + args[i + 1];
+      i += used - 1;
+   }
+
+   const string &input = args[1];
+   if (input.compare(0, 4, "shm:") == 0)
+   {
+      string name;
+      if (!ParseSharedImage(input, &name, &job.width, &job.height, &job.numComponents))
+         return "error expected shm:NAME:WIDTHxHEIGHTxCHANNELS, not " + input;
+      if (!ReadSharedImage(&job, name))
+         return "error unable to read shared memory: " + name;
+   }
+   else
+   {
+      long long size, time;
+      if (!FileStamp(input, &size, &time))
+         return "error no such image: " + input;
+      job.filename = input;
+      job.cacheKey = input + "@" + to_string(size) + ":" + to_string(time);
+   }
+
+   {
+      unique_lock<mutex> guard(queue->lock);
+      if (queue->stopping)
+         return "error server stopping";
+      queue->jobs.push_back(&job);
+      queue->submitted.notify_one();
+      while (!job.finished)
+         queue->finished.wait(guard);
+   }
+   if (!job.error.empty())
+      return "error " + job.error;
+
+   const string &output = args[2];
+   double start = ProfileBegin();
+   if (output.compare(0, 4, "shm:") == 0)
+   {
+      if (!WriteSharedImage(output.substr(4), job.result))
+         return "error unable to write shared memory: " + output.substr(4);
+   }
+   else if (!stbi_write_png(output.c_str(), job.width, job.height, 3, job.result.data(), 0))
+      return "error unable to write image: " + output;
+   ProfileEnd("encode", start, output);
+
+   ostringstream reply;
+   reply << "ok " << output << " " << job.width << " " << job.height;
+   return reply.str();
+}
+
+// reads requests from a client until it disconnects or the server stops
+void ServeConnection(ServeQueue *queue, int connection)
+{
+   string pending;
+   char buffer[4096];
+   while (true)
+   {
+      ssize_t received = recv(connection, buffer, sizeof(buffer), 0);
+      if (received <= 0) break;
+      pending.append(buffer, received);
+
+      size_t end;
+      while ((end = pending.find('\n')) != string::npos)
+      {
+         string line = pending.substr(0, end);
+         pending.erase(0, end + 1);
+         if (!line.empty() && line[line.size() - 1] == '\r')
+            line.erase(line.size() - 1);
+         if (line.find_first_not_of(" \t") == string::npos)
+            continue;
+
+         string reply = ServeRequest(queue, line) + "\n";
+         for (size_t sent = 0; sent < reply.size(); )
+         {
+            ssize_t written = send(connection, reply.data() + sent, reply.size() - sent, 0);
+            if (written <= 0) break;
+            sent += written;
+         }
+      }
+   }
+
+   lock_guard<mutex> guard(queue->lock);
+   queue->connections.erase(connection);
+   close(connection);
+   queue->finished.notify_all();
+}
+
+// accepts clients until the server stops, checking for that a few times a
+// second
+void ServeListener(ServeQueue *queue, int listener)
+{
+   while (true)
+   {
+      {
+         lock_guard<mutex> guard(queue->lock);
+         if (queue->stopping) return;
+      }
+      pollfd waiting = { listener, POLLIN, 0 };
+      if (poll(&waiting, 1, 200) <= 0) continue;
+      int connection = accept(listener, 0, 0);
+      if (connection < 0) continue;
+
+      lock_guard<mutex> guard(queue->lock);
+      queue->connections.insert(connection);
+      thread(ServeConnection, queue, connection).detach();
+   }
+}
+
+// hands a job's result or error back to its connection thread
+void FinishServeJob(ServeQueue *queue, ServeJob *job, const string &error = "")
+{
+   lock_guard<mutex> guard(queue->lock);
+   job->error = error;
+   job->finished = true;
+   queue->finished.notify_all();
+}
+
+// collects the oldest GPU result of a batch once its readback is in
+void CollectServeJob(ServeQueue *queue, PixelTransfer *transfer, deque<ServeJob *> *inFlight)
+{
+   ServeJob *job = inFlight->front();
+   inFlight->pop_front();
+   bool success = FinishReadback(transfer, &job->result, true);
+   FinishServeJob(queue, job, success ? "" : "unable to read back the result");
+}
+
+// uploads or finds a job's image and renders it into the target with its
+// readback queued; returns why it could not, or an empty string
+string RenderServeJob(ServeJob *job, EffectPipeline *pipeline, TextureCache *textures, DecodePool *decoder,
+                      MyRenderTarget *target, PixelTransfer *transfer)
+{
+   MyTexture shared;
+   MyTexture *texture = 0;
+   if (job->filename.empty())
+   {
+      DecodedImage image;
+      image.filename = "shared memory";
+      image.width = job->width;
+      image.height = job->height;
+      image.numComponents = job->numComponents;
+      image.pixels = job->sharedPixels.data();
+      if (UploadTexture(&shared, &image, GL_TEXTURE_RECTANGLE))
+         texture = &shared;
+   }
+   else if (!(texture = FindTexture(textures, job->cacheKey)))
+   {
+      // requested with the rest of the batch, unless an earlier job's image
+      // has pushed it out of the cache since
+      RequestDecode(decoder, job->filename, true);
+      DecodedImage image;
+      WaitDecodedImage(decoder, job->filename, &image);
+      image.filename = job->cacheKey;
+      texture = InsertTexture(textures, &image, GL_TEXTURE_RECTANGLE);
+      DestroyDecodedImage(&image);
+   }
+   if (!texture)
+      return "unable to load image";
+
+   // the image is taken from the decode pool first, so that a failure here
+   // leaves nothing behind for a later request to pick up
+   if (!PrepareEffectChain(pipeline, job->chain))
+   {
+      if (texture == &shared)
+         DestroyTexture(&shared);
+      return "unable to build the effect programs";
+   }
+
+   job->width = texture->width;
+   job->height = texture->height;
+   bool success = RenderToReadback(target, texture, pipeline, job->chain, transfer);
+   if (texture == &shared)
+      DestroyTexture(&shared);
+   return success ? "" : "unable to render the effects";
+}
+
+int RunServer(const ServeOptions &options, TextureCache *textures, EffectPipeline *pipeline)
+{
+   sockaddr_un address;
+   memset(&address, 0, sizeof(address));
+   address.sun_family = AF_UNIX;
+   if (options.socketPath.size() >= sizeof(address.sun_path))
+   {
+      cout << "Socket path is too long: " << options.socketPath << endl;
+      return 1;
+   }
+   strcpy(address.sun_path, options.socketPath.c_str());
+
+   // a socket file left behind by an earlier server that did not stop
+   // cleanly would make the bind fail
+   unlink(options.socketPath.c_str());
+   int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (listener < 0 || bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+       listen(listener, SOMAXCONN) != 0)
+   {
+      cout << "Unable to listen on " << options.socketPath << ": " << strerror(errno) << endl;
+      if (listener >= 0)
+         close(listener);
+      return 1;
+   }
+
+   // a client that hangs up shows up as a failed send rather than ending the
+   // server, and an interrupt stops it cleanly
+   signal(SIGPIPE, SIG_IGN);
+   signal(SIGINT, ServeSignalHandler);
+   signal(SIGTERM, ServeSignalHandler);
+   cout << "Serving on " << options.socketPath << endl;
+
+   ServeQueue queue;
+   thread acceptor(ServeListener, &queue, listener);
+   unsigned int cores = max(thread::hardware_concurrency(), 2u);
+   DecodePool decoder;
+   decoder.maxCompleted = max(static_cast<size_t>(options.maxBatch), static_cast<size_t>(cores));
+   InitializeDecodePool(&decoder, cores - 1);
+
+   MyRenderTarget target;
+   PixelTransfer transfer;
+   while (!serveInterrupted_)
+   {
+      vector<ServeJob *> batch;
+      {
+         unique_lock<mutex> guard(queue.lock);
+         if (queue.jobs.empty())
+            queue.submitted.wait_for(guard, chrono::milliseconds(200));
+         while (!queue.jobs.empty() && batch.size() < static_cast<size_t>(options.maxBatch))
+         {
+            batch.push_back(queue.jobs.front());
+            queue.jobs.pop_front();
+         }
+         queue.jobCount += batch.size();
+         queue.batchCount += batch.empty() ? 0 : 1;
+      }
+
+      // every image of the batch that is not resident decodes at once
+      for (size_t i = 0; i < batch.size(); i++)
+         if (!batch[i]->filename.empty() && !textures->entries.count(batch[i]->cacheKey))
+            RequestDecode(&decoder, batch[i]->filename, false);
+
+      deque<ServeJob *> inFlight;
+      for (size_t i = 0; i < batch.size(); i++)
+      {
+         string error = RenderServeJob(batch[i], pipeline, textures, &decoder, &target, &transfer);
+         if (!error.empty())
+            FinishServeJob(&queue, batch[i], error);
+         else
+            inFlight.push_back(batch[i]);
+         if (inFlight.size() > READBACK_LAG)
+            CollectServeJob(&queue, &transfer, &inFlight);
+         CollectGpuTimers();
+      }
+      while (!inFlight.empty())
+         CollectServeJob(&queue, &transfer, &inFlight);
+      ReportProfile();
+   }
+
+   // refuse new jobs, fail the waiting ones and wait for every connection to
+   // close
+   cout << "Stopping server" << endl;
+   {
+      lock_guard<mutex> guard(queue.lock);
+      queue.stopping = true;
+   }
+   acceptor.join();
+   close(listener);
+   unlink(options.socketPath.c_str());
+   {
+      unique_lock<mutex> guard(queue.lock);
+      for (size_t i = 0; i < queue.jobs.size(); i++)
+      {
+         queue.jobs[i]->error = "server stopping";
+         queue.jobs[i]->finished = true;
+      }
+      queue.jobs.clear();
+      queue.finished.notify_all();
+      for (set<int>::iterator it = queue.connections.begin(); it != queue.connections.end(); ++it)
+         shutdown(*it, SHUT_RDWR);
+      while (!queue.connections.empty())
+         queue.finished.wait(guard);
+   }
+
+   DestroyDecodePool(&decoder);
+   PrintPixelTransferStats(&transfer);
+   DestroyPixelTransfer(&transfer);
+   DestroyRenderTarget(&target);
+   cout << "Served " << queue.jobCount << " jobs in " << queue.batchCount << " batches" << endl;
+   PrintTextureCacheStats(textures);
+   DestroyTextureCache(textures);
+   PrintPixelCacheStats();
+   return 0;
+}
+#else
+int RunServer(const ServeOptions &options, TextureCache *textures, EffectPipeline *pipeline)
+{
+   cout << "--serve needs Unix domain sockets and POSIX shared memory, which this platform lacks" << endl;
+   return 1;
+}
+#endif
+
+// --------------------------------------------------------------------------
+// Benchmark: every effect mode on the bundled and synthetic images, on the
+// GPU and each supported CPU kernel set, written as JSON and optionally
+// compared against a baseline from an earlier run
+
+struct BenchmarkOptions
+{
+   bool enabled;
+   string outputPath;
+   string baselinePath;
+
+   // fail when throughput drops more than this many percent below baseline
+   double threshold;
+
+   // synthetic images double in size from 256x256 up to this
+   int maxSize;
+
+   // timed frames per case, after one untimed warm-up frame
+   int frames;
+
+   BenchmarkOptions() : enabled(false), threshold(10.0), maxSize(16384), frames(5)
+   {}
+};
+
+struct BenchmarkResult
+{
+   string image;
+   int width;
+   int height;
+   string implementation;
+   EffectStage effect;
+
+   double megapixelsPerSecond;
+   double latency50;
+   double latency90;
+   double latency99;
+   double latencyMax;
+   double peakResidentMB;
+};
+
+// a deterministic RGB test image: gradients with a checkerboard and hashed
+// noise, so that every effect has edges and texture to work on
+bool MakeSyntheticImage(DecodedImage *image, int size)
+{
+   ostringstream name;
+   name << "synthetic-" << size;
+   image->filename = name.str();
+   image->width = size;
+   image->height = size;
+   image->numComponents = 3;
+   image->pixels = static_cast<unsigned char *>(PixelPoolMalloc(static_cast<size_t>(size) * size * 3));
+   if (!image->pixels) return false;
+
+   for (int y = 0; y < size; y++)
+   {
+      unsigned char *row = image->pixels + static_cast<size_t>(y) * size * 3;
+      for (int x = 0; x < size; x++)
+      {
+         unsigned int hash = (x * 73856093u) ^ (y * 19349663u);
+         hash = (hash ^ (hash >> 13)) * 1274126177u;
+         int checker = ((x >> 5) ^ (y >> 5)) & 1 ? 48 : 0;
+         row[3 * x + 0] = static_cast<unsigned char>((x * 255 / size + checker) & 255);
+         row[3 * x + 1] = static_cast<unsigned char>((y * 255 / size + checker) & 255);
+         row[3 * x + 2] = static_cast<unsigned char>((hash >> 24) & 255);
+      }
+   }
+   return true;
+}
+
+// fills in throughput and latency percentiles from per-frame milliseconds
+void SummarizeFrames(BenchmarkResult *result, vector<double> milliseconds)
+{
+   sort(milliseconds.begin(), milliseconds.end());
+   double total = 0.0;
+   for (size_t i = 0; i < milliseconds.size(); i++)
+      total += milliseconds[i];
+
+   size_t last = milliseconds.size() - 1;
+   result->latency50 = milliseconds[last * 50 / 100];
+   result->latency90 = milliseconds[last * 90 / 100];
+   result->latency99 = milliseconds[last * 99 / 100];
+   result->latencyMax = milliseconds[last];
+   result->megapixelsPerSecond = static_cast<double>(result->width) * result->height
+      / (total / milliseconds.size() * 1000.0);
+   result->peakResidentMB = PeakResidentMB();
+}
+
+// every effect mode the shaders offer, including no effect, and a
+// convolution run directly, as two separable passes and through FFTs
+vector<EffectStage> BenchmarkEffects()
+{
+   vector<EffectStage> effects;
+   effects.push_back(EffectStage("colour", NO_EFFECT));
+   for (int mode = EFFECT1; mode <= EFFECT4; mode++)
+      effects.push_back(EffectStage("colour", mode));
+   for (int mode = EFFECT1; mode <= EFFECT3; mode++)
+      effects.push_back(EffectStage("filter", mode));
+   for (int mode = EFFECT1; mode <= EFFECT3; mode++)
+      effects.push_back(EffectStage("blur", mode));
+   const char *kernels[] = { "emboss", "box:31", "log:5" };
+   for (int i = 0; i < 3; i++)
+   {
+      effects.push_back(EffectStage());
+      LoadConvolutionKernel(&effects.back(), kernels[i], false);
+   }
+   return effects;
+}
+
+// the identity of a result, used to match it against the baseline
+string BenchmarkKey(const string &image, const string &implementation, const string &effect, int mode)
 {
-   GLfloat height = 1.0;
-   GLfloat width = 1.0;
+   ostringstream key;
+   key << image << "|" << implementation << "|" << effect << "|" << mode;
+   return key.str();
+}
 
-   if (texture.width > texture.height)
+// writes one result per line so that baselines can be read back without a
+// JSON library
+bool WriteBenchmarkJson(const string &path, const vector<BenchmarkResult> &results)
+{
+   ofstream output(path.c_str());
+   if (!output)
    {
-      GLfloat ratio = static_cast<GLfloat>(texture.height) / static_cast<GLfloat>(texture.width);
-      height *= ratio;
+      cout << "Unable to write benchmark results: " << path << endl;
+      return false;
    }
-   else
+
+   output << "{\"results\":[\n" << fixed << setprecision(3);
+   for (size_t i = 0; i < results.size(); i++)
    {
-      GLfloat ratio = static_cast<GLfloat>(texture.width) / static_cast<GLfloat>(texture.height);
-      width *= ratio;
+      const BenchmarkResult &r = results[i];
+      output << "{\"image\":" << JsonString(r.image) << ",\"width\":" << r.width << ",\"height\":" << r.height
+         << ",\"implementation\":" << JsonString(r.implementation) << ",\"effect\":" << JsonString(EffectLabel(r.effect))
+         << ",\"mode\":" << r.effect.mode << ",\"mpxPerSecond\":" << r.megapixelsPerSecond
+         << ",\"latencyMs\":{\"p50\":" << r.latency50 << ",\"p90\":" << r.latency90 << ",\"p99\":" << r.latency99
+         << ",\"max\":" << r.latencyMax << "},\"peakResidentMB\":" << r.peakResidentMB << "}"
+         << (i + 1 < results.size() ? ",\n" : "\n");
    }
+   output << "]}\n";
+   return true;
+}
 
-   // Initialize two triangles with the aspect ratio
-   vertices[0] = (-1.0f * width);
-   vertices[1] = (-1.0f * height);
-   vertices[2] = (-1.0f * width);
-   vertices[3] = (1.0f * height);
-   vertices[4] = (1.0f * width);
-   vertices[5] = (1.0f * height);
-   vertices[6] = (1.0f * width);
-   vertices[7] = (1.0f * height);
-   vertices[8] = (1.0f * width);
-   vertices[9] = (-1.0f * height);
-   vertices[10] = (-1.0f * width);
-   vertices[11] = (-1.0f * height);
+// returns the raw text of a field in a one-line JSON object, unquoted
+string JsonField(const string &line, const string &key)
+{
+   string marker = "\"" + key + "\":";
+   size_t start = line.find(marker);
+   if (start == string::npos) return "";
+   start += marker.size();
+
+   if (line[start] == '"')
+   {
+      size_t end = line.find('"', start + 1);
+      return end == string::npos ? "" : line.substr(start + 1, end - start - 1);
+   }
+   size_t end = line.find_first_of(",}", start);
+   return line.substr(start, end - start);
 }
 
-// create buffers and fill with geometry data, returning true if successful
-bool InitializeGeometry(MyGeometry *geometry, MyTexture* texture)
+// reads throughput by result key from a file written by WriteBenchmarkJson
+bool ReadBenchmarkBaseline(const string &path, map<string, double> *baseline)
 {
-   // three vertex positions and associated textures of a triangle
-   const GLfloat colours[][3] = {
-      { 1.0f, 0.0f, 0.0f },
-      { 0.0f, 1.0f, 0.0f },
-      { 0.0f, 0.0f, 1.0f }
-   };
+   ifstream input(path.c_str());
+   if (!input)
+   {
+      cout << "Unable to read benchmark baseline: " << path << endl;
+      return false;
+   }
 
-   // Map texture coordinates to the geometry coordinates
-   vector<GLfloat> textures;
-   textures.push_back(0.0f);
-   textures.push_back(0.0f);
-   textures.push_back(0.0f);
-   textures.push_back(static_cast<GLfloat>(texture->height));
-   textures.push_back(static_cast<GLfloat>(texture->width));
-   textures.push_back(static_cast<GLfloat>(texture->height));
-   textures.push_back(static_cast<GLfloat>(texture->width));
-   textures.push_back(static_cast<GLfloat>(texture->height));
-   textures.push_back(static_cast<GLfloat>(texture->width));
-   textures.push_back(0.0f);
-   textures.push_back(0.0f);
-   textures.push_back(0.0f);
+   string line;
+   while (getline(input, line))
+   {
+      string image = JsonField(line, "image");
+      if (image.empty()) continue;
+      string key = BenchmarkKey(image, JsonField(line, "implementation"), JsonField(line, "effect"),
+                                atoi(JsonField(line, "mode").c_str()));
+      (*baseline)[key] = atof(JsonField(line, "mpxPerSecond").c_str());
+   }
+   return true;
+}
 
-   geometry->elementCount = vertices.size() / 2;
+void PrintBenchmarkResult(const BenchmarkResult &r)
+{
+   cout << left << setw(28) << r.image << setw(12) << r.implementation << setw(8) << EffectLabel(r.effect)
+      << right << r.effect.mode << fixed << setprecision(1) << setw(10) << r.megapixelsPerSecond << " Mpx/s"
+      << setprecision(2) << "  p50 " << r.latency50 << " ms  p99 " << r.latency99 << " ms" << endl;
+   cout.unsetf(ios::fixed);
+   cout << setprecision(6);
+}
 
-   // these vertex attribute indices correspond to those specified for the
-   // input variables in the vertex shader
-   const GLuint VERTEX_INDEX = 0;
-   const GLuint COLOUR_INDEX = 1;
-   const GLuint TEXTURE_INDEX = 2;
+// times every effect on one image with each implementation
+void BenchmarkImage(const BenchmarkOptions &options, const DecodedImage &image, EffectPipeline *pipeline,
+                    const vector<const CpuKernels *> &cpuKernels, CpuTiling *tiling,
+                    vector<BenchmarkResult> *results)
+{
+   vector<EffectStage> effects = BenchmarkEffects();
+   string name = image.filename.substr(image.filename.find_last_of("/\\") + 1);
 
-   // create an array buffer object for storing our vertices
-   glGenBuffers(1, &geometry->vertexBuffer);
-   glBindBuffer(GL_ARRAY_BUFFER, geometry->vertexBuffer);
-   glBufferData(GL_ARRAY_BUFFER, vertices.size()*sizeof(GLfloat), vertices.data(), GL_STATIC_DRAW);
+   BenchmarkResult result;
+   result.image = name;
+   result.width = image.width;
+   result.height = image.height;
 
-   // create an array buffer object for storing our textures
-   glGenBuffers(1, &geometry->textureBuffer);
-   glBindBuffer(GL_ARRAY_BUFFER, geometry->textureBuffer);
-   glBufferData(GL_ARRAY_BUFFER, textures.size()*sizeof(GLfloat), textures.data(), GL_STATIC_DRAW);
+   if (pipeline)
+   {
+      GLint maxSize = 0;
+      glGetIntegerv(GL_MAX_RECTANGLE_TEXTURE_SIZE, &maxSize);
+      MyTexture texture;
+      MyRenderTarget target;
+      if (max(image.width, image.height) > maxSize || !UploadTexture(&texture, &image, GL_TEXTURE_RECTANGLE) ||
+          !InitializeRenderTarget(&target, image.width, image.height))
+         cout << "Skipping GPU for " << name << ": too large for this GPU" << endl;
+      else
+      {
+         MyGeometry geometry;
+         InitializeGeometry(&geometry, &texture);
+         GLfloat fillMatrix[16];
+         BuildFillMatrix(texture, false, fillMatrix);
 
-   // create another one for storing our colours
-   glGenBuffers(1, &geometry->colourBuffer);
-   glBindBuffer(GL_ARRAY_BUFFER, geometry->colourBuffer);
-   glBufferData(GL_ARRAY_BUFFER, sizeof(colours), colours, GL_STATIC_DRAW);
+         // the fragment passes, then the compute passes where the context
+         // has them, whether or not --compute was given
+         bool useCompute = pipeline->useCompute;
+         for (int compute = 0; compute <= (ComputeShadersAvailable() ? 1 : 0); compute++)
+         {
+            pipeline->useCompute = compute != 0;
+            result.implementation = compute ? "gpu-compute" : "gpu";
+            for (size_t e = 0; e < effects.size(); e++)
+            {
+               vector<EffectStage> chain(1, effects[e]);
+               if (!PrepareEffectChain(pipeline, chain))
+                  continue;
 
-   // create a vertex array object encapsulating all our vertex attributes
-   glGenVertexArrays(1, &geometry->vertexArray);
-   glBindVertexArray(geometry->vertexArray);
+               // glFinish makes each frame's latency include the GPU work
+               vector<double> milliseconds;
+               for (int frame = -1; frame < options.frames; frame++)
+               {
+                  chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+                  glBindFramebuffer(GL_FRAMEBUFFER, target.framebuffer);
+                  glViewport(0, 0, target.width, target.height);
+                  RenderEffectChain(pipeline, &geometry, &texture, chain, fillMatrix);
+                  glFinish();
+                  if (frame >= 0)
+                     milliseconds.push_back(chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count());
+               }
+               glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
-   // associate the position array with the vertex array object
-   glBindBuffer(GL_ARRAY_BUFFER, geometry->vertexBuffer);
-   glVertexAttribPointer(VERTEX_INDEX, 2, GL_FLOAT, GL_FALSE, 0, 0);
-   glEnableVertexAttribArray(VERTEX_INDEX);
+               result.effect = effects[e];
+               SummarizeFrames(&result, milliseconds);
+               PrintBenchmarkResult(result);
+               results->push_back(result);
+            }
+         }
+         pipeline->useCompute = useCompute;
 
-   // associate the texture array with the vertex array object
-   glBindBuffer(GL_ARRAY_BUFFER, geometry->textureBuffer);
-   glVertexAttribPointer(TEXTURE_INDEX, 2, GL_FLOAT, GL_FALSE, 0, 0);
-   glEnableVertexAttribArray(TEXTURE_INDEX);
+         DestroyGeometry(&geometry);
+      }
+      DestroyRenderTarget(&target);
+      if (texture.textureID)
+         DestroyTexture(&texture);
+      DestroyRenderTargetPool(&pipeline->targets);
+   }
 
-   // associate the colour array with the vertex array object
-   glBindBuffer(GL_ARRAY_BUFFER, geometry->colourBuffer);
-   glVertexAttribPointer(COLOUR_INDEX, 3, GL_FLOAT, GL_FALSE, 0, 0);
-   glEnableVertexAttribArray(COLOUR_INDEX);
+   vector<unsigned char> output;
+   try
+   {
+      output.resize(static_cast<size_t>(image.width) * image.height * 3);
+   }
+   catch (const bad_alloc &)
+   {
+      cout << "Skipping CPU for " << name << ": out of memory" << endl;
+      return;
+   }
 
-   // unbind our buffers, resetting to default state
-   glBindBuffer(GL_ARRAY_BUFFER, 0);
-   glBindVertexArray(0);
+   ImageView input = InterleavedView(image.pixels, image.width, image.height, image.numComponents);
+   ImageView outputView = InterleavedView(output.data(), image.width, image.height, 3);
+   for (size_t k = 0; k < cpuKernels.size(); k++)
+   {
+      result.implementation = string("cpu-") + cpuKernels[k]->name;
+      for (size_t e = 0; e < effects.size(); e++)
+      {
+         vector<EffectStage> chain(1, effects[e]);
+         vector<double> milliseconds;
+         for (int frame = -1; frame < options.frames; frame++)
+         {
+            chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+            ApplyCpuEffectChain(cpuKernels[k], input, outputView, chain, tiling);
+            if (frame >= 0)
+               milliseconds.push_back(chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count());
+         }
 
-   // check for OpenGL errors and return false if error occurred
-   return !CheckGLErrors();
+         result.effect = effects[e];
+         SummarizeFrames(&result, milliseconds);
+         PrintBenchmarkResult(result);
+         results->push_back(result);
+      }
+   }
 }
 
-// deallocate geometry-related objects
-void DestroyGeometry(MyGeometry *geometry)
+// runs the benchmark, returning nonzero if it could not run or throughput
+// regressed past the threshold; pipeline is null to benchmark the CPU only
+int RunBenchmark(const BenchmarkOptions &options, EffectPipeline *pipeline)
 {
-   // unbind and destroy our vertex array object and associated buffers
-   glBindVertexArray(0);
-   glDeleteVertexArrays(1, &geometry->vertexArray);
-   glDeleteBuffers(1, &geometry->vertexBuffer);
-   glDeleteBuffers(1, &geometry->colourBuffer);
-   glDeleteBuffers(1, &geometry->textureBuffer);
-}
+   map<string, double> baseline;
+   if (!options.baselinePath.empty() && !ReadBenchmarkBaseline(options.baselinePath, &baseline))
+      return 1;
 
-// --------------------------------------------------------------------------
-// Rendering function that draws our scene to the frame buffer
+   vector<const CpuKernels *> cpuKernels;
+   const char *kernelNames[] = { "scalar", "sse4", "avx2" };
+   for (int i = 0; i < 3; i++)
+      if (SelectCpuKernels(kernelNames[i]))
+         cpuKernels.push_back(SelectCpuKernels(kernelNames[i]));
 
-void RenderScene(MyGeometry *geometry, MyTexture* texture, MyShader *shader)
-{
-   // clear screen to a dark grey colour
-   glClearColor(0.2f, 0.2f, 0.2f, 1.0f);
-   glClear(GL_COLOR_BUFFER_BIT);
+   TaskPool tilePool;
+   InitializeTaskPool(&tilePool, max(thread::hardware_concurrency(), 1u));
+   CpuTiling tiling;
+   tiling.pool = &tilePool;
 
-   // bind our shader program and the vertex array object containing our
-   // scene geometry, then tell OpenGL to draw our geometry
-   glUseProgram(shader->program);
-   glBindVertexArray(geometry->vertexArray);
-   glBindTexture(texture->target, texture->textureID);
-   glDrawArrays(GL_TRIANGLES, 0, geometry->elementCount);
+   stbi_set_flip_vertically_on_load(true);
+   vector<BenchmarkResult> results;
+   for (int i = 0; i < imageCount_; i++)
+   {
+      DecodedImage image;
+      DecodeImage(&image, imageFileNames_[i]);
+      if (image.pixels)
+         BenchmarkImage(options, image, pipeline, cpuKernels, &tiling, &results);
+      else
+         cout << "Unable to load image: " << imageFileNames_[i] << endl;
+      DestroyDecodedImage(&image);
+   }
+   for (int size = 256; size <= options.maxSize; size *= 2)
+   {
+      DecodedImage image;
+      if (MakeSyntheticImage(&image, size))
+         BenchmarkImage(options, image, pipeline, cpuKernels, &tiling, &results);
+      else
+         cout << "Skipping synthetic " << size << "x" << size << " image: out of memory" << endl;
+      DestroyDecodedImage(&image);
+   }
+   DestroyTaskPool(&tilePool);
 
-   // reset state to default (no shader or geometry bound)
-   glBindTexture(texture->target, 0);
-   glBindVertexArray(0);
-   glUseProgram(0);
+   bool written = WriteBenchmarkJson(options.outputPath, results);
+   cout << "Wrote " << results.size() << " benchmark results to " << options.outputPath
+      << ", peak resident memory " << PeakResidentMB() << " MB" << endl;
 
-   // check for an report any OpenGL errors
-   CheckGLErrors();
+   int regressions = 0;
+   for (size_t i = 0; i < results.size() && !baseline.empty(); i++)
+   {
+      const BenchmarkResult &r = results[i];
+      map<string, double>::iterator it = baseline.find(BenchmarkKey(r.image, r.implementation, EffectLabel(r.effect), r.effect.mode));
+      if (it == baseline.end() || r.megapixelsPerSecond >= it->second * (1.0 - options.threshold / 100.0))
+         continue;
+
+      cout << "Regression: " << r.image << " " << r.implementation << " " << EffectLabel(r.effect) << " "
+         << r.effect.mode << " at " << r.megapixelsPerSecond << " Mpx/s, baseline " << it->second << endl;
+      regressions++;
+   }
+   if (!baseline.empty())
+      cout << regressions << " regressions beyond " << options.threshold << "% against " << options.baselinePath << endl;
+   return written && regressions == 0 ? 0 : 1;
 }
 
 // --------------------------------------------------------------------------
@@ -346,90 +8320,72 @@ void ErrorCallback(int error, const char* description)
 // handles keyboard input events
 void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
+   if (action == GLFW_PRESS)
+      redraw_ = true;
+
    if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
    {
       glfwSetWindowShouldClose(window, GL_TRUE);
    }
-   else if (key == GLFW_KEY_1 && action == GLFW_PRESS)
-   {
-      currImageNum_ = 0;
-      currImageFileName_ = "images/image1-mandrill.png";
-   }
-   else if (key == GLFW_KEY_2  && action == GLFW_PRESS)
-   {
-      currImageNum_ = 1;
-      currImageFileName_ = "images/image2-uclogo.png";
-   }
-   else if (key == GLFW_KEY_3  && action == GLFW_PRESS)
+   else if (key == GLFW_KEY_G && action == GLFW_PRESS)
    {
-      currImageNum_ = 2;
-      currImageFileName_ = "images/image3-aerial.jpg";
+      galleryMode_ = !galleryMode_;
+      galleryPage_ = currImageNum_ / GALLERY_PAGE_SIZE;
    }
-   else if (key == GLFW_KEY_4  && action == GLFW_PRESS)
+   else if (key == GLFW_KEY_PAGE_DOWN && action == GLFW_PRESS && galleryMode_)
    {
-      currImageNum_ = 3;
-      currImageFileName_ = "images/image4-thirsk.jpg";
+      galleryPage_ = min(galleryPage_ + 1, GalleryPageCount() - 1);
    }
-   else if (key == GLFW_KEY_5  && action == GLFW_PRESS)
+   else if (key == GLFW_KEY_PAGE_UP && action == GLFW_PRESS && galleryMode_)
    {
-      currImageNum_ = 4;
-      currImageFileName_ = "images/image5-pattern.png";
+      galleryPage_ = max(galleryPage_ - 1, 0);
    }
-   else if (key == GLFW_KEY_6  && action == GLFW_PRESS)
+   else if (key >= GLFW_KEY_1 && key < GLFW_KEY_1 + min(imageCount_, 9) && action == GLFW_PRESS)
    {
-      currImageNum_ = 5;
-      currImageFileName_ = "images/image6-edc2016.jpg";
+      currImageNum_ = key - GLFW_KEY_1;
+      currImageFileName_ = imageFileNames_[currImageNum_];
    }
    else if (key == GLFW_KEY_C && action == GLFW_PRESS)
    {
-      shaderChanged_ = true;
-      currShaderFileName_ = "colourFragment.glsl";
       colourEffects_[currImageNum_] = static_cast<Effect>((colourEffects_[currImageNum_] + 1) % 5);
    }
    else if (key == GLFW_KEY_F && action == GLFW_PRESS)
    {
-      shaderChanged_ = true;
-      currShaderFileName_ = "filterFragment.glsl";
       filters_[currImageNum_] = static_cast<Effect>((filters_[currImageNum_] + 1) % 4);
    }
    else if (key == GLFW_KEY_B && action == GLFW_PRESS)
    {
-      shaderChanged_ = true;
-      currShaderFileName_ = "blurFragment.glsl";
       blurs_[currImageNum_] = static_cast<Effect>((blurs_[currImageNum_] + 1) % 4);
    }
    else if (key == GLFW_KEY_RIGHT && action == GLFW_PRESS)
    {
-      GLfloat angle  = static_cast<GLfloat>(M_PI / -8);
-
-      // Apply rotation matrix to each points x & y
-      for (unsigned int i = 0; i < vertices.size(); i += 2)
-      {
-         float x = vertices[i] * cos(angle) - vertices[i + 1] * sin(angle);
-         float y = vertices[i + 1] * cos(angle) + vertices[i] * sin(angle);
-         vertices[i] = x;
-         vertices[i + 1] = y;
-      }
+      RotateView(&view_, -1);
    }
    else if (key == GLFW_KEY_LEFT && action == GLFW_PRESS)
    {
-      GLfloat angle = static_cast<GLfloat>(M_PI / 8);
-
-      // Apply rotation matrix to each points x & y
-      for (unsigned int i = 0; i < vertices.size(); i += 2)
-      {
-         float x = vertices[i] * cos(angle) - vertices[i + 1] * sin(angle);
-         float y = vertices[i + 1] * cos(angle) + vertices[i] * sin(angle);
-         vertices[i] = x;
-         vertices[i + 1] = y;
-      }
+      RotateView(&view_, 1);
    }
 }
 
 // handles mouse input events
 void MouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
 {
-   if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS)
+   if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS && galleryMode_)
+   {
+      // a click on the contact sheet selects the image under it
+      double xPos, yPos;
+      int width, height;
+      glfwGetCursorPos(window, &xPos, &yPos);
+      glfwGetWindowSize(window, &width, &height);
+      int image = GalleryImageAt(galleryPage_, xPos, yPos, width, height);
+      if (image >= 0)
+      {
+         currImageNum_ = image;
+         currImageFileName_ = imageFileNames_[image];
+         redraw_ = true;
+      }
+   }
+   else if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS)
    {
       isDragging_ = true;
 
@@ -451,11 +8407,10 @@ void CursorPosCallback(GLFWwindow* window, double xPos, double yPos)
    if (isDragging_)
    {
       // Amount mouse has moved, normalized
-      for (unsigned int i = 0; i < vertices.size(); i += 2)
-      {
-         vertices[i] += static_cast<GLfloat>(2 * (xPos - prevCoords_[0]) / 512);
-         vertices[i + 1] -= static_cast<GLfloat>(2 * (yPos - prevCoords_[1]) / 512);
-      }
+      view_.panX += static_cast<GLfloat>(2 * (xPos - prevCoords_[0]) / 512);
+      view_.panY -= static_cast<GLfloat>(2 * (yPos - prevCoords_[1]) / 512);
+      NoteInteraction(&progressive_);
+      redraw_ = true;
    }
 
    prevCoords_[0] = xPos;
@@ -471,14 +8426,30 @@ void ScrollCallback(GLFWwindow* window, double xOffset, double yOffset)
       return;
    }
 
+   // the contact sheet scrolls a page at a time instead
+   if (galleryMode_)
+   {
+      if (yOffset != 0.0)
+         galleryPage_ = min(max(galleryPage_ + (yOffset < 0.0 ? 1 : -1), 0), GalleryPageCount() - 1);
+      redraw_ = true;
+      return;
+   }
+
    float zoom = 100.0f;
    zoom += static_cast<GLfloat>(yOffset*2);
 
-   for (unsigned int i = 0; i < vertices.size(); i += 2)
-   {
-      vertices[i] = vertices[i] * zoom / 100.0f;
-      vertices[i + 1] = vertices[i + 1] * zoom / 100.0f;
-   }
+   // Zoom is about the window centre, so the pan offset scales too
+   view_.zoom *= zoom / 100.0f;
+   view_.panX *= zoom / 100.0f;
+   view_.panY *= zoom / 100.0f;
+   NoteInteraction(&progressive_);
+   redraw_ = true;
+}
+
+// handles the window needing to be repainted, e.g. after being uncovered
+void RefreshCallback(GLFWwindow* window)
+{
+   redraw_ = true;
 }
 
 // ==========================================================================
@@ -486,20 +8457,199 @@ void ScrollCallback(GLFWwindow* window, double xOffset, double yOffset)
 
 int main(int argc, char *argv[])
 {
+   // decoded images stay resident on the GPU up to this budget
+   TextureCache textures;
+   BatchOptions batch;
+   BenchmarkOptions benchmark;
+   StreamOptions stream;
+   ServeOptions serve;
+   bool vsync = false;
+   bool useCompute = false;
+   vector<string> images;
+   int tileAbove = 4096;
+   for (int i = 1; i < argc; i++)
+   {
+      string arg = argv[i];
+      if (arg == "--texture-budget" && i + 1 < argc)
+         textures.budgetBytes = static_cast<size_t>(atoi(argv[++i])) << 20;
+      else if (arg == "--batch" && i + 2 < argc)
+      {
+         batch.enabled = true;
+         batch.inputDirectory = argv[++i];
+         batch.outputDirectory = argv[++i];
+      }
+      else if (int used = ParseEffectOption(arg, i + 1 < argc ? argv[i + 1] : 0, &batch.chain))
+      {
+         if (used < 0)
+            return -1;
+         i += used - 1;
+      }
+      else if (arg == "--cpu")
+         batch.useCpu = true;
+      else if (arg == "--cpu-kernels" && i + 1 < argc)
+      {
+         batch.useCpu = true;
+         batch.cpuKernels = argv[++i];
+      }
+      else if (arg == "--threads" && i + 1 < argc)
+         batch.cpuThreads = atoi(argv[++i]);
+      else if (arg == "--tile" && i + 1 < argc)
+      {
+         if (sscanf(argv[++i], "%dx%d", &batch.tileWidth, &batch.tileHeight) != 2)
+            batch.tileHeight = batch.tileWidth;
+      }
+      else if (arg == "--tile-report")
+         batch.tileReport = true;
+      else if (arg == "--strip-rows" && i + 1 < argc)
+         batch.stripRows = max(atoi(argv[++i]), 1);
+      else if (arg == "--vsync")
+         vsync = true;
+      else if (arg == "--image" && i + 1 < argc && images.size() < 9)
+         images.push_back(argv[++i]);
+      else if (arg == "--gallery" && i + 1 < argc)
+      {
+         images = ListImageFiles(argv[++i]);
+         galleryMode_ = true;
+      }
+      else if (arg == "--tile-above" && i + 1 < argc)
+         tileAbove = atoi(argv[++i]);
+      else if (arg == "--pixel-cache" && i + 1 < argc)
+         pixelCache_.directory = argv[++i];
+      else if (arg == "--pixel-cache-beside")
+         pixelCache_.directory.clear();
+      else if (arg == "--pixel-cache-budget" && i + 1 < argc)
+         pixelCache_.budgetBytes = static_cast<long long>(atoi(argv[++i])) << 20;
+      else if (arg == "--no-pixel-cache")
+         pixelCache_.enabled = false;
+      else if (arg == "--no-colour-lut")
+         colourLuts_.enabled = false;
+      else if (arg == "--compute")
+         useCompute = true;
+      else if (arg == "--target-fps" && i + 1 < argc)
+         progressive_.frameBudget = 1.0 / max(atof(argv[++i]), 1.0);
+      else if (arg == "--no-progressive")
+         progressive_.enabled = false;
+      else if (arg == "--benchmark" && i + 1 < argc)
+      {
+         benchmark.enabled = true;
+         benchmark.outputPath = argv[++i];
+      }
+      else if (arg == "--baseline" && i + 1 < argc)
+         benchmark.baselinePath = argv[++i];
+      else if (arg == "--threshold" && i + 1 < argc)
+         benchmark.threshold = atof(argv[++i]);
+      else if (arg == "--bench-max-size" && i + 1 < argc)
+         benchmark.maxSize = atoi(argv[++i]);
+      else if (arg == "--bench-frames" && i + 1 < argc)
+         benchmark.frames = max(atoi(argv[++i]), 1);
+      else if (arg == "--stream")
+         stream.enabled = true;
+      else if (arg == "--stream-queue" && i + 1 < argc)
+         stream.queueDepth = max(atoi(argv[++i]), 1);
+      else if (arg == "--stream-drop" && i + 1 < argc)
+      {
+         string policy = argv[++i];
+         stream.dropPolicy = policy == "newest" ? STREAM_DROP_NEWEST : policy == "oldest" ? STREAM_DROP_OLDEST : STREAM_BLOCK;
+      }
+      else if (arg == "--stream-latency")
+         stream.latencyReport = true;
+      else if (arg == "--serve" && i + 1 < argc)
+      {
+         serve.enabled = true;
+         serve.socketPath = argv[++i];
+      }
+      else if (arg == "--serve-batch" && i + 1 < argc)
+         serve.maxBatch = max(atoi(argv[++i]), 1);
+      else if (arg == "--profile")
+         profiler_.enabled = true;
+      else if (arg == "--trace" && i + 1 < argc)
+      {
+         profiler_.enabled = true;
+         profiler_.tracePath = argv[++i];
+      }
+      else
+      {
+         cout << "Usage: " << argv[0] << " [--texture-budget MB] [--vsync] [--profile] [--trace FILE]" << endl;
+         cout << "             [--image FILE]... [--gallery DIR] [--tile-above PIXELS] [--compute]" << endl;
+         cout << "             [--target-fps N | --no-progressive]" << endl;
+         cout << "             [--pixel-cache DIR | --pixel-cache-beside | --no-pixel-cache] [--pixel-cache-budget MB]" << endl;
+         cout << "             [--no-colour-lut]" << endl;
+         cout << "       " << argv[0] << " --batch INPUT_DIR OUTPUT_DIR [--colour N | --filter N | --blur N | --blur-sigma S]" << endl;
+         cout << "             [--convolve KERNEL | --convolve-luma KERNEL]" << endl;
+         cout << "             [--cpu] [--cpu-kernels scalar|sse4|avx2] [--threads N] [--tile WxH] [--tile-report]" << endl;
+         cout << "             [--strip-rows N]" << endl;
+         cout << "       " << argv[0] << " --benchmark OUTPUT.json [--baseline FILE] [--threshold PERCENT]" << endl;
+         cout << "             [--bench-max-size N] [--bench-frames N] [--cpu]" << endl;
+         cout << "       " << argv[0] << " --stream [--stream-queue N] [--stream-drop block|oldest|newest] [--stream-latency]" << endl;
+         cout << "             [effect and --cpu options as for --batch] < INPUT > OUTPUT" << endl;
+         cout << "       " << argv[0] << " --serve SOCKET [--serve-batch N] [--texture-budget MB] [--compute]" << endl;
+         return -1;
+      }
+   }
+
+   // stdout carries the frames when streaming, so messages go to stderr
+   if (stream.enabled)
+      cout.rdbuf(cerr.rdbuf());
+
+   if (pixelCache_.enabled && !pixelCache_.directory.empty())
+      MakeDirectory(pixelCache_.directory);
+
+   // up to nine images given with --image, or a directory's images given
+   // with --gallery, replace the six bundled ones
+   if (!images.empty())
+   {
+      imageFileNames_ = images;
+      imageCount_ = static_cast<int>(images.size());
+      currImageFileName_ = imageFileNames_[0];
+   }
+
+   // the CPU engine needs no OpenGL context at all
+   if (batch.enabled && batch.useCpu)
+   {
+      int failures = RunBatch(batch, 0);
+      FinishProfile();
+      return failures ? -1 : 0;
+   }
+   if (benchmark.enabled && batch.useCpu)
+   {
+      int failed = RunBenchmark(benchmark, 0);
+      FinishProfile();
+      return failed ? -1 : 0;
+   }
+   if (stream.enabled && batch.useCpu)
+   {
+      int failures = RunStream(stream, batch, 0);
+      FinishProfile();
+      return failures ? -1 : 0;
+   }
+   bool headless = batch.enabled || benchmark.enabled || stream.enabled || serve.enabled;
+
    // initialize the GLFW windowing system
    if (!glfwInit()) {
       cout << "ERROR: GLFW failed to initialize, TERMINATING" << endl;
       return -1;
    }
-   glfwSetErrorCallback(ErrorCallback);
 
-   // attempt to create a window with an OpenGL 4.1 core profile context
+   // attempt to create a window with an OpenGL 4.3 core profile context,
+   // which has compute shaders, then with the 4.1 the rest of the program
+   // needs where 4.3 is not available (e.g. macOS); only the last attempt's
+   // failure is reported
    GLFWwindow *window = 0;
    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-   glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-   window = glfwCreateWindow(512, 512, "CPSC 453 OpenGL Assignment 2", 0, 0);
+
+   // batch, benchmark, stream and server modes only need the context, so
+   // their window is never shown
+   if (headless)
+      glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+   for (int minor = 3; minor >= 1 && !window; minor -= 2)
+   {
+      glfwSetErrorCallback(minor == 1 ? ErrorCallback : 0);
+      glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, minor);
+      window = glfwCreateWindow(512, 512, "CPSC 453 OpenGL Assignment 2", 0, 0);
+   }
+   glfwSetErrorCallback(ErrorCallback);
    if (!window) {
       cout << "Program failed to create GLFW window, TERMINATING" << endl;
       glfwTerminate();
@@ -511,8 +8661,14 @@ int main(int argc, char *argv[])
    glfwSetMouseButtonCallback(window, MouseButtonCallback);
    glfwSetCursorPosCallback(window, CursorPosCallback);
    glfwSetScrollCallback(window, ScrollCallback);
+   glfwSetWindowRefreshCallback(window, RefreshCallback);
    glfwMakeContextCurrent(window);
 
+   // with vsync each swap waits for the display, which paces redraws while
+   // dragging to the refresh rate however fast mouse events arrive
+   if (vsync)
+      glfwSwapInterval(1);
+
    //Initialize GLAD
    if (!gladLoadGL())
    {
@@ -523,76 +8679,284 @@ int main(int argc, char *argv[])
    // query and print out information about our OpenGL environment
    QueryGLVersion();
 
-   // call function to load and compile shader programs
-   MyShader shader;
-   MyTexture texture;
+   // call function to load and compile shader programs; the interactive
+   // viewer builds a program for every combination of effects up front
+   ShaderRegistry shaders;
+   InitializeShaderRegistry(&shaders, "shadercache");
+   EffectPipeline pipeline;
+   pipeline.useCompute = useCompute && ComputeShadersAvailable();
+   if (!InitializeEffectPipeline(&pipeline, &shaders) || (!headless && !PrepareKeyEffectChains(&pipeline))
+       || (!headless && progressive_.enabled && !PrepareReducedEffectChains(&pipeline)))
+   {
+      cout << "Program could not initialize shaders, TERMINATING" << endl;
+      return -1;
+   }
+   cout << "Shader programs: " << shaders.binaryHits << " loaded from cache, "
+      << shaders.compiles << " compiled" << (pipeline.useCompute ? ", filters and blurs in compute shaders" : "") << endl;
+
+   if (headless)
+   {
+      int failures = serve.enabled ? RunServer(serve, &textures, &pipeline)
+         : benchmark.enabled ? RunBenchmark(benchmark, &pipeline)
+         : stream.enabled ? RunStream(stream, batch, &pipeline) : RunBatch(batch, &pipeline);
+      FinishProfile();
+      DestroyEffectPipeline(&pipeline);
+      DestroyShaderRegistry(&shaders);
+      glfwDestroyWindow(window);
+      glfwTerminate();
+      return failures ? -1 : 0;
+   }
+
+   MyTexture *texture = 0;
    MyGeometry geometry;
 
+   // images larger than this in either direction, or than the largest
+   // texture the GPU takes, are shown as tiles streamed in with the view
+   GLint maxTextureSize = 0;
+   glGetIntegerv(GL_MAX_RECTANGLE_TEXTURE_SIZE, &maxTextureSize);
+   VirtualTexture virtualTexture;
+
+   // the processed part of a zoomed-in whole image
+   RegionCache regionCache;
+
+   // pixel buffers the viewer uploads images through, and the image being
+   // uploaded
+   PixelTransfer transfer;
+   TextureUpload upload;
+
    // Initialize each images state variables
-   for (int i = 0; i < 6; i++)
+   for (int i = 0; i < imageCount_; i++)
    {
       colourEffects_.push_back(NO_EFFECT);
       filters_.push_back(NO_EFFECT);
       blurs_.push_back(NO_EFFECT);
-      vertices.push_back(0.0); //x
-      vertices.push_back(0.0); //y
    }
 
-   // Variable to check if image has changed
-   int prevImage = -1;
+   // images are decoded on worker threads; the render thread only uploads,
+   // and each finished decode wakes it with an empty event
+   DecodePool decoder;
+   decoder.onCompleted = glfwPostEmptyEvent;
+   decoder.pyramidAbove = tileAbove > 0 ? min(tileAbove, static_cast<int>(maxTextureSize)) : maxTextureSize;
+   InitializeDecodePool(&decoder, min(max(thread::hardware_concurrency(), 2u) - 1, 4u));
 
-   // run an event-triggered main loop
+   // the contact sheet, set up the first time it is shown; its thumbnails
+   // wake the loop like decodes do
+   ContactSheet sheet;
+   sheet.thumbnails.onCompleted = glfwPostEmptyEvent;
+
+   // Image currently on screen, and the image still waiting for its decode
+   int shownImage = -1;
+   int pendingImage = -1;
+   int exitCode = 0;
+
+   // run an event-driven main loop that redraws only when something changed
    while (!glfwWindowShouldClose(window))
    {
-      // reset
-      DestroyGeometry(&geometry);
+      // start loading a newly selected image, keeping the previous one on
+      // screen until it is ready
+      MyTexture *image = 0;
+      if (currImageNum_ != shownImage && currImageNum_ != pendingImage)
+      {
+         image = FindTexture(&textures, currImageFileName_);
+         pendingImage = image ? -1 : currImageNum_;
+         if (!image)
+            RequestDecode(&decoder, currImageFileName_, true);
+      }
+      // back on the image still shown: a decode still pending for another
+      // selection goes to the cache without replacing it
+      else if (currImageNum_ == shownImage)
+         pendingImage = -1;
+      // the pool drops results nobody takes in time, as can happen while
+      // another image is uploading; asking again decodes the pending image
+      // anew only if it is not queued, in flight, completed or uploading
+      else if (!upload.image.pixels || upload.filename != currImageFileName_)
+         RequestDecode(&decoder, currImageFileName_, true);
 
-      if (shaderChanged_)
+      DecodedImage decoded;
+      bool loaded = false;
+      if (pendingImage >= 0 && !upload.image.pixels && TakeDecodedImage(&decoder, imageFileNames_[pendingImage], &decoded))
       {
-         shaderChanged_ = false;
-         if (!InitializeShaders(&shader, currShaderFileName_)) {
-            cout << "Program could not initialize shaders, TERMINATING" << endl;
-            return -1;
+         // only one tiled image is kept at a time, outside the texture cache
+         if (!decoded.mips.empty())
+         {
+            DestroyVirtualTexture(&virtualTexture);
+            if (InitializeVirtualTexture(&virtualTexture, &decoded, textures.budgetBytes))
+               image = &virtualTexture.extent;
+            loaded = true;
+         }
+         else
+            loaded = !BeginTextureUpload(&upload, &decoded, GL_TEXTURE_RECTANGLE);
+         DestroyDecodedImage(&decoded);
+      }
+
+      // other images fill their texture a strip at a time through pixel
+      // buffers, spreading a large upload over several frames; it still goes
+      // into the cache if the selection has moved on meanwhile
+      if (upload.image.pixels)
+      {
+         if (!ContinueTextureUpload(&transfer, &upload, FRAME_UPLOAD_BYTES))
+            glfwPostEmptyEvent();
+         else if (pendingImage >= 0 && upload.filename == imageFileNames_[pendingImage])
+         {
+            image = upload.texture.textureID ? AddTexture(&textures, upload.filename, upload.texture) : 0;
+            loaded = true;
          }
+         else if (upload.texture.textureID)
+            AddTexture(&textures, upload.filename, upload.texture);
+         if (!upload.image.pixels)
+            upload.texture = MyTexture();
       }
 
-      if (currImageNum_ != prevImage)
+      if (loaded)
       {
-         prevImage = currImageNum_;
-         if (!InitializeTexture(&texture, currImageFileName_.c_str(), GL_TEXTURE_RECTANGLE))
+         pendingImage = -1;
+         if (!image)
+         {
             cout << "Program failed to initialize texture!" << endl;
-         createImageWithAspectRatio(texture);
+            if (shownImage < 0)
+            {
+               exitCode = -1;
+               break;
+            }
+            currImageNum_ = shownImage;
+            currImageFileName_ = imageFileNames_[shownImage];
+         }
+      }
+
+      // geometry only depends on the image's aspect ratio, so it is rebuilt
+      // once per image rather than every frame
+      if (image)
+      {
+         if (image != &virtualTexture.extent)
+            DestroyVirtualTexture(&virtualTexture);
+         texture = image;
+         shownImage = currImageNum_;
+         redraw_ = true;
+
+         ClearRegionCache(&regionCache, &pipeline);
+         DestroyGeometry(&geometry);
+         if (!InitializeGeometry(&geometry, texture))
+            cout << "Program failed to initialize geometry!" << endl;
+         view_ = ViewTransform();
+
+         // speculatively decode the neighbouring images
+         const int neighbours[] = { 1, imageCount_ - 1 };
+         for (int i = 0; i < 2; i++)
+         {
+            string neighbour = imageFileNames_[(shownImage + neighbours[i]) % imageCount_];
+            if (!textures.entries.count(neighbour))
+               RequestDecode(&decoder, neighbour, false);
+         }
       }
 
-      // call function to create and fill buffers with geometry data
-      if (!InitializeGeometry(&geometry, &texture))
-         cout << "Program failed to initialize geometry!" << endl;
+      if (galleryMode_ && !sheet.shader &&
+          !InitializeContactSheet(&sheet, &pipeline, galleryPage_, min(max(thread::hardware_concurrency(), 2u) - 1, 4u)))
+      {
+         cout << "Program failed to initialize the contact sheet!" << endl;
+         DestroyContactSheet(&sheet);
+         galleryMode_ = false;
+      }
+      if (sheet.shader && UploadThumbnails(&sheet) && galleryMode_)
+         redraw_ = true;
+
+      if (redraw_)
+      {
+         redraw_ = false;
+         double frameStart = ProfileBegin();
+
+         // while the view is moving, a whole image is drawn at the reduced
+         // scale; tiled images already stand coarser tiles in for missing ones
+         double interactionStart = glfwGetTime();
+         bool interacting = IsInteracting(&progressive_, interactionStart) && !galleryMode_
+            && texture && texture != &virtualTexture.extent;
+         float scale = interacting ? progressive_.scale : 1.0f;
+         if (galleryMode_)
+            RenderContactSheet(&sheet, galleryPage_, currImageNum_);
+         else if (texture)
+         {
+            GLfloat modelView[16];
+            BuildModelViewMatrix(view_, modelView);
 
-      glUseProgram(shader.program);
-      GLuint colourEffectUniform = glGetUniformLocation(shader.program, "colourEffect");
-      GLuint filterUniform = glGetUniformLocation(shader.program, "filter");
-      GLuint blurUniform = glGetUniformLocation(shader.program, "blur");
-      glUniform1i(colourEffectUniform, colourEffects_.at(currImageNum_));
-      glUniform1i(filterUniform, filters_.at(currImageNum_));
-      glUniform1i(blurUniform, blurs_.at(currImageNum_));
+            // call function to draw our scene with all of the image's effects;
+            // a tiled image keeps redrawing until its visible tiles are in
+            if (texture == &virtualTexture.extent)
+            {
+               if (!RenderVirtualTexture(&virtualTexture, &pipeline, ImageEffectChain(shownImage), view_))
+               {
+                  redraw_ = true;
+                  glfwPostEmptyEvent();
+               }
+            }
+            else if (RenderImageRegion(&regionCache, &pipeline, *texture, ImageEffectChain(shownImage), view_))
+            {
+               // a zoomed-in view only processes what it newly shows, so it
+               // is never reduced
+               interacting = false;
+            }
+            else
+               RenderEffectChain(&pipeline, &geometry, texture, ReducedEffectChain(ImageEffectChain(shownImage), scale),
+                                 modelView, scale);
+         }
+         else
+         {
+            // nothing to show until the first image has been decoded
+            glClearColor(0.2f, 0.2f, 0.2f, 1.0f);
+            glClear(GL_COLOR_BUFFER_BIT);
+         }
 
-      // call function to draw our scene
-      RenderScene(&geometry, &texture, &shader); //render scene with texture
+         double swapStart = ProfileBegin();
+         glfwSwapBuffers(window);
+         ProfileEnd("swap", swapStart);
 
-      glfwSwapBuffers(window);
+         // interactive frames wait for the GPU, so the scale is picked from
+         // what they really cost and input never queues behind a backlog
+         if (interacting)
+         {
+            glFinish();
+            UpdateInteractiveScale(&progressive_, glfwGetTime() - interactionStart);
+         }
+         progressive_.coarse = interacting && scale < 1.0f;
+         ProfileEnd("frame", frameStart);
+      }
+      CollectGpuTimers();
+      ReportProfile();
 
-      glfwPollEvents();
+      // sleep until input arrives or a decode finishes; all events queued by
+      // then are handled together, so a burst of mouse moves costs one frame.
+      // A reduced view is refined once input has been still long enough.
+      double refineWait = RefinementWait(&progressive_, glfwGetTime());
+      if (refineWait < 0.0)
+         glfwWaitEvents();
+      else if (refineWait > 0.0)
+         glfwWaitEventsTimeout(refineWait);
+      else
+      {
+         redraw_ = true;
+         glfwPollEvents();
+      }
    }
 
    // clean up allocated resources before exit
-   DestroyTexture(&texture);
+   DestroyDecodePool(&decoder);
+   DestroyContactSheet(&sheet);
+   FinishProfile();
+   PrintPixelCacheStats();
+   PrintPixelTransferStats(&transfer);
+   CancelTextureUpload(&upload);
+   DestroyPixelTransfer(&transfer);
+   PrintTextureCacheStats(&textures);
+   DestroyTextureCache(&textures);
+   DestroyVirtualTexture(&virtualTexture);
+   PrintRegionCacheStats(&regionCache);
+   DestroyRegionCache(&regionCache, &pipeline);
    DestroyGeometry(&geometry);
-   DestroyShaders(&shader);
+   DestroyEffectPipeline(&pipeline);
+   DestroyShaderRegistry(&shaders);
    glfwDestroyWindow(window);
    glfwTerminate();
 
    cout << "Goodbye!" << endl;
-   return 0;
+   return exitCode;
 }
 
 // ==========================================================================
@@ -692,8 +9056,9 @@ GLuint CompileShader(GLenum shaderType, const string &source)
 // creates and returns a program object linked from vertex and fragment shaders
 GLuint LinkProgram(GLuint vertexShader, GLuint fragmentShader)
 {
-   // allocate program object name
+   // allocate program object name, allowing its binary to be cached
    GLuint programObject = glCreateProgram();
+   glProgramParameteri(programObject, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 
    // attach provided shader objects to this program
    if (vertexShader)   glAttachShader(programObject, vertexShader);
@@ -716,4 +9081,4 @@ GLuint LinkProgram(GLuint vertexShader, GLuint fragmentShader)
    }
 
    return programObject;
-}
\ No newline at end of file
+}
\ No newline at end of file
@@ -4,11 +4,9 @@
 // Author:  Sonny Chan, University of Calgary
 // Date:    December 2015
 // ==========================================================================
-#version 410
-
-// interpolated colour received from vertex stage
-in vec3 Colour;
-in vec2 textureCoords;
+// Per-pixel colour effects. This file is not a complete shader: it is pasted
+// into the pass shaders generated by the effect pipeline, which always pass
+// a constant effect number so the unused branches fold away.
 
 // various colour effects
 const vec3 GREYSCALE1 = vec3(0.333, 0.333, 0.333); 
@@ -16,23 +14,11 @@ const vec3 GREYSCALE2 = vec3(0.299, 0.587, 0.114);
 const vec3 GREYSCALE3 = vec3(0.213, 0.715, 0.072);
 const vec3 SEPIA = vec3(1.2, 1.0, 0.8); 
 
-// first output is mapped to the framebuffer's colour index by default
-out vec4 FragmentColour;
-
-// our texture to read from
-uniform sampler2DRect tex;
-uniform int colourEffect;
-
-void main(void)
+vec4 ColourEffect(vec4 texColour, int colourEffect)
 {
-	vec4 texColour = texture(tex, textureCoords);
-
 	// Don't bother doing the calculations if not colouring
 	if(colourEffect == 0)
-	{
-		FragmentColour = texColour;
-		return;
-	}
+		return texColour;
 
 	float luminance;
 	vec4 newColour;
@@ -58,5 +44,5 @@ void main(void)
 		newColour = vec4(vec3(luminance, luminance, luminance) * SEPIA, 1.0);
 	}
 
-	FragmentColour = newColour;
+	return newColour;
 }
@@ -0,0 +1,28 @@
+// ==========================================================================
+// Vertex program for barebones GLFW boilerplate
+//
+// Author:  Sonny Chan, University of Calgary
+// Date:    December 2015
+// ==========================================================================
+// Convolution with an arbitrary kernel: the whole kernel in one pass, or one
+// axis of a separable kernel. This file is pasted into the pass shaders
+// generated by the effect pipeline, which provide Sample() to read the pass
+// input and define the kernel's non-zero taps as constants. Offsets are
+// whole texels from the texel centre, so each tap reads exactly one texel.
+const float convolveWeights[CONVOLVE_TAPS] = float[](CONVOLVE_WEIGHTS);
+const vec2 convolveOffsets[CONVOLVE_TAPS] = vec2[](CONVOLVE_OFFSETS);
+
+vec4 Convolve(vec2 textureCoords)
+{
+	vec3 sum = vec3(0.0);
+	for (int i = 0; i < CONVOLVE_TAPS; i++)
+	{
+		vec3 texel = Sample(textureCoords + convolveOffsets[i]).rgb;
+#if CONVOLVE_LUMINANCE
+		texel = vec3(dot(texel, vec3(0.299, 0.587, 0.114)));
+#endif
+		sum += texel * convolveWeights[i];
+	}
+
+	return vec4(sum + CONVOLVE_BIAS, 1.0);
+}
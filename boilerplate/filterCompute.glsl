@@ -0,0 +1,61 @@
+// ==========================================================================
+// Vertex program for barebones GLFW boilerplate
+//
+// Author:  Sonny Chan, University of Calgary
+// Date:    December 2015
+// ==========================================================================
+// 3x3 neighbourhood filters as a compute shader. Each workgroup loads its
+// block of texels plus a halo into shared memory once, instead of every
+// pixel fetching its own neighbourhood, then filters exactly as
+// filterFragment.glsl does. This file is pasted into the compute shaders
+// generated by the effect pipeline, which provide Load() to read a texel of
+// the pass input, Finish() to apply the post stages, and define
+// FILTER_EFFECT and GROUP_SIZE.
+
+#if FILTER_EFFECT == 1
+	// vertical sobel
+	const mat3 F = mat3(vec3(1.0, 0.0, -1.0), vec3(2.0, 0.0, -2.0), vec3(1.0, 0.0, -1.0));
+#elif FILTER_EFFECT == 2
+	// horizontal sobel
+	const mat3 F = mat3(vec3(-1.0, -2.0, -1.0), vec3(0.0, 0.0, 0.0), vec3(1.0, 2.0, 1.0));
+#elif FILTER_EFFECT == 3
+	// unsharp mask
+	const mat3 F = mat3(vec3(0.0, -1.0, 0.0), vec3(-1.0, 5.0, -1.0), vec3(0.0, -1.0, 0.0));
+#endif
+
+layout(local_size_x = GROUP_SIZE, local_size_y = GROUP_SIZE) in;
+layout(rgba8, binding = 0) writeonly uniform image2DRect result;
+
+// the block's texels from two below and left of it to one above and right,
+// and the length of each 2x2 average of them: what the fragment filter's
+// samples at texel corners return. corners[y][x] is the corner below and
+// left of block texel (x - 1, y - 1).
+shared vec3 texels[GROUP_SIZE + 3][GROUP_SIZE + 3];
+shared float corners[GROUP_SIZE + 2][GROUP_SIZE + 2];
+
+void main(void)
+{
+	ivec2 origin = ivec2(gl_WorkGroupID.xy) * GROUP_SIZE;
+	ivec2 local = ivec2(gl_LocalInvocationID.xy);
+
+	for (int y = local.y; y < GROUP_SIZE + 3; y += GROUP_SIZE)
+		for (int x = local.x; x < GROUP_SIZE + 3; x += GROUP_SIZE)
+			texels[y][x] = Load(origin + ivec2(x - 2, y - 2)).rgb;
+	barrier();
+
+	for (int y = local.y; y < GROUP_SIZE + 2; y += GROUP_SIZE)
+		for (int x = local.x; x < GROUP_SIZE + 2; x += GROUP_SIZE)
+			corners[y][x] = length(0.25 * (texels[y][x] + texels[y][x + 1] + texels[y + 1][x] + texels[y + 1][x + 1]));
+	barrier();
+
+	mat3 I;
+	for (int i = 0, k = 2; i < 3; i++, k--)
+		for (int j = 0; j < 3; j++)
+			I[i][j] = corners[local.y + k][local.x + j];
+	float dotprod = dot(F[0], I[0]) + dot(F[1], I[1]) + dot(F[2], I[2]);
+
+	// groups on the right and top edges run past the image
+	ivec2 texel = origin + local;
+	if (all(lessThan(texel, imageSize(result))))
+		imageStore(result, texel, Finish(vec4(0.5 * abs(dotprod))));
+}
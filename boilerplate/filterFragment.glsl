@@ -4,61 +4,35 @@
 // Author:  Sonny Chan, University of Calgary
 // Date:    December 2015
 // ==========================================================================
-#version 410
-
-// interpolated colour received from vertex stage
-in vec2 textureCoords;
-
-// first output is mapped to the framebuffer's colour index by default
-out vec4 FragmentColour;
-
-// our texture to read from
-uniform sampler2DRect tex;
-uniform int filter;
-
-void main(void)
+// 3x3 neighbourhood filters. This file is not a complete shader: it is
+// pasted into the pass shaders generated by the effect pipeline, which
+// provide Sample() to read the pass input and define FILTER_EFFECT.
+
+#if FILTER_EFFECT == 1
+	// vertical sobel
+	const mat3 F = mat3(vec3(1.0, 0.0, -1.0), vec3(2.0, 0.0, -2.0), vec3(1.0, 0.0, -1.0));
+#elif FILTER_EFFECT == 2
+	// horizontal sobel
+	const mat3 F = mat3(vec3(-1.0, -2.0, -1.0), vec3(0.0, 0.0, 0.0), vec3(1.0, 2.0, 1.0));
+#elif FILTER_EFFECT == 3
+	// unsharp mask
+	const mat3 F = mat3(vec3(0.0, -1.0, 0.0), vec3(-1.0, 5.0, -1.0), vec3(0.0, -1.0, 0.0));
+#endif
+
+vec4 Filter(vec2 textureCoords)
 {
-	// Get texture
-	vec4 texColour = texture(tex, textureCoords);
-
-	// Don't bother doing the calculations if not filtering
-	if(filter == 0)
-	{
-		FragmentColour = texColour;
-		return;
-	}
-
 	mat3 I;
-	mat3 F;
-
-	// Fill matrix with selected filter
-	if(filter == 1)
-	{
-		// vertical sobel
-		F[0]=vec3(1.0, 0.0, -1.0);
-		F[1]=vec3(2.0, 0.0, -2.0);
-		F[2]=vec3(1.0, 0.0, -1.0);
-	}
-	else if(filter == 2)
-	{
-	    // horizontal sobel
-		F[0]=vec3(-1.0, -2.0, -1.0);
-		F[1]=vec3(0.0, 0.0, 0.0);
-		F[2]=vec3(1.0, 2.0, 1.0);
-	}
-	else if(filter == 3)
-	{
-		// unsharp mask
-		F[0]=vec3(0.0, -1.0, 0.0);
-		F[1]=vec3(-1.0, 5.0, -1.0);
-		F[2]=vec3(0.0, -1.0, 0.0 );
-	}
 
-	// Create matrix with surrounding textures
+	// Create matrix with surrounding textures; F is constant, so the
+	// compiler drops the samples under zero weights
 	for (int i=0, k=2; i<3; i++, k--)
     {
         for (int j=0; j<3; j++) {
-            vec4 smt = texture( tex, ivec2(textureCoords) + ivec2(j-1,k-1));
+            if (F[i][j] == 0.0) {
+                I[i][j] = 0.0;
+                continue;
+            }
+            vec4 smt = Sample(vec2(ivec2(textureCoords) + ivec2(j-1,k-1)));
             I[i][j] = length(smt.rgb); 
         }
     }
@@ -66,5 +40,5 @@ void main(void)
 	// Calculate the convolution values for the mask
     float dotprod = dot(F[0], I[0]) + dot(F[1], I[1]) + dot(F[2], I[2]);
 
-	FragmentColour = vec4(0.5 * abs(dotprod));
+	return vec4(0.5 * abs(dotprod));
 }
@@ -0,0 +1,101 @@
+// ==========================================================================
+// Vertex program for barebones GLFW boilerplate
+//
+// Author:  Sonny Chan, University of Calgary
+// Date:    December 2015
+// ==========================================================================
+// Contact sheet tiles. Every tile applies its own image's blur, filter and
+// colour effects to the thumbnail, so the effects are picked at run time
+// rather than folded in as constants. Blurs and filters work on thumbnail
+// texels and so only preview what the full image will show. The viewer
+// pastes colourFragment.glsl in front of this file.
+
+in vec2 cellCoords;
+flat in ivec4 effects;
+flat in vec4 shape;
+
+out vec4 FragmentColour;
+
+uniform sampler2DArray thumbnails;
+
+// space around each thumbnail, as a fraction of its cell
+const float MARGIN = 0.04;
+
+// the filters of filterFragment.glsl: vertical and horizontal sobel, and
+// unsharp mask
+const mat3 FILTERS[3] = mat3[](
+	mat3(vec3(1.0, 0.0, -1.0), vec3(2.0, 0.0, -2.0), vec3(1.0, 0.0, -1.0)),
+	mat3(vec3(-1.0, -2.0, -1.0), vec3(0.0, 0.0, 0.0), vec3(1.0, 2.0, 1.0)),
+	mat3(vec3(0.0, -1.0, 0.0), vec3(-1.0, 5.0, -1.0), vec3(0.0, -1.0, 0.0)));
+
+// reads the thumbnail, clamped to the part of the layer it fills
+vec4 Fetch(vec2 coords, vec2 texel)
+{
+	coords = clamp(coords, 0.5 * texel, shape.xy - 0.5 * texel);
+	return texture(thumbnails, vec3(coords, effects.w));
+}
+
+// a Gaussian of up to 5x5 texels
+vec4 Blurred(vec2 coords, vec2 texel)
+{
+	float sigma = shape.z;
+	if (effects.z == 0 || sigma < 0.25)
+		return Fetch(coords, texel);
+
+	int radius = min(int(ceil(2.0 * sigma)), 2);
+	vec4 sum = vec4(0.0);
+	float total = 0.0;
+	for (int y = -radius; y <= radius; y++)
+	{
+		for (int x = -radius; x <= radius; x++)
+		{
+			float weight = exp(-0.5 * float(x * x + y * y) / (sigma * sigma));
+			sum += weight * Fetch(coords + vec2(x, y) * texel, texel);
+			total += weight;
+		}
+	}
+	return sum / total;
+}
+
+vec4 Filtered(vec2 coords, vec2 texel)
+{
+	if (effects.y == 0)
+		return Blurred(coords, texel);
+
+	mat3 F = FILTERS[effects.y - 1];
+	float sum = 0.0;
+	for (int i = 0, k = 2; i < 3; i++, k--)
+		for (int j = 0; j < 3; j++)
+			if (F[i][j] != 0.0)
+				sum += F[i][j] * length(Blurred(coords + vec2(j - 1, k - 1) * texel, texel).rgb);
+	return vec4(0.5 * abs(sum));
+}
+
+void main()
+{
+	// the selected image is framed in its margin
+	vec2 edge = min(cellCoords, 1.0 - cellCoords);
+	vec4 background = shape.w > 0.0 && min(edge.x, edge.y) < 0.5 * MARGIN ? vec4(1.0) : vec4(0.2, 0.2, 0.2, 1.0);
+
+	// a thumbnail not made yet leaves a darker placeholder
+	float fit = max(shape.x, shape.y);
+	vec2 inner = (cellCoords - MARGIN) / (1.0 - 2.0 * MARGIN);
+	if (fit == 0.0)
+	{
+		bool inside = all(greaterThanEqual(inner, vec2(0.0))) && all(lessThanEqual(inner, vec2(1.0)));
+		FragmentColour = inside ? vec4(0.15, 0.15, 0.15, 1.0) : background;
+		return;
+	}
+
+	// fit the thumbnail in the cell, keeping its aspect ratio
+	vec2 size = shape.xy / fit;
+	vec2 coords = (inner - 0.5 * (1.0 - size)) / size;
+	if (any(lessThan(coords, vec2(0.0))) || any(greaterThan(coords, vec2(1.0))))
+	{
+		FragmentColour = background;
+		return;
+	}
+
+	vec2 texel = 1.0 / vec2(textureSize(thumbnails, 0).xy);
+	FragmentColour = ColourEffect(Filtered(coords * shape.xy, texel), effects.x);
+}
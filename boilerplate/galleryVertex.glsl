@@ -0,0 +1,44 @@
+// ==========================================================================
+// Vertex program for barebones GLFW boilerplate
+//
+// Author:  Sonny Chan, University of Calgary
+// Date:    December 2015
+// ==========================================================================
+// Contact sheet tiles, all drawn by one instanced draw of a four vertex
+// strip. Each instance is one cell of the grid, placed from its instance
+// number, and takes its image's effects from the uniform buffer. The
+// program is prefixed with #defines for GALLERY_PAGE_SIZE by the viewer.
+
+struct Tile
+{
+	// colour, filter and blur effect numbers, and the thumbnail's layer
+	ivec4 effects;
+	// part of the layer the thumbnail fills, blur sigma in its texels, and
+	// 1 for the selected image
+	vec4 shape;
+};
+
+layout(std140) uniform Tiles
+{
+	Tile tiles[GALLERY_PAGE_SIZE];
+};
+
+// columns and rows of the grid, filled from the top left
+uniform ivec2 grid;
+
+out vec2 cellCoords;
+flat out ivec4 effects;
+flat out vec4 shape;
+
+void main()
+{
+	vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+	int column = gl_InstanceID % grid.x;
+	int row = gl_InstanceID / grid.x;
+	vec2 cell = 2.0 / vec2(grid);
+	gl_Position = vec4(-1.0 + (column + corner.x) * cell.x, 1.0 - (row + 1.0 - corner.y) * cell.y, 0.0, 1.0);
+
+	cellCoords = corner;
+	effects = tiles[gl_InstanceID].effects;
+	shape = tiles[gl_InstanceID].shape;
+}
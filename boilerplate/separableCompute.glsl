@@ -0,0 +1,52 @@
+// ==========================================================================
+// Vertex program for barebones GLFW boilerplate
+//
+// Author:  Sonny Chan, University of Calgary
+// Date:    December 2015
+// ==========================================================================
+// One axis of a separable blur or convolution as a compute shader. Each
+// workgroup computes a run of LINE_SIZE texels along a row (direction
+// (1, 0)) or column ((0, 1)), loading the run and the kernel's reach on
+// either side into shared memory once so that neighbouring texels share
+// their fetches. This file is pasted into the compute shaders generated by
+// the effect pipeline, which provide Load() to read a texel of the pass
+// input, Finish() to apply the post stages, and define the taps as whole
+// texel offsets along the axis.
+const ivec2 direction = LINE_DIRECTION;
+const float lineWeights[LINE_TAPS] = float[](LINE_WEIGHTS);
+const int lineOffsets[LINE_TAPS] = int[](LINE_OFFSETS);
+
+layout(local_size_x = LINE_SIZE) in;
+layout(rgba8, binding = 0) writeonly uniform image2DRect result;
+
+shared vec4 line[LINE_SIZE + 2 * LINE_RADIUS];
+
+void main(void)
+{
+	// the run starts LINE_SIZE * x texels along the axis, in row or column y
+	ivec2 origin = direction * int(gl_WorkGroupID.x) * LINE_SIZE + direction.yx * int(gl_WorkGroupID.y);
+	int local = int(gl_LocalInvocationID.x);
+
+	for (int i = local; i < LINE_SIZE + 2 * LINE_RADIUS; i += LINE_SIZE)
+	{
+		vec4 texel = Load(origin + direction * (i - LINE_RADIUS));
+#if LINE_LUMINANCE
+		texel.rgb = vec3(dot(texel.rgb, vec3(0.299, 0.587, 0.114)));
+#endif
+		line[i] = texel;
+	}
+	barrier();
+
+	vec4 sum = vec4(0.0);
+	for (int i = 0; i < LINE_TAPS; i++)
+		sum += line[local + LINE_RADIUS + lineOffsets[i]] * lineWeights[i];
+
+	// convolutions are opaque and add their bias; blurs keep the blurred alpha
+#if LINE_CONVOLVE
+	sum = vec4(sum.rgb + LINE_BIAS, 1.0);
+#endif
+
+	ivec2 texel = origin + direction * local;
+	if (all(lessThan(texel, imageSize(result))))
+		imageStore(result, texel, Finish(sum));
+}
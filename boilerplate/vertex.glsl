@@ -16,10 +16,13 @@ layout(location = 2) in vec2 VertexTexture;
 out vec3 Colour;
 out vec2 textureCoords;
 
+// accumulated pan, zoom and rotation of the image
+uniform mat4 modelView;
+
 void main()
 {
     // assign modified vertex position
-    gl_Position = vec4(VertexPosition, 0.0, 1.0);
+    gl_Position = modelView * vec4(VertexPosition, 0.0, 1.0);
 
     // assign output colour/ texture to be interpolated
 	textureCoords = VertexTexture;